@@ -0,0 +1,25 @@
+#pragma once
+
+// Small timing helpers shared by the *_bench.cc benchmarks.
+// Each benchmark times a callable and prints one line per measurement.
+
+#include <chrono>
+#include <cstdio>
+
+// Mean wall time of fn() in nanoseconds over iters calls, after one warm-up call
+template <typename F>
+double time_ns(F&& fn, int iters)
+{
+    fn();
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iters; i++) {
+        fn();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / iters;
+}
+
+inline void report(const char* name, double value, const char* unit)
+{
+    std::printf("%-48s %12.3f %s\n", name, value, unit);
+}
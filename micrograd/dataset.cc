@@ -0,0 +1,391 @@
+// Implementations from dataset.h
+
+#include "dataset.h"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// File format
+// Header, padded to data_offset, then n_samples records of
+// n_features + n_labels floats. Fields are in native byte order.
+struct DatasetHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t float_size;
+    uint32_t n_features;
+    uint32_t n_labels;
+    uint64_t n_samples;
+    uint64_t data_offset;
+};
+
+static constexpr char dataset_magic[8] = { 'M', 'G', 'R', 'D', 'D', 'A', 'T', 'A' };
+static constexpr uint32_t dataset_version = 1;
+static constexpr uint64_t dataset_data_offset = 64;
+
+static_assert(sizeof(DatasetHeader) <= dataset_data_offset, "header must fit before the records");
+
+Dataset Dataset::open(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < dataset_data_offset) {
+        ::close(fd);
+        throw std::runtime_error("not a dataset: " + path);
+    }
+    size_t file_size = st.st_size;
+    void* address = ::mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED) {
+        throw std::runtime_error("cannot map " + path);
+    }
+    std::shared_ptr<void> mapping(address, [file_size](void* address) { ::munmap(address, file_size); });
+
+    DatasetHeader header;
+    std::memcpy(&header, address, sizeof(header));
+    if (std::memcmp(header.magic, dataset_magic, sizeof(header.magic)) != 0) {
+        throw std::runtime_error("not a dataset: " + path);
+    }
+    if (header.version != dataset_version || header.float_size != sizeof(float)) {
+        throw std::runtime_error("unsupported dataset version in " + path);
+    }
+    if (header.n_features == 0 || header.data_offset != dataset_data_offset) {
+        throw std::runtime_error("corrupt dataset header in " + path);
+    }
+    uint64_t record_size = (static_cast<uint64_t>(header.n_features) + header.n_labels) * sizeof(float);
+    if (header.n_samples > (file_size - header.data_offset) / record_size) {
+        throw std::runtime_error("truncated dataset " + path);
+    }
+
+    Dataset dataset;
+    dataset.mapping = std::move(mapping);
+    dataset.records = reinterpret_cast<const float*>(static_cast<const char*>(address) + header.data_offset);
+    dataset.n_samples = header.n_samples;
+    dataset.n_features = header.n_features;
+    dataset.n_labels = header.n_labels;
+    return dataset;
+}
+
+void Dataset::advise(bool sequential) const
+{
+    if (!mapping) {
+        return;
+    }
+    // the mapping starts at the header, page aligned
+    size_t bytes = dataset_data_offset + n_samples * (n_features + n_labels) * sizeof(float);
+    ::madvise(mapping.get(), bytes, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+}
+
+// Writing
+DatasetWriter::DatasetWriter(const std::string& path, int n_features, int n_labels)
+    : path(path), n_features(n_features), n_labels(n_labels)
+{
+    if (n_features < 1 || n_labels < 0) {
+        throw std::invalid_argument("a dataset needs at least one feature");
+    }
+    file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        throw std::runtime_error("cannot open " + path + " for writing");
+    }
+    std::setvbuf(file, nullptr, _IOFBF, 1 << 20);
+    // placeholder header, rewritten by close
+    char head[dataset_data_offset] = {};
+    std::fwrite(head, 1, sizeof(head), file);
+}
+
+DatasetWriter::~DatasetWriter()
+{
+    if (file) {
+        try {
+            close();
+        } catch (const std::runtime_error&) {
+        }
+    }
+}
+
+void DatasetWriter::add(const float* features, const float* labels)
+{
+    std::fwrite(features, sizeof(float), n_features, file);
+    std::fwrite(labels, sizeof(float), n_labels, file);
+    n_samples++;
+}
+
+void DatasetWriter::close()
+{
+    if (!file) {
+        return;
+    }
+    DatasetHeader header = {};
+    std::memcpy(header.magic, dataset_magic, sizeof(header.magic));
+    header.version = dataset_version;
+    header.float_size = sizeof(float);
+    header.n_features = n_features;
+    header.n_labels = n_labels;
+    header.n_samples = n_samples;
+    header.data_offset = dataset_data_offset;
+
+    bool ok = !std::ferror(file) && std::fseek(file, 0, SEEK_SET) == 0
+        && std::fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = std::fclose(file) == 0 && ok;
+    file = nullptr;
+    if (!ok) {
+        throw std::runtime_error("cannot write dataset " + path);
+    }
+}
+
+// CSV
+// Parses the fields of one line; false if a field is not a number
+static bool parse_csv_line(const std::string& line, char delimiter, std::vector<float>& fields)
+{
+    fields.clear();
+    const char* p = line.data();
+    const char* end = p + line.size();
+    while (end > p && (end[-1] == '\r' || end[-1] == ' ')) {
+        end--;
+    }
+    while (true) {
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p < end && *p == '+') {
+            p++;
+        }
+        float value;
+        std::from_chars_result result = std::from_chars(p, end, value);
+        if (result.ec != std::errc()) {
+            return false;
+        }
+        fields.push_back(value);
+        p = result.ptr;
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p == end) {
+            return true;
+        }
+        if (*p++ != delimiter) {
+            return false;
+        }
+    }
+}
+
+// Streams the samples of csv to a dataset file at path
+static size_t write_csv_samples(std::istream& csv, const std::string& csv_path, const std::string& path,
+                                int n_labels, char delimiter)
+{
+    std::unique_ptr<DatasetWriter> writer;
+    std::string line;
+    std::vector<float> fields;
+    size_t n_fields = 0;
+    for (size_t line_number = 1; std::getline(csv, line); line_number++) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        bool parsed = parse_csv_line(line, delimiter, fields);
+        if (!writer) {
+            if (!parsed) {
+                if (line_number == 1) {
+                    continue;
+                }
+                throw std::runtime_error(csv_path + ":" + std::to_string(line_number) + ": not a number");
+            }
+            if (fields.size() <= static_cast<size_t>(n_labels)) {
+                throw std::runtime_error(csv_path + ": " + std::to_string(fields.size()) + " columns for "
+                                         + std::to_string(n_labels) + " labels");
+            }
+            n_fields = fields.size();
+            writer = std::make_unique<DatasetWriter>(path, n_fields - n_labels, n_labels);
+        }
+        if (!parsed) {
+            throw std::runtime_error(csv_path + ":" + std::to_string(line_number) + ": not a number");
+        }
+        if (fields.size() != n_fields) {
+            throw std::runtime_error(csv_path + ":" + std::to_string(line_number) + ": expected "
+                                     + std::to_string(n_fields) + " columns");
+        }
+        writer->add(fields.data(), fields.data() + n_fields - n_labels);
+    }
+    if (csv.bad()) {
+        throw std::runtime_error("cannot read " + csv_path);
+    }
+    if (!writer) {
+        throw std::runtime_error("no samples in " + csv_path);
+    }
+    writer->close();
+    return writer->size();
+}
+
+size_t Dataset::convert_csv(const std::string& csv_path, const std::string& path, int n_labels, char delimiter)
+{
+    std::ifstream csv(csv_path);
+    if (!csv) {
+        throw std::runtime_error("cannot open " + csv_path);
+    }
+    // written next to path and renamed when complete, so a failed conversion
+    // never leaves a dataset that looks valid
+    std::string partial_path = path + ".partial";
+    size_t n_samples;
+    try {
+        n_samples = write_csv_samples(csv, csv_path, partial_path, n_labels, delimiter);
+    } catch (...) {
+        std::remove(partial_path.c_str());
+        throw;
+    }
+    if (std::rename(partial_path.c_str(), path.c_str()) != 0) {
+        std::remove(partial_path.c_str());
+        throw std::runtime_error("cannot write dataset " + path);
+    }
+    return n_samples;
+}
+
+Dataset Dataset::open_csv(const std::string& csv_path, const std::string& cache_path, int n_labels,
+                          char delimiter)
+{
+    struct stat csv_st, cache_st;
+    if (::stat(csv_path.c_str(), &csv_st) != 0) {
+        throw std::runtime_error("cannot open " + csv_path);
+    }
+    if (::stat(cache_path.c_str(), &cache_st) == 0 && cache_st.st_mtime >= csv_st.st_mtime) {
+        Dataset cached = open(cache_path);
+        if (cached.n_labels == n_labels) {
+            return cached;
+        }
+    }
+    convert_csv(csv_path, cache_path, n_labels, delimiter);
+    return open(cache_path);
+}
+
+// Minibatches
+BatchLoader::BatchLoader(const Dataset& dataset, LoaderOptions options)
+    : dataset(dataset), options(options)
+{
+    if (dataset.size() == 0 || options.batch_size < 1) {
+        throw std::invalid_argument("a loader needs samples and a batch size of at least 1");
+    }
+    n_batches = options.drop_last ? dataset.size() / options.batch_size
+                                  : (dataset.size() + options.batch_size - 1) / options.batch_size;
+    if (n_batches == 0) {
+        throw std::invalid_argument("batch size larger than the dataset with drop_last");
+    }
+    dataset.advise(!options.shuffle);
+    prefetcher = std::thread([this]() { prefetch_loop(); });
+}
+
+BatchLoader::~BatchLoader()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    prefetcher.join();
+}
+
+void BatchLoader::fill(Batch& batch, const std::vector<size_t>& order, size_t begin, size_t count,
+                       size_t epoch) const
+{
+    int n_features = dataset.get_n_features();
+    int n_labels = dataset.get_n_labels();
+    batch.inputs.resize(static_cast<int>(count), n_features);
+    batch.targets.resize(static_cast<int>(count), n_labels);
+    batch.epoch = epoch;
+    for (size_t r = 0; r < count; r++) {
+        size_t i = order[begin + r];
+        std::memcpy(batch.inputs.row(r), dataset.features(i), n_features * sizeof(float));
+        std::memcpy(batch.targets.row(r), dataset.labels(i), n_labels * sizeof(float));
+    }
+}
+
+void BatchLoader::prefetch_loop()
+{
+    std::vector<size_t> order(dataset.size());
+    std::iota(order.begin(), order.end(), size_t{0});
+    int slot = 0;
+    for (size_t epoch = 0;; epoch++) {
+        if (options.shuffle) {
+            // Fisher-Yates from a generator seeded by seed and epoch, so a run is reproducible
+            std::mt19937_64 rng(options.seed + epoch * 0x9e3779b97f4a7c15ull);
+            for (size_t i = order.size() - 1; i > 0; i--) {
+                std::uniform_int_distribution<size_t> pick(0, i);
+                std::swap(order[i], order[pick(rng)]);
+            }
+        }
+        for (size_t b = 0; b < n_batches; b++) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]() { return stopping || slots[slot] == Slot::Free; });
+                if (stopping) {
+                    return;
+                }
+            }
+            size_t begin = b * options.batch_size;
+            fill(batches[slot], order, begin, std::min<size_t>(options.batch_size, order.size() - begin), epoch);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slots[slot] = Slot::Ready;
+            }
+            changed.notify_all();
+            slot ^= 1;
+        }
+    }
+}
+
+// Waits for the next ready slot and marks it in use; -1 at the end of the epoch
+int BatchLoader::take_slot(std::unique_lock<std::mutex>& lock)
+{
+    if (held >= 0) {
+        slots[held] = Slot::Free;
+        held = -1;
+        changed.notify_all();
+    }
+    if (batch_in_epoch == n_batches) {
+        batch_in_epoch = 0;
+        return -1;
+    }
+    if (slots[next_slot] != Slot::Ready) {
+        auto start = std::chrono::steady_clock::now();
+        changed.wait(lock, [&]() { return slots[next_slot] == Slot::Ready; });
+        wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start)
+                       .count();
+    }
+    int slot = next_slot;
+    slots[slot] = Slot::InUse;
+    next_slot ^= 1;
+    batch_in_epoch++;
+    return slot;
+}
+
+const Batch* BatchLoader::next()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    held = take_slot(lock);
+    return held >= 0 ? &batches[held] : nullptr;
+}
+
+bool BatchLoader::next(Batch& batch)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    int slot = take_slot(lock);
+    if (slot < 0) {
+        return false;
+    }
+    // the caller's buffers go back to the prefetch thread to be refilled
+    std::swap(batch, batches[slot]);
+    slots[slot] = Slot::Free;
+    changed.notify_all();
+    return true;
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+// Datasets for the batched training path. A dataset is a binary file of
+// fixed-size float records, each sample's features followed by its labels,
+// behind a small header. The file is memory-mapped, never read into memory,
+// so it can be larger than RAM; CSV files are converted to it once.
+//
+// BatchLoader turns a dataset into minibatches as Matrix pairs (one sample
+// per row) for MLP::forward / MLP::train_batch. A background thread gathers
+// the next batch into the second of two buffers while the caller trains on
+// the first.
+
+#include "engine.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Dataset
+{
+private:
+    std::shared_ptr<void> mapping;
+    const float* records = nullptr;
+    size_t n_samples = 0;
+    int n_features = 0;
+    int n_labels = 0;
+
+public:
+    Dataset() = default;
+
+    // Map a dataset file; std::runtime_error if it cannot be opened or is
+    // not a (complete) dataset
+    static Dataset open(const std::string& path);
+
+    // Convert a CSV file, one sample per line with the labels in the last
+    // n_labels columns, to a dataset file. The CSV is streamed, a header line
+    // (first field not a number) is skipped. Returns the number of samples;
+    // std::runtime_error on unreadable files or malformed lines.
+    static size_t convert_csv(const std::string& csv_path, const std::string& path, int n_labels,
+                              char delimiter = ',');
+    // Map the dataset at cache_path, converting csv_path first if the cache is
+    // missing or older than the CSV
+    static Dataset open_csv(const std::string& csv_path, const std::string& cache_path, int n_labels,
+                            char delimiter = ',');
+
+    size_t size() const { return n_samples; }
+    int get_n_features() const { return n_features; }
+    int get_n_labels() const { return n_labels; }
+
+    // Record i: n_features features then n_labels labels
+    const float* features(size_t i) const { return records + i * (n_features + n_labels); }
+    const float* labels(size_t i) const { return features(i) + n_features; }
+
+    // Readahead hint for the mapping: off for shuffled access, where it only
+    // pulls in pages of samples that are not needed yet
+    void advise(bool sequential) const;
+};
+
+// Writes a dataset file record by record, so data larger than RAM can be
+// produced in one pass. The sample count in the header is filled in by close.
+class DatasetWriter
+{
+private:
+    std::string path;
+    std::FILE* file = nullptr;
+    int n_features;
+    int n_labels;
+    size_t n_samples = 0;
+
+public:
+    // std::invalid_argument for non-positive sizes, std::runtime_error if
+    // the file cannot be created
+    DatasetWriter(const std::string& path, int n_features, int n_labels);
+    // Closes the file if close was not called; errors are lost then
+    ~DatasetWriter();
+    DatasetWriter(const DatasetWriter&) = delete;
+    DatasetWriter& operator=(const DatasetWriter&) = delete;
+
+    void add(const float* features, const float* labels);
+    size_t size() const { return n_samples; }
+    // Finish the header and close; std::runtime_error if anything failed to write
+    void close();
+};
+
+struct LoaderOptions {
+    int batch_size = 32;
+    // New random order of the samples every epoch, from seed and the epoch
+    bool shuffle = true;
+    uint64_t seed = 0;
+    // Skip the last batch of an epoch when it is not full
+    bool drop_last = false;
+};
+
+// Inputs and targets of one minibatch, one sample per row
+struct Batch {
+    Matrix inputs;
+    Matrix targets;
+    size_t epoch = 0;
+};
+
+class BatchLoader
+{
+private:
+    const Dataset& dataset;
+    LoaderOptions options;
+    size_t n_batches;
+
+    // Two buffers: the prefetch thread fills one while the caller holds the other
+    enum class Slot : uint8_t { Free, Ready, InUse };
+    Batch batches[2];
+    Slot slots[2] = { Slot::Free, Slot::Free };
+    int next_slot = 0;
+    int held = -1;
+    size_t batch_in_epoch = 0;
+    uint64_t wait_ns = 0;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool stopping = false;
+    std::thread prefetcher;
+
+    void prefetch_loop();
+    void fill(Batch& batch, const std::vector<size_t>& order, size_t begin, size_t count, size_t epoch) const;
+    int take_slot(std::unique_lock<std::mutex>& lock);
+
+public:
+    // The dataset must outlive the loader; std::invalid_argument for an empty
+    // dataset or a batch size below 1
+    BatchLoader(const Dataset& dataset, LoaderOptions options);
+    ~BatchLoader();
+    BatchLoader(const BatchLoader&) = delete;
+    BatchLoader& operator=(const BatchLoader&) = delete;
+
+    // Next minibatch, valid until the following call; nullptr once at the end
+    // of every epoch, after which the next epoch starts
+    const Batch* next();
+    // Same, swapping the minibatch into batch instead of lending it: batch's
+    // old buffers go back to the loader to be refilled, so nothing is copied
+    // and the caller can keep the batch as long as it likes. false at the end
+    // of every epoch.
+    bool next(Batch& batch);
+
+    size_t batches_per_epoch() const { return n_batches; }
+    // Time next() spent waiting for the prefetch thread; near zero when the
+    // loader keeps up with training
+    uint64_t get_wait_ns() const { return wait_ns; }
+};
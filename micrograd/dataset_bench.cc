@@ -0,0 +1,174 @@
+// Benchmarks for micrograd/dataset.h
+//
+// csv conversion: MB/s of CSV text turned into a dataset file.
+// loader: samples/sec out of BatchLoader, sequential and shuffled, with
+// nothing consuming the batches.
+// training: one train_batch + SGD step per batch from the loader, next to the
+// same steps on a batch that is already in memory, how long training
+// waited for the prefetch thread, and the same epochs through the pipelined
+// Trainer with its per-stage utilization.
+// pipeline: the serial loop against the Trainer when the source and the hook
+// wait on I/O (simulated with a sleep), the latency the pipeline hides.
+
+#include "dataset.h"
+#include "nn.h"
+#include "trainer.h"
+#include "bench.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const std::string bench_path = "/tmp/micrograd_bench_dataset.bin";
+static const std::string bench_csv_path = "/tmp/micrograd_bench_dataset.csv";
+
+static void write_dataset(size_t n_samples, int n_features, int n_labels)
+{
+    DatasetWriter writer(bench_path, n_features, n_labels);
+    std::vector<float> x(n_features), y(n_labels);
+    for (size_t i = 0; i < n_samples; i++) {
+        for (int c = 0; c < n_features; c++) {
+            x[c] = std::sin(0.001f * i + c);
+        }
+        for (int c = 0; c < n_labels; c++) {
+            y[c] = std::cos(0.002f * i + c);
+        }
+        writer.add(x.data(), y.data());
+    }
+}
+
+void bench_csv_conversion(size_t n_samples, int n_features)
+{
+    {
+        std::ofstream csv(bench_csv_path);
+        for (size_t i = 0; i < n_samples; i++) {
+            for (int c = 0; c < n_features; c++) {
+                csv << std::sin(0.001f * i + c) << ",";
+            }
+            csv << (i % 10) << "\n";
+        }
+    }
+    std::ifstream csv(bench_csv_path, std::ios::ate);
+    double megabytes = static_cast<double>(csv.tellg()) / 1e6;
+    std::printf("csv conversion, %zu samples x %d features, %.1f MB\n", n_samples, n_features, megabytes);
+    double ns = time_ns([&]() { Dataset::convert_csv(bench_csv_path, bench_path, 1); }, 3);
+    report("  convert", megabytes / (ns / 1e9), "MB/s");
+    std::remove(bench_csv_path.c_str());
+    std::remove(bench_path.c_str());
+}
+
+void bench_loader(size_t n_samples, int n_features, int batch_size)
+{
+    write_dataset(n_samples, n_features, 10);
+    Dataset dataset = Dataset::open(bench_path);
+    std::printf("loader, %zu samples x %d features, batch %d\n", n_samples, n_features, batch_size);
+    for (bool shuffle : { false, true }) {
+        LoaderOptions options;
+        options.batch_size = batch_size;
+        options.shuffle = shuffle;
+        BatchLoader loader(dataset, options);
+        double ns = time_ns([&]() {
+            while (loader.next()) {
+            }
+        }, 3);
+        report(shuffle ? "  shuffled" : "  sequential", n_samples / (ns / 1e9), "samples/s");
+    }
+    std::remove(bench_path.c_str());
+}
+
+void bench_training(size_t n_samples, int n_inputs, std::vector<int> sizes, int batch_size)
+{
+    write_dataset(n_samples, n_inputs, sizes.back());
+    Dataset dataset = Dataset::open(bench_path);
+    MLP mlp(n_inputs, sizes, Init::He, 1);
+    SGD optimizer(mlp.get_parameters(), 1e-3);
+    ThreadPool pool;
+    std::printf("training from the loader, %zu samples, batch %d\n", n_samples, batch_size);
+
+    LoaderOptions options;
+    options.batch_size = batch_size;
+    options.drop_last = true;
+    BatchLoader loader(dataset, options);
+    size_t n_batches = loader.batches_per_epoch();
+    double loader_ns = time_ns([&]() {
+        while (const Batch* batch = loader.next()) {
+            mlp.train_batch(batch->inputs, batch->targets, pool);
+            optimizer.step();
+        }
+    }, 3);
+    report("  step, batches from the loader", loader_ns / n_batches / 1e3, "us");
+
+    Matrix inputs(batch_size, n_inputs, 0.5f), targets(batch_size, sizes.back(), 0.5f);
+    double memory_ns = time_ns([&]() {
+        mlp.train_batch(inputs, targets, pool);
+        optimizer.step();
+    }, static_cast<int>(n_batches));
+    report("  step, batch in memory", memory_ns / 1e3, "us");
+    report("  waited on the loader", loader.get_wait_ns() / 4.0 / n_batches / 1e3, "us/step");
+
+    Trainer trainer(mlp, optimizer, pool);
+    double trainer_ns = time_ns([&]() { trainer.run(loader, 1); }, 3);
+    report("  step, pipelined Trainer", trainer_ns / n_batches / 1e3, "us");
+    const TrainerStats& stats = trainer.get_stats();
+    for (size_t s = 0; s < static_cast<size_t>(Stage::Count); s++) {
+        char name[64];
+        std::snprintf(name, sizeof(name), "    %s utilization", stage_name(static_cast<Stage>(s)));
+        report(name, 100.0 * stats.utilization(static_cast<Stage>(s)), "%");
+    }
+    std::remove(bench_path.c_str());
+}
+
+void bench_pipeline(int n_steps, int n_inputs, std::vector<int> sizes, int batch_size, int source_us, int hook_us)
+{
+    MLP mlp(n_inputs, sizes, Init::He, 1);
+    SGD optimizer(mlp.get_parameters(), 1e-3);
+    ThreadPool pool;
+    std::printf("pipeline, batch %d, source waits %d us, hook %d us per step\n", batch_size, source_us, hook_us);
+    int step = 0;
+    auto source = [&](Batch& batch) {
+        if (step == n_steps) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(source_us));
+        batch.inputs.resize(batch_size, n_inputs);
+        batch.targets.resize(batch_size, sizes.back());
+        batch.inputs.fill(0.01f * (step % 7));
+        batch.targets.fill(0.5f);
+        step++;
+        return true;
+    };
+    auto hook = [&](const StepInfo&) { std::this_thread::sleep_for(std::chrono::microseconds(hook_us)); };
+
+    Batch batch;
+    double serial_ns = time_ns([&]() {
+        step = 0;
+        while (source(batch)) {
+            float loss = mlp.train_batch(batch.inputs, batch.targets, pool);
+            optimizer.step();
+            hook(StepInfo{static_cast<size_t>(step), 0, batch_size, loss});
+        }
+    }, 3);
+    report("  step, serial loop", serial_ns / n_steps / 1e3, "us");
+
+    Trainer trainer(mlp, optimizer, pool);
+    trainer.set_hook(hook);
+    double trainer_ns = time_ns([&]() {
+        step = 0;
+        trainer.run(source);
+    }, 3);
+    report("  step, pipelined Trainer", trainer_ns / n_steps / 1e3, "us");
+    report("  speedup", serial_ns / trainer_ns, "x");
+}
+
+int main()
+{
+    bench_csv_conversion(20000, 64);
+    bench_loader(100000, 784, 64);
+    bench_training(20000, 784, { 128, 10 }, 64);
+    bench_pipeline(200, 784, { 128, 10 }, 64, 0, 0);
+    bench_pipeline(200, 784, { 128, 10 }, 64, 500, 200);
+}
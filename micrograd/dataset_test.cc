@@ -0,0 +1,205 @@
+// Testing micrograd/dataset.h implementation
+//
+#include <assert.h>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "dataset.h"
+#include "nn.h"
+
+static const std::string dataset_path = "/tmp/micrograd_dataset_test.bin";
+static const std::string csv_path = "/tmp/micrograd_dataset_test.csv";
+
+// n samples with features i, i + 0.5, i + 0.25 and label -i
+static void write_samples(size_t n)
+{
+    DatasetWriter writer(dataset_path, 3, 1);
+    for (size_t i = 0; i < n; i++) {
+        float x[3] = { float(i), i + 0.5f, i + 0.25f };
+        float y = -float(i);
+        writer.add(x, &y);
+    }
+    writer.close();
+}
+
+void test_write_and_map()
+{
+    write_samples(100);
+    Dataset dataset = Dataset::open(dataset_path);
+    assert(dataset.size() == 100);
+    assert(dataset.get_n_features() == 3);
+    assert(dataset.get_n_labels() == 1);
+    for (size_t i = 0; i < 100; i++) {
+        assert(dataset.features(i)[0] == float(i));
+        assert(dataset.features(i)[2] == i + 0.25f);
+        assert(dataset.labels(i)[0] == -float(i));
+    }
+
+    // Truncated file and garbage are refused
+    {
+        std::ofstream out(dataset_path, std::ios::binary | std::ios::in);
+        out.seekp(0);
+        out << "garbage!";
+    }
+    bool threw = false;
+    try {
+        Dataset::open(dataset_path);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    std::remove(dataset_path.c_str());
+}
+
+void test_csv()
+{
+    {
+        std::ofstream csv(csv_path);
+        csv << "a,b,label\n1, 2.5 ,0\r\n\n-3e2,+4,1\n0.125,-0,2\n";
+    }
+    std::remove(dataset_path.c_str());
+    Dataset dataset = Dataset::open_csv(csv_path, dataset_path, 1);
+    assert(dataset.size() == 3);
+    assert(dataset.get_n_features() == 2);
+    assert(dataset.features(0)[1] == 2.5f);
+    assert(dataset.features(1)[0] == -300.0f && dataset.features(1)[1] == 4.0f);
+    assert(dataset.labels(2)[0] == 2.0f);
+    // The cache is newer than the CSV now and is mapped as it is
+    Dataset cached = Dataset::open_csv(csv_path, dataset_path, 1);
+    assert(cached.size() == 3 && cached.features(2)[0] == 0.125f);
+
+    // Malformed lines name the line and leave no dataset behind
+    {
+        std::ofstream csv(csv_path);
+        csv << "1,2,3\n4,5\n";
+    }
+    std::remove(dataset_path.c_str());
+    bool threw = false;
+    try {
+        Dataset::convert_csv(csv_path, dataset_path, 1);
+    } catch (const std::runtime_error& e) {
+        threw = std::string(e.what()).find(":2:") != std::string::npos;
+    }
+    assert(threw);
+    assert(!std::ifstream(dataset_path) && !std::ifstream(dataset_path + ".partial"));
+    std::remove(csv_path.c_str());
+}
+
+void test_loader_epochs()
+{
+    write_samples(103);
+    Dataset dataset = Dataset::open(dataset_path);
+    for (bool shuffle : { false, true }) {
+        LoaderOptions options;
+        options.batch_size = 10;
+        options.shuffle = shuffle;
+        options.seed = 5;
+        BatchLoader loader(dataset, options);
+        assert(loader.batches_per_epoch() == 11);
+        std::vector<std::vector<int>> orders;
+        for (size_t epoch = 0; epoch < 3; epoch++) {
+            std::vector<int> seen(103, 0);
+            std::vector<int> order;
+            size_t n_batches = 0;
+            while (const Batch* batch = loader.next()) {
+                assert(batch->epoch == epoch);
+                assert(batch->inputs.get_rows() == (n_batches < 10 ? 10 : 3));
+                for (int r = 0; r < batch->inputs.get_rows(); r++) {
+                    int i = static_cast<int>(batch->inputs(r, 0));
+                    assert(batch->inputs(r, 1) == i + 0.5f);
+                    assert(batch->targets(r, 0) == -float(i));
+                    seen[i]++;
+                    order.push_back(i);
+                }
+                n_batches++;
+            }
+            assert(n_batches == 11);
+            for (int count : seen) {
+                assert(count == 1);
+            }
+            orders.push_back(order);
+        }
+        // Sequential epochs repeat, shuffled ones differ
+        assert((orders[0] == orders[1]) == !shuffle);
+    }
+
+    // Same seed, same order; drop_last skips the short batch
+    LoaderOptions options;
+    options.batch_size = 10;
+    options.drop_last = true;
+    BatchLoader a(dataset, options), b(dataset, options);
+    assert(a.batches_per_epoch() == 10);
+    for (int i = 0; i < 10; i++) {
+        const Batch* x = a.next();
+        const Batch* y = b.next();
+        assert(x->inputs.get_rows() == 10);
+        for (int r = 0; r < 10; r++) {
+            assert(x->inputs(r, 0) == y->inputs(r, 0));
+        }
+    }
+    assert(a.next() == nullptr);
+
+    // Swapping batches out gives the same sequence, with the caller's
+    // buffers going back to the loader
+    BatchLoader c(dataset, options), d(dataset, options);
+    Batch kept;
+    for (int i = 0; i < 10; i++) {
+        const Batch* x = d.next();
+        assert(c.next(kept) && kept.inputs.get_rows() == 10 && kept.epoch == 0);
+        for (int r = 0; r < 10; r++) {
+            assert(kept.inputs(r, 0) == x->inputs(r, 0) && kept.targets(r, 0) == x->targets(r, 0));
+        }
+    }
+    assert(!c.next(kept) && d.next() == nullptr);
+    assert(c.next(kept) && kept.epoch == 1);
+
+    // Stopping in the middle of an epoch
+    {
+        BatchLoader partial(dataset, options);
+        partial.next();
+    }
+    std::remove(dataset_path.c_str());
+}
+
+void test_loader_trains()
+{
+    // Learn y = x0 - x1 from a mapped dataset
+    {
+        DatasetWriter writer(dataset_path, 2, 1);
+        for (int i = 0; i < 256; i++) {
+            float x[2] = { std::sin(0.3f * i) * 0.5f, std::cos(0.7f * i) * 0.5f };
+            float y = x[0] - x[1];
+            writer.add(x, &y);
+        }
+    }
+    Dataset dataset = Dataset::open(dataset_path);
+    LoaderOptions options;
+    options.batch_size = 32;
+    BatchLoader loader(dataset, options);
+    MLP mlp(2, { 8, 1 }, Init::Xavier, 3);
+    SGD optimizer(mlp.get_parameters(), 0.02);
+    ThreadPool pool(2);
+    float first = 0.0f, last = 0.0f;
+    for (int epoch = 0; epoch < 40; epoch++) {
+        float loss = 0.0f;
+        while (const Batch* batch = loader.next()) {
+            loss += mlp.train_batch(batch->inputs, batch->targets, pool);
+            optimizer.step();
+        }
+        (epoch == 0 ? first : last) = loss;
+    }
+    assert(last < first / 4);
+    std::remove(dataset_path.c_str());
+}
+
+int main()
+{
+    test_write_and_map();
+    test_csv();
+    test_loader_epochs();
+    test_loader_trains();
+}
@@ -2,175 +2,917 @@
 // python implementation.
 
 #include "engine.h"
+#include "kernels.h"
+#include "profiler.h"
 
-// Constructor & Destructor
-Value::Value(float data, std::vector<Value*> children, std::string op, std::string label)
-    : data(data), children(children), op(op), label(label) { grad = 0.0; }
-Value::Value(float data, std::string label) : data(data), label(label) {
-    children = std::vector<Value*>();
-    op = "";
-    grad = 0.0;
+#include <algorithm>
+#include <stdexcept>
+
+
+// Op names, used for printing and drawing
+const char* op_name(Op op)
+{
+    static const char* names[] = {
+        "", "", "+", "-", "*", "/", "-", "pow", "exp", "log", "tanh", "relu", "sigmoid",
+        "cross_entropy", "mse", "hinge", "softmax_ce", "dot", "dot+tanh"
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == static_cast<size_t>(Op::Count),
+                  "every op needs a name");
+    return names[static_cast<size_t>(op)];
+}
+
+int op_arity(Op op)
+{
+    // n-ary ops have their children in a side array, fused ops in the program
+    static const int arity[] = { 0, 0, 2, 2, 2, 2, 1, 2, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0 };
+    static_assert(sizeof(arity) / sizeof(arity[0]) == static_cast<size_t>(Op::Count),
+                  "every op needs an arity");
+    return arity[static_cast<size_t>(op)];
+}
+
+bool op_is_nary(Op op)
+{
+    return op == Op::CrossEntropy || op == Op::MseLoss || op == Op::HingeLoss || op == Op::SoftmaxLoss;
+}
+
+// Tape
+Tape& Tape::current()
+{
+    thread_local Tape tape;
+    return tape;
+}
+
+uint32_t Tape::push(float data, Op op, uint32_t lhs, uint32_t rhs)
+{
+    MICROGRAD_PROFILE_NODE(op);
+    nodes.push_back(Node{data, 0.0f, {lhs, rhs}, 0, op});
+    return static_cast<uint32_t>(nodes.size() - 1);
+}
+
+uint32_t Tape::push_nary(float data, Op op, std::span<const uint32_t> children,
+                         std::span<const float> saved, uint32_t extra)
+{
+    uint32_t first = static_cast<uint32_t>(operands.size());
+    uint32_t id = push(data, op, first, static_cast<uint32_t>(children.size()));
+    nary.push_back(Nary{id, first});
+    operands.insert(operands.end(), children.begin(), children.end());
+    operands.push_back(extra);
+    this->saved.insert(this->saved.end(), saved.begin(), saved.end());
+    this->saved.push_back(0.0f);
+    return id;
+}
+
+std::span<const uint32_t> Tape::get_children(uint32_t id) const
+{
+    const Node& n = nodes[id];
+    if (op_is_nary(n.op)) {
+        return get_operands(n);
+    }
+    return {n.children, static_cast<size_t>(op_arity(n.op))};
+}
+
+void Tape::rewind(size_t mark)
+{
+    // Node is trivially destructible, shrinking only moves the end pointer
+    nodes.resize(mark);
+    while (!bindings.empty() && bindings.back().first >= mark) {
+        bindings.pop_back();
+    }
+    while (!nary.empty() && nary.back().id >= mark) {
+        operands.resize(nary.back().first);
+        saved.resize(nary.back().first);
+        nary.pop_back();
+    }
+    if (!labels.empty()) {
+        for (auto it = labels.begin(); it != labels.end();) {
+            if (it->first >= mark) {
+                it = labels.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+void Tape::set_label(uint32_t id, const std::string& label)
+{
+    if (label == "") {
+        labels.erase(id);
+    } else {
+        labels[id] = label;
+    }
 }
 
-Value::~Value() {
-    // std::cout << "Value destructor called" << std::endl;
+std::string Tape::get_label(uint32_t id) const
+{
+    auto it = labels.find(id);
+    return it == labels.end() ? "" : it->second;
+}
+
+size_t Tape::get_bytes() const
+{
+    return nodes.capacity() * sizeof(Node) + operands.capacity() * sizeof(uint32_t)
+         + saved.capacity() * sizeof(float) + nary.capacity() * sizeof(Nary) + order.capacity() * sizeof(uint32_t);
+}
+
+uint32_t Tape::bind(const float* data, float* grad, size_t n, std::weak_ptr<void> owner)
+{
+    MICROGRAD_PROFILE_NODES(Op::Leaf, n);
+    uint32_t first = static_cast<uint32_t>(nodes.size());
+    for (size_t i = 0; i < n; i++) {
+        nodes.push_back(Node{data[i], 0.0f, {npos, npos}, 0, Op::Leaf});
+    }
+    // the owner is alive here whenever one was given
+    bool owned = !owner.expired();
+    bindings.push_back(Binding{first, static_cast<uint32_t>(n), grad, std::move(owner), owned});
+    return first;
+}
+
+void Tape::flush_bindings(std::span<const uint32_t> order)
+{
+    if (bindings.empty()) {
+        return;
+    }
+    // Bindings are in node order; find the one holding each reached leaf
+    reached.assign(bindings.size(), 0);
+    for (uint32_t id : order) {
+        if (nodes[id].op != Op::Leaf || id < bindings.front().first) {
+            continue;
+        }
+        auto it = std::upper_bound(bindings.begin(), bindings.end(), id,
+                                   [](uint32_t id, const Binding& b) { return id < b.first; }) - 1;
+        if (id < it->first + it->size) {
+            reached[it - bindings.begin()] = 1;
+        }
+    }
+    for (size_t i = 0; i < bindings.size(); i++) {
+        if (!reached[i]) {
+            continue;
+        }
+        const Binding& b = bindings[i];
+        Node* n = nodes.data() + b.first;
+        // keeps the owner alive while its grads are written
+        std::shared_ptr<void> owner = b.owner.lock();
+        if (b.owned && !owner) {
+            for (uint32_t j = 0; j < b.size; j++) {
+                n[j].grad = 0.0f;
+            }
+            continue;
+        }
+        for (uint32_t j = 0; j < b.size; j++) {
+            b.grad[j] += n[j].grad;
+            n[j].grad = 0.0f;
+        }
+    }
+}
+
+// Backward kernels, one per op
+static void backward_leaf(Tape&, const Node&) {}
+
+static void backward_add(Tape& t, const Node& n)
+{
+    t[n.children[0]].grad += n.grad;
+    t[n.children[1]].grad += n.grad;
+}
+
+static void backward_sub(Tape& t, const Node& n)
+{
+    t[n.children[0]].grad += n.grad;
+    t[n.children[1]].grad -= n.grad;
+}
+
+static void backward_mul(Tape& t, const Node& n)
+{
+    t[n.children[0]].grad += n.grad * t[n.children[1]].data;
+    t[n.children[1]].grad += n.grad * t[n.children[0]].data;
+}
+
+static void backward_div(Tape& t, const Node& n)
+{
+    // y = a / b: dy/da = 1 / b, dy/db = -a / b^2 = -y / b
+    float inverse = 1 / t[n.children[1]].data;
+    t[n.children[0]].grad += n.grad * inverse;
+    t[n.children[1]].grad -= n.grad * n.data * inverse;
+}
+
+static void backward_neg(Tape& t, const Node& n)
+{
+    t[n.children[0]].grad -= n.grad;
+}
+
+static void backward_pow(Tape& t, const Node& n)
+{
+    // y = x^p: dy/dx = p x^(p - 1) = p y / x, only evaluated again at x = 0
+    // (the exponent is a constant, it gets no gradient)
+    float x = t[n.children[0]].data;
+    float p = t[n.children[1]].data;
+    float d = x != 0 ? p * n.data / x : p * std::pow(x, p - 1);
+    t[n.children[0]].grad += n.grad * d;
+}
+
+static void backward_exp(Tape& t, const Node& n)
+{
+    t[n.children[0]].grad += n.grad * n.data;
+}
+
+static void backward_log(Tape& t, const Node& n)
+{
+    t[n.children[0]].grad += n.grad / t[n.children[0]].data;
+}
+
+static void backward_tanh(Tape& t, const Node& n)
+{
+    // d tanh(x)/dx = 1 - tanh(x)^2, tanh(x) is this node's own data
+    t[n.children[0]].grad += n.grad * (1 - n.data * n.data);
+}
+
+static void backward_relu(Tape& t, const Node& n)
+{
+    if (n.data > 0) {
+        t[n.children[0]].grad += n.grad;
+    }
+}
+
+static void backward_sigmoid(Tape& t, const Node& n)
+{
+    t[n.children[0]].grad += n.grad * n.data * (1 - n.data);
+}
+
+static void backward_nary(Tape& t, const Node& n)
+{
+    // saved holds d(node)/d(child), e.g. softmax(logits) - one_hot(target)
+    std::span<const uint32_t> children = t.get_operands(n);
+    std::span<const float> saved = t.get_saved(n);
+    for (size_t i = 0; i < children.size(); i++) {
+        t[children[i]].grad += n.grad * saved[i];
+    }
+}
+
+const BackwardFn backward_kernels[static_cast<size_t>(Op::Count)] = {
+    backward_leaf,           // Leaf
+    backward_leaf,           // Const
+    backward_add,            // Add
+    backward_sub,            // Sub
+    backward_mul,            // Mul
+    backward_div,            // Div
+    backward_neg,            // Neg
+    backward_pow,            // Pow
+    backward_exp,            // Exp
+    backward_log,            // Log
+    backward_tanh,           // Tanh
+    backward_relu,           // Relu
+    backward_sigmoid,        // Sigmoid
+    backward_nary,           // CrossEntropy
+    backward_nary,           // MseLoss
+    backward_nary,           // HingeLoss
+    backward_nary,           // SoftmaxLoss
+    backward_leaf,           // Dot, never on a tape
+    backward_leaf,           // DotTanh, never on a tape
+};
+
+void Tape::backward_node(uint32_t id)
+{
+    const Node& n = nodes[id];
+    backward_kernels[static_cast<size_t>(n.op)](*this, n);
+}
+
+// Constructor
+Value::Value(float data, std::string label) : tape(&Tape::current())
+{
+    id = tape->push(data);
+    if (label != "") {
+        tape->set_label(id, label);
+    }
+}
+
+Value Value::record(float data, Op op, const Value* other) const
+{
+    // Record a new node on this value's tape with this (and other) as children
+    uint32_t rhs = other ? other->id : Tape::npos;
+    return Value(tape, tape->push(data, op, id, rhs));
 }
 
 // Operator overloads
 Value Value::operator+(const Value& other) const
 {
     // Sum of two values
-    return Value(data + other.data, {const_cast<Value*>(this), const_cast<Value*>(&other)}, "+");
+    return record(get_data() + other.get_data(), Op::Add, &other);
 }
 
 Value Value::operator-(const Value& other) const
 {
     // Difference of two values
-    return Value(this->data - other.data, {const_cast<Value*>(this), const_cast<Value*>(&other)}, "-");
+    return record(get_data() - other.get_data(), Op::Sub, &other);
 }
 
 Value Value::operator*(const Value& other) const
 {
     // Product of two values
-    return Value(this->data * other.data, {const_cast<Value*>(this), const_cast<Value*>(&other)}, "*");
+    return record(get_data() * other.get_data(), Op::Mul, &other);
+}
+
+Value Value::operator/(const Value& other) const
+{
+    // Quotient of two values
+    return record(get_data() / other.get_data(), Op::Div, &other);
 }
 
 Value Value::operator-() const
 {
     // Negation of a value
-    return Value(-this->data, {const_cast<Value*>(this)}, "-");
+    return record(-get_data(), Op::Neg);
 }
 
+// Compound operators rebind this handle to a new node, the old node stays
+// in the graph as a child
 Value& Value::operator+=(const Value& other)
 {
     // Increment a value by another value
-    data += other.data;
-    children = {const_cast<Value*>(this), const_cast<Value*>(&other)};
+    *this = *this + other;
     return *this;
 }
 
 Value& Value::operator-=(const Value& other)
 {
     // Decrement a value by another value
-    data -= other.data;
-    children = {const_cast<Value*>(this), const_cast<Value*>(&other)};
+    *this = *this - other;
     return *this;
 }
 
 Value& Value::operator*=(const Value& other)
 {
     // Multiply a value by another value
-    data *= other.data;
-    children = {const_cast<Value*>(this), const_cast<Value*>(&other)};
+    *this = *this * other;
+    return *this;
+}
+
+Value& Value::operator/=(const Value& other)
+{
+    // Divide a value by another value
+    *this = *this / other;
     return *this;
 }
 
 // Overloaded operators for float
 Value Value::operator+(float other) const 
 { 
-    Value other_value = Value(other);
+    Value other_value = Value(tape, tape->push(other, Op::Const));
     return *this + other_value;
 }
 Value Value::operator-(float other) const 
 { 
-    Value other_value = Value(other);
+    Value other_value = Value(tape, tape->push(other, Op::Const));
     return *this - other_value;
 }
 Value Value::operator*(float other) const 
 { 
-    Value other_value = Value(other);
+    Value other_value = Value(tape, tape->push(other, Op::Const));
     return *this * other_value;
 }
+Value Value::operator/(float other) const 
+{ 
+    Value other_value = Value(tape, tape->push(other, Op::Const));
+    return *this / other_value;
+}
+Value& Value::operator+=(float other) { *this = *this + other; return *this; }
+Value& Value::operator-=(float other) { *this = *this - other; return *this; }
+Value& Value::operator*=(float other) { *this = *this * other; return *this; }
+Value& Value::operator/=(float other) { *this = *this / other; return *this; }
 
 // Comparison operators
 bool Value::operator==(const Value& other) const
 {
     // Check if two values are equal
-    return this->data == other.data;
+    return get_data() == other.get_data();
 }
 bool Value::operator!=(const Value& other) const
 {
     // Check if two values are not equal
-    return this->data != other.data;
+    return get_data() != other.get_data();
 }
 bool Value::operator<(const Value& other) const
 {
     // Check if a value is less than another value
-    return this->data < other.data;
+    return get_data() < other.get_data();
 }
 bool Value::operator<=(const Value& other) const
 {
     // Check if a value is less than or equal to another value
-    return this->data <= other.data;
+    return get_data() <= other.get_data();
 }
 bool Value::operator>(const Value& other) const
 {
     // Check if a value is greater than another value
-    return this->data > other.data;
+    return get_data() > other.get_data();
 }
 bool Value::operator>=(const Value& other) const
 {
     // Check if a value is greater than or equal to another value
-    return this->data >= other.data;
+    return get_data() >= other.get_data();
 }
 
 // Math functions
+Value Value::pow(float exponent) const
+{
+    // Power with a constant exponent, kept as a child for backward
+    Value p = Value(tape, tape->push(exponent, Op::Const));
+    return record(std::pow(get_data(), exponent), Op::Pow, &p);
+}
+
+Value Value::exp() const
+{
+    // Exponential function
+    return record(std::exp(get_data()), Op::Exp);
+}
+
+Value Value::log() const
+{
+    // Natural logarithm
+    return record(std::log(get_data()), Op::Log);
+}
+
 Value Value::tanh() const
 {
     // Hyperbolic tangent function
-    return Value(std::tanh(this->data), {const_cast<Value*>(this)}, "tanh");
+    return record(std::tanh(get_data()), Op::Tanh);
+}
+
+Value Value::relu() const
+{
+    // Rectified linear unit
+    return record(std::max(get_data(), 0.0f), Op::Relu);
+}
+
+Value Value::sigmoid() const
+{
+    // Logistic function
+    return record(logistic(get_data()), Op::Sigmoid);
+}
+
+float logistic(float x)
+{
+    if (x >= 0) {
+        return 1 / (1 + std::exp(-x));
+    }
+    float e = std::exp(x);
+    return e / (1 + e);
+}
+
+Value cross_entropy(std::span<const Value> logits, int target)
+{
+    // loss = log(sum_i exp(z_i)) - z_target = log(sum_i exp(z_i - m)) + m - z_target
+    if (target < 0 || static_cast<size_t>(target) >= logits.size()) {
+        throw std::invalid_argument("cross_entropy: target is not one of the logits");
+    }
+    Tape& tape = logits.empty() ? Tape::current() : *logits[0].get_tape();
+    float m = -INFINITY;
+    for (const Value& z : logits) {
+        m = std::max(m, z.get_data());
+    }
+    // scratch kept per thread, so a loss per sample does not allocate
+    thread_local std::vector<float> softmax;
+    thread_local std::vector<uint32_t> children;
+    softmax.resize(logits.size());
+    children.resize(logits.size());
+    float sum = 0;
+    for (size_t i = 0; i < logits.size(); i++) {
+        softmax[i] = std::exp(logits[i].get_data() - m);
+        sum += softmax[i];
+        children[i] = logits[i].get_id();
+    }
+    for (size_t i = 0; i < logits.size(); i++) {
+        softmax[i] = softmax[i] / sum - (static_cast<int>(i) == target ? 1.0f : 0.0f);
+    }
+    float loss = std::log(sum) + m - logits[target].get_data();
+    return Value(&tape, tape.push_nary(loss, Op::CrossEntropy, children, softmax, target));
+}
+
+// Losses
+float loss_kernel(Loss kind, const float* outputs, const float* targets, int rows, int n, float scale, float* grads)
+{
+    float total = 0;
+    switch (kind) {
+    case Loss::MSE:
+        for (size_t i = 0; i < static_cast<size_t>(rows) * n; i++) {
+            float diff = outputs[i] - targets[i];
+            total += diff * diff;
+            grads[i] = 2 * diff * scale;
+        }
+        break;
+    case Loss::Hinge:
+        for (size_t i = 0; i < static_cast<size_t>(rows) * n; i++) {
+            float margin = 1 - outputs[i] * targets[i];
+            total += std::max(margin, 0.0f);
+            grads[i] = margin > 0 ? -targets[i] * scale : 0.0f;
+        }
+        break;
+    case Loss::SoftmaxCrossEntropy:
+        // per row: log(sum exp(y - m)) + m - y[t], grads (softmax - one_hot)
+        for (int r = 0; r < rows; r++) {
+            const float* y = outputs + static_cast<size_t>(r) * n;
+            float* g = grads + static_cast<size_t>(r) * n;
+            int target = static_cast<int>(targets[r]);
+            float m = *std::max_element(y, y + n);
+            float sum = 0;
+            for (int j = 0; j < n; j++) {
+                g[j] = std::exp(y[j] - m);
+                sum += g[j];
+            }
+            for (int j = 0; j < n; j++) {
+                g[j] = (g[j] / sum - (j == target ? 1.0f : 0.0f)) * scale;
+            }
+            total += std::log(sum) + m - y[target];
+        }
+        break;
+    }
+    return total * scale;
+}
+
+void check_class_targets(const float* targets, int rows, int n)
+{
+    for (int r = 0; r < rows; r++) {
+        float t = targets[r];
+        if (!(t >= 0 && t < n) || t != std::floor(t)) {
+            throw std::invalid_argument("loss: class target " + std::to_string(t) + " is not one of "
+                                        + std::to_string(n) + " outputs");
+        }
+    }
+}
+
+static Op loss_op(Loss kind)
+{
+    static const Op ops[] = { Op::MseLoss, Op::HingeLoss, Op::SoftmaxLoss };
+    return ops[static_cast<size_t>(kind)];
+}
+
+Value loss(std::span<const Value> outputs, std::span<const Value> targets, int batch, Loss kind)
+{
+    size_t n_targets = kind == Loss::SoftmaxCrossEntropy ? batch : outputs.size();
+    if (batch <= 0 || outputs.size() % batch != 0 || targets.size() != n_targets) {
+        throw std::invalid_argument("loss: outputs and targets do not match the batch");
+    }
+    // children are the outputs, then the targets (with a zero gradient)
+    Tape& tape = outputs.empty() ? Tape::current() : *outputs[0].get_tape();
+    thread_local std::vector<float> y, t, saved;
+    thread_local std::vector<uint32_t> children;
+    y.clear();
+    t.clear();
+    children.clear();
+    for (const Value& v : outputs) {
+        y.push_back(v.get_data());
+        children.push_back(v.get_id());
+    }
+    for (const Value& v : targets) {
+        t.push_back(v.get_data());
+        children.push_back(v.get_id());
+    }
+    if (kind == Loss::SoftmaxCrossEntropy) {
+        check_class_targets(t.data(), batch, static_cast<int>(outputs.size() / batch));
+    }
+    saved.assign(children.size(), 0.0f);
+    float value = loss_kernel(kind, y.data(), t.data(), batch, static_cast<int>(outputs.size() / batch),
+                              1.0f / batch, saved.data());
+    return Value(&tape, tape.push_nary(value, loss_op(kind), children, saved, batch));
 }
 
 // Gradient
-void Value::build_topo(std::vector<Value*>& sorted, std::unordered_map<Value*, bool>& visited, Value* node)
+void Tape::topological_sort(uint32_t root, std::vector<uint32_t>& sorted)
 {
-    // Build the topological sort of the graph
-    if (visited[node]) {
-        return;
+    MICROGRAD_PROFILE_PHASE(Phase::Sort);
+    // Nodes visited by this sort carry the current epoch, so nothing has
+    // to be cleared between sorts
+    if (++epoch == 0) {
+        for (Node& n : nodes) {
+            n.epoch = 0;
+        }
+        epoch = 1;
     }
-    std::cout << "Node: " << node->get_label() << std::endl;
-    visited[node] = true;
-    for (auto child : node->children) {
-        build_topo(sorted, visited, child);
+
+    sorted.clear();
+    stack.clear();
+    nodes[root].epoch = epoch;
+    stack.push_back(Frame{root, 0});
+    while (!stack.empty()) {
+        Frame& frame = stack.back();
+        std::span<const uint32_t> children = get_children(frame.id);
+        if (frame.next_child < children.size()) {
+            uint32_t child = children[frame.next_child++];
+            if (nodes[child].epoch != epoch) {
+                nodes[child].epoch = epoch;
+                stack.push_back(Frame{child, 0});
+            }
+        } else {
+            sorted.push_back(frame.id);
+            stack.pop_back();
+        }
     }
-    sorted.push_back(node);
 }
 
-void Value::backward_single()
+void Tape::backward(uint32_t root, const std::vector<uint32_t>& sorted)
 {
-    // Backpropagate the gradient, updateding children's gradients
-    if (op == "") {} // Leaf node
-    else if (op == "+") {
-        children[0]->update_grad(grad);
-        children[1]->update_grad(grad); 
-    } else if (op == "-") {
-        children[0]->update_grad(grad);
-        children[1]->update_grad(-grad);
-    } else if (op == "*") {
-        children[0]->update_grad(grad * children[1]->get_data());
-        children[1]->update_grad(grad * children[0]->get_data());
-    } else if (op == "tanh") {
-        children[0]->update_grad(grad * (1 - std::pow(std::tanh(children[0]->get_data()), 2)));
+    MICROGRAD_PROFILE_PHASE(Phase::Backward);
+    nodes[root].grad = 1.0;
+    if (MICROGRAD_PROFILE_ENABLED()) {
+        // same loop, timing every kernel under its op
+        Profiler& profiler = Profiler::current();
+        for (auto it = sorted.rbegin(); it != sorted.rend(); ++it) {
+            uint64_t start = profiler.now_ns();
+            backward_node(*it);
+            profiler.add_backward(nodes[*it].op, profiler.now_ns() - start);
+        }
+        profiler.sample_graph_bytes(get_bytes());
     } else {
-        throw std::runtime_error("Unknown op " + op);
+        for (auto it = sorted.rbegin(); it != sorted.rend(); ++it) {
+            backward_node(*it);
+        }
     }
+    flush_bindings(sorted);
 }
 
-void Value::backward()
+void Value::backward_single() const
+{
+    // Backpropagate the gradient, updateding children's gradients
+    tape->backward_node(id);
+}
+
+void Value::backward() const
 {
     // Topsort the graph and backpropagate the gradient
-    // Note: Using pointers to avoid copying the graph
-    std::vector<Value*> sorted = std::vector<Value*>();
-    std::unordered_map<Value*, bool> visited = std::unordered_map<Value*, bool>();
-    
-    // Build the topological sort
-    build_topo(sorted, visited, this);
+    tape->topological_sort(id, tape->order);
+    tape->backward(id, tape->order);
+}
 
-    // Backpropagate the gradient
-    sorted.back()->set_grad(1.0);
-    for (auto it = sorted.rbegin(); it != sorted.rend(); ++it) {
-        (*it)->backward_single();
+void Value::backward(Schedule& schedule) const
+{
+    // Same as backward(), reusing the schedule's order while it matches
+    if (!schedule.matches(id, *tape)) {
+        tape->topological_sort(id, schedule.order);
+        schedule.root = id;
+        schedule.tape_size = tape->size();
+    }
+    tape->backward(id, schedule.order);
+}
+
+// Batched loss
+float loss(const Matrix& outputs, const Matrix& targets, Matrix& output_grads, Loss kind)
+{
+    int rows = outputs.get_rows();
+    if (targets.get_rows() != rows
+        || targets.get_cols() != (kind == Loss::SoftmaxCrossEntropy ? 1 : outputs.get_cols())) {
+        throw std::invalid_argument("loss: outputs and targets do not match the batch");
+    }
+    if (kind == Loss::SoftmaxCrossEntropy) {
+        check_class_targets(targets.data(), rows, outputs.get_cols());
+    }
+    output_grads.resize(rows, outputs.get_cols());
+    return loss_kernel(kind, outputs.data(), targets.data(), rows, outputs.get_cols(), 1.0f / rows,
+                       output_grads.data());
+}
+
+// Sparse matrix
+SparseMatrix SparseMatrix::from_dense(const Matrix& dense)
+{
+    SparseMatrix sparse(dense.get_cols());
+    for (int r = 0; r < dense.get_rows(); r++) {
+        for (int c = 0; c < dense.get_cols(); c++) {
+            if (dense(r, c) != 0.0f) {
+                sparse.add(c, dense(r, c));
+            }
+        }
+        sparse.end_row();
     }
+    return sparse;
 }
 
+void SparseMatrix::add(int32_t column, float value)
+{
+    if (column < 0 || column >= cols || (values.size() > offsets.back() && column <= indices.back())) {
+        throw std::invalid_argument("sparse columns must be in range and increasing within a row");
+    }
+    indices.push_back(column);
+    values.push_back(value);
+}
 
+void SparseMatrix::end_row()
+{
+    offsets.push_back(values.size());
+    rows++;
+}
+
+void SparseMatrix::clear()
+{
+    rows = 0;
+    offsets.resize(1);
+    indices.clear();
+    values.clear();
+}
+
+void SparseMatrix::assign_rows(const SparseMatrix& other, int begin, int end)
+{
+    size_t first = other.offsets[begin];
+    size_t last = other.offsets[end];
+    cols = other.cols;
+    rows = end - begin;
+    offsets.resize(rows + 1);
+    for (int r = 0; r <= rows; r++) {
+        offsets[r] = other.offsets[begin + r] - first;
+    }
+    indices.assign(other.indices.begin() + first, other.indices.begin() + last);
+    values.assign(other.values.begin() + first, other.values.begin() + last);
+}
+
+// Batched dense tanh node
+void dense_tanh(const float* x, int batch, int n_inputs,
+                const float* weights, const float* bias, int n_outputs, float* y, Precision precision)
+{
+    // One dot product per (sample, neuron), then tanh over the whole row
+    const Kernels& k = kernels();
+    for (int r = 0; r < batch; r++) {
+        const float* xr = x + static_cast<size_t>(r) * n_inputs;
+        float* yr = y + static_cast<size_t>(r) * n_outputs;
+        for (int j = 0; j < n_outputs; j++) {
+            const float* w = weights + static_cast<size_t>(j) * n_inputs;
+            yr[j] = precision == Precision::Mixed ? static_cast<float>(bias[j] + k.dot_mixed(xr, w, n_inputs))
+                                                  : bias[j] + k.dot(xr, w, n_inputs);
+        }
+        k.tanh(yr, yr, n_outputs);
+    }
+}
+
+void dense_tanh(const float* x, int batch, int n_inputs, const uint16_t* weights, WeightFormat format,
+                const float* bias, int n_outputs, float* y)
+{
+    const Kernels& k = kernels();
+    float (*dot)(const float*, const uint16_t*, int) = format == WeightFormat::F16 ? k.dot_f16 : k.dot_bf16;
+    for (int r = 0; r < batch; r++) {
+        const float* xr = x + static_cast<size_t>(r) * n_inputs;
+        float* yr = y + static_cast<size_t>(r) * n_outputs;
+        for (int j = 0; j < n_outputs; j++) {
+            yr[j] = bias[j] + dot(xr, weights + static_cast<size_t>(j) * n_inputs, n_inputs);
+        }
+        k.tanh(yr, yr, n_outputs);
+    }
+}
+
+void DenseTanh::set_parameters(const float* weights, const float* bias, float* weight_grads, float* bias_grads)
+{
+    this->weights = weights;
+    this->bias = bias;
+    this->weight_grads = weight_grads;
+    this->bias_grads = bias_grads;
+}
+
+const Matrix& DenseTanh::forward(const Matrix& input)
+{
+    const Matrix& y = forward(input, output);
+    result = nullptr;
+    return y;
+}
+
+// std::invalid_argument for a batch that is not n_inputs wide
+static void check_width(int cols, int n_inputs)
+{
+    if (cols != n_inputs) {
+        throw std::invalid_argument("batch has " + std::to_string(cols) + " columns, the layer "
+                                    + std::to_string(n_inputs) + " inputs");
+    }
+}
+
+const Matrix& DenseTanh::forward(const Matrix& input, Matrix& output)
+{
+    check_width(input.get_cols(), n_inputs);
+    this->input = &input;
+    sparse_input = nullptr;
+    result = &output;
+    output.resize(input.get_rows(), n_outputs);
+    dense_tanh(input.data(), input.get_rows(), n_inputs, weights, bias, n_outputs, output.data(), precision);
+    return output;
+}
+
+const Matrix& DenseTanh::forward(const SparseMatrix& input)
+{
+    return forward(input, output);
+}
+
+const Matrix& DenseTanh::forward(const SparseMatrix& input, Matrix& output)
+{
+    // A sparse dot product per (sample, neuron), gathering the weights of the
+    // row's columns. Neuron by neuron, so the gathers of the whole batch hit
+    // one row of weights while it is in cache.
+    check_width(input.get_cols(), n_inputs);
+    this->input = nullptr;
+    sparse_input = &input;
+    result = &output;
+    const Kernels& k = kernels();
+    int batch = input.get_rows();
+    output.resize(batch, n_outputs);
+    for (int j = 0; j < n_outputs; j++) {
+        const float* w = weights + static_cast<size_t>(j) * n_inputs;
+        for (int r = 0; r < batch; r++) {
+            output(r, j) = bias[j] + k.dot_sparse(input.row_values(r), input.row_indices(r), input.row_size(r), w);
+        }
+    }
+    for (int r = 0; r < batch; r++) {
+        k.tanh(output.row(r), output.row(r), n_outputs);
+    }
+    return output;
+}
+
+void DenseTanh::backward_sparse(const Matrix& output_grads)
+{
+    // delta of the whole batch first, then dW_j += delta * x only at each
+    // row's columns, neuron by neuron as in forward
+    const Kernels& k = kernels();
+    const Matrix& output = get_output();
+    int batch = sparse_input->get_rows();
+    delta.resize(static_cast<size_t>(batch) * n_outputs);
+    for (int r = 0; r < batch; r++) {
+        k.tanh_backward(output.row(r), output_grads.row(r), delta.data() + static_cast<size_t>(r) * n_outputs,
+                        n_outputs);
+    }
+    for (int j = 0; j < n_outputs; j++) {
+        float* dw = weight_grads + static_cast<size_t>(j) * n_inputs;
+        for (int r = 0; r < batch; r++) {
+            float d = delta[static_cast<size_t>(r) * n_outputs + j];
+            bias_grads[j] += d;
+            k.axpy_sparse(d, sparse_input->row_values(r), sparse_input->row_indices(r), sparse_input->row_size(r),
+                          dw);
+        }
+    }
+}
+
+void DenseTanh::backward(const Matrix& output_grads, Matrix* input_grads)
+{
+    // delta = dL/dy * (1 - y^2) reuses the saved output instead of tanh again.
+    // Then for every (sample, neuron): db += delta, dW_j += delta * x and
+    // dx += delta * W_j, all in the same sweep over the weights.
+    const Kernels& k = kernels();
+    const Matrix& output = get_output();
+    delta.resize(n_outputs);
+    if (sparse_input) {
+        if (input_grads) {
+            throw std::invalid_argument("no input gradients for a sparse input");
+        }
+        backward_sparse(output_grads);
+        return;
+    }
+    int batch = input->get_rows();
+    if (input_grads) {
+        input_grads->resize(batch, n_inputs);
+        input_grads->fill(0.0f);
+    }
+    if (precision == Precision::Mixed) {
+        backward_mixed(output_grads, input_grads);
+        return;
+    }
+    for (int r = 0; r < batch; r++) {
+        const float* x = input->row(r);
+        k.tanh_backward(output.row(r), output_grads.row(r), delta.data(), n_outputs);
+        for (int j = 0; j < n_outputs; j++) {
+            float d = delta[j];
+            bias_grads[j] += d;
+            k.axpy(d, x, weight_grads + static_cast<size_t>(j) * n_inputs, n_inputs);
+            if (input_grads) {
+                k.axpy(d, weights + static_cast<size_t>(j) * n_inputs, input_grads->row(r), n_inputs);
+            }
+        }
+    }
+}
+
+void DenseTanh::backward_mixed(const Matrix& output_grads, Matrix* input_grads)
+{
+    // Same sweep with the sums in double: the weight and bias grads of the
+    // whole batch in grad_sums (weights, then biases), added to the float
+    // grads once at the end, and each input grad row in input_sums
+    const Kernels& k = kernels();
+    const Matrix& output = get_output();
+    int batch = input->get_rows();
+    size_t n_weights = static_cast<size_t>(n_outputs) * n_inputs;
+    grad_sums.assign(n_weights + n_outputs, 0.0);
+    input_sums.resize(n_inputs);
+    for (int r = 0; r < batch; r++) {
+        const float* x = input->row(r);
+        k.tanh_backward(output.row(r), output_grads.row(r), delta.data(), n_outputs);
+        std::fill(input_sums.begin(), input_sums.end(), 0.0);
+        for (int j = 0; j < n_outputs; j++) {
+            float d = delta[j];
+            grad_sums[n_weights + j] += d;
+            k.axpy_mixed(d, x, grad_sums.data() + static_cast<size_t>(j) * n_inputs, n_inputs);
+            if (input_grads) {
+                k.axpy_mixed(d, weights + static_cast<size_t>(j) * n_inputs, input_sums.data(), n_inputs);
+            }
+        }
+        if (input_grads) {
+            float* dx = input_grads->row(r);
+            for (int i = 0; i < n_inputs; i++) {
+                dx[i] = static_cast<float>(input_sums[i]);
+            }
+        }
+    }
+    for (size_t i = 0; i < n_weights; i++) {
+        weight_grads[i] = static_cast<float>(weight_grads[i] + grad_sums[i]);
+    }
+    for (int j = 0; j < n_outputs; j++) {
+        bias_grads[j] = static_cast<float>(bias_grads[j] + grad_sums[n_weights + j]);
+    }
+}
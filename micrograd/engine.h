@@ -1,81 +1,238 @@
+#pragma once
+
 #include <string>
 #include <sstream>
 #include <vector>
 #include <cmath>
+#include <cstdint>
 #include <unordered_map>
+#include <algorithm>
+#include <span>
+#include <memory>
+
+#include "kernels.h"
+
+// Operations a node can record. Leaf nodes are inputs and parameters, Const
+// nodes are the float literals of mixed Value/float expressions. Pow takes
+// its exponent as a Const child. CrossEntropy and the batch losses are n-ary
+// (see Tape::push_nary). Dot and DotTanh are fused ops that only appear in
+// optimized programs (program.h). The op indexes the table of backward
+// kernels, so keep Count last.
+enum class Op : uint8_t {
+    Leaf, Const, Add, Sub, Mul, Div, Neg, Pow, Exp, Log, Tanh, Relu, Sigmoid,
+    CrossEntropy, MseLoss, HingeLoss, SoftmaxLoss, Dot, DotTanh, Count
+};
+
+// Display name of an op, only meant for printing and drawing graphs
+const char* op_name(Op op);
+// Number of children a node of this op has, 0 for leaves and n-ary ops
+int op_arity(Op op);
+// Whether the op keeps its children in the tape's side array
+bool op_is_nary(Op op);
+
+// A single recorded operation. Nodes live contiguously inside a Tape and refer
+// to their children by index, so recording a node never allocates on its own.
+struct Node {
+    float data;
+    float grad;
+    uint32_t children[2];
+    // last topological sort that visited this node, see Tape::topological_sort
+    uint32_t epoch;
+    Op op;
+};
+
+// Arena that holds every node of a computation graph. Values are small handles
+// into a tape; the tape keeps its capacity when rewound, so rebuilding the same
+// graph every training step costs no allocations once it has warmed up.
+class Tape
+{
+private:
+    std::vector<Node> nodes;
+    // labels are only used for printing and drawing, kept out of the node itself
+    std::unordered_map<uint32_t, std::string> labels;
+
+    // scratch space of topological_sort, kept to avoid allocating per call
+    struct Frame { uint32_t id; uint32_t next_child; };
+    std::vector<Frame> stack;
+    std::vector<uint32_t> order;
+    uint32_t epoch = 0;
+
+    // parameter blocks bound with bind(), see flush_bindings. An owned
+    // binding only writes its grads while the owner is alive.
+    struct Binding {
+        uint32_t first;
+        uint32_t size;
+        float* grad;
+        std::weak_ptr<void> owner;
+        bool owned;
+    };
+    std::vector<Binding> bindings;
+    // scratch of flush_bindings: which bindings the backward reached
+    std::vector<uint8_t> reached;
+
+    // side arrays of n-ary nodes, see push_nary; nary lists those nodes so
+    // rewind can cut the arrays back
+    std::vector<uint32_t> operands;
+    std::vector<float> saved;
+    struct Nary { uint32_t id; uint32_t first; };
+    std::vector<Nary> nary;
+
+public:
+    static constexpr uint32_t npos = UINT32_MAX;
+
+    Tape() = default;
+    Tape(const Tape&) = delete;
+    Tape& operator=(const Tape&) = delete;
+
+    // Tape used by Values created on this thread
+    static Tape& current();
+
+    uint32_t push(float data, Op op = Op::Leaf, uint32_t lhs = npos, uint32_t rhs = npos);
+    // Record an n-ary node. Its children are kept in a side array: the
+    // node's children[0] is the offset of its operands there and children[1]
+    // their count. extra is stored right after the operands (the target
+    // class of CrossEntropy, the batch size of a loss), saved holds
+    // d(node)/d(operand) for each operand, which is all backward needs.
+    uint32_t push_nary(float data, Op op, std::span<const uint32_t> children,
+                       std::span<const float> saved, uint32_t extra = npos);
+
+    // Children of any node, two-input, unary or n-ary
+    std::span<const uint32_t> get_children(uint32_t id) const;
+    // Children, extra and saved values (one per child) of an n-ary node
+    std::span<const uint32_t> get_operands(const Node& n) const { return {operands.data() + n.children[0], n.children[1]}; }
+    uint32_t get_extra(const Node& n) const { return operands[n.children[0] + n.children[1]]; }
+    std::span<const float> get_saved(const Node& n) const { return {saved.data() + n.children[0], n.children[1]}; }
+
+    Node& operator[](uint32_t id) { return nodes[id]; }
+    const Node& operator[](uint32_t id) const { return nodes[id]; }
+
+    size_t size() const { return nodes.size(); }
+    size_t capacity() const { return nodes.capacity(); }
+    // Bytes held by the node and side arrays (labels not counted)
+    size_t get_bytes() const;
+    void reserve(size_t n) { nodes.reserve(n); }
+
+    // mark() / rewind() drop every node recorded after the mark in O(1),
+    // e.g. keep the model parameters and reset the graph between steps.
+    size_t mark() const { return nodes.size(); }
+    void rewind(size_t mark);
+    void clear() { rewind(0); }
+
+    void set_label(uint32_t id, const std::string& label);
+    std::string get_label(uint32_t id) const;
+
+    // Record n leaf nodes holding a copy of data[0..n) and return the index
+    // of the first one. Parameters live outside the tape in flat buffers;
+    // after every backward the gradients of these nodes are added to
+    // grad[0..n) (and reset on the tape), so each bound block behaves like
+    // a view of the parameters on the graph. The tape only holds a weak
+    // reference to owner, the storage behind grad: once it is destroyed the
+    // block's grads are dropped instead of written to freed memory. Without
+    // an owner grad must outlive the nodes (until rewound).
+    uint32_t bind(const float* data, float* grad, size_t n, std::weak_ptr<void> owner = {});
+    // Add the grads of the bound blocks with a node in order (the nodes a
+    // backward went through) to their parameters
+    void flush_bindings(std::span<const uint32_t> order);
+
+    // Children-before-parents order of every node reachable from root.
+    // Iterative DFS, so the depth of the graph is not bound by the call stack.
+    void topological_sort(uint32_t root, std::vector<uint32_t>& sorted);
+
+    // Propagate the gradient of a node to its children
+    void backward_node(uint32_t id);
+
+    // Backpropagate from root (seeded with grad 1) along a topological order
+    void backward(uint32_t root, const std::vector<uint32_t>& sorted);
+
+    friend class Value;
+};
+
+// Cached topological order for Value::backward. When the same code rebuilds
+// the same graph on a rewound tape, the root lands on the same index and the
+// tape has the same size; the order is then replayed without sorting again.
+// The caller guarantees the graph shape only changes together with those two.
+struct Schedule {
+    std::vector<uint32_t> order;
+    uint32_t root = Tape::npos;
+    size_t tape_size = 0;
+
+    bool matches(uint32_t root, const Tape& tape) const {
+        return this->root == root && tape_size == tape.size();
+    }
+    void invalidate() { root = Tape::npos; }
+};
+
+// Backward kernels; each one pushes node.grad into the children of node
+using BackwardFn = void (*)(Tape& tape, const Node& node);
+extern const BackwardFn backward_kernels[static_cast<size_t>(Op::Count)];
 
 class Value
 {
 private:
-    float data;
-    // children are Value pointers to change use only the address of the Value
-    std::vector<Value*> children;
-    std::string op;
-    std::string label;
-    float grad;
+    Tape* tape;
+    uint32_t id;
+
+    Node& node() const { return (*tape)[id]; }
+    Value record(float data, Op op, const Value* other = nullptr) const;
 
 public:
-    Value(float data, 
-          std::vector<Value*> children = std::vector<Value*>(),
-          std::string op = "",
-          std::string label = "");
-    Value(float data, std::string label);
-    ~Value();
-
-    void set_data(float data) { this->data = data; }
-    void set_label(std::string label) { this->label = label; }
-    void set_grad(float grad) { this->grad = grad; }
-
-    float get_data() const { return data; }
-    float get_grad() const { return grad; }
-    std::string get_label() const { return label; }
-    std::vector<Value*> get_children() const { return children; }
-    std::string get_op() const { return op; }
+    Value(float data, std::string label = "");
+    // Handle to a node already on the tape
+    Value(Tape* tape, uint32_t id) : tape(tape), id(id) {}
+
+    void set_data(float data) { node().data = data; }
+    void set_label(std::string label) { tape->set_label(id, label); }
+    void set_grad(float grad) { node().grad = grad; }
+
+    float get_data() const { return node().data; }
+    float get_grad() const { return node().grad; }
+    std::string get_label() const { return tape->get_label(id); }
+    // Node indices of the children, on the same tape
+    std::span<const uint32_t> get_children() const { return tape->get_children(id); }
+    Op get_op() const { return node().op; }
+    uint32_t get_id() const { return id; }
+    Tape* get_tape() const { return tape; }
 
     std::string get_key() const {
-        std::stringstream ss;
+        std::string label = get_label();
         if (label != "") {
-            ss << label;
-            return ss.str();
-        } else {
-            ss << this;
-            // remove 0x from the beginning
-            return ss.str().substr(2);
+            return label;
         }
+        return std::to_string(id);
     }
 
-    void update_grad(float grad) { this->grad += grad; }
+    void update_grad(float grad) { node().grad += grad; }
 
     std::string to_string() const {
         std::stringstream ss;
         ss.precision(4);
-        ss << std::fixed << data;
-        ss << " (" << op << ")";
-        ss << " [" << label << "]";
-        ss << " {" << grad << "}";
+        ss << std::fixed << get_data();
+        ss << " (" << op_name(get_op()) << ")";
+        ss << " [" << get_label() << "]";
+        ss << " {" << get_grad() << "}";
         return ss.str();
     }
-    
+
     // define operator overloads
     Value operator+(const Value& other) const;
     Value operator-(const Value& other) const;
     Value operator*(const Value& other) const;
-    // Value operator/(const Value& other) const;
+    Value operator/(const Value& other) const;
     Value operator-() const;
     Value& operator+=(const Value& other);
     Value& operator-=(const Value& other);
     Value& operator*=(const Value& other);
-    // Value& operator/=(const Value& other);
+    Value& operator/=(const Value& other);
 
     // define overloaded operators for float
     Value operator+(float other) const;
     Value operator-(float other) const;
     Value operator*(float other) const;
-    // Value operator/(float other) const;
+    Value operator/(float other) const;
     Value& operator+=(float other);
     Value& operator-=(float other);
     Value& operator*=(float other);
-    // Value& operator/=(float other);
+    Value& operator/=(float other);
 
     // define comparison operators
     bool operator==(const Value& other) const;
@@ -85,13 +242,198 @@ public:
     bool operator>(const Value& other) const;
     bool operator>=(const Value& other) const;
 
-    // define math functions
-    // Value pow(float exponent) const;
-    // Value exp() const;
+    // define math functions. Backward uses the node's own output where it
+    // can (exp, tanh, sigmoid, pow, /), so no transcendental is evaluated twice.
+    Value pow(float exponent) const;
+    Value exp() const;
+    Value log() const;
     Value tanh() const;
+    Value relu() const;
+    Value sigmoid() const;
 
     // gradient
-    void backward();
-    void backward_single();
-    void build_topo(std::vector<Value*>& sorted, std::unordered_map<Value*, bool>& visited, Value* node);
+    void backward() const;
+    void backward(Schedule& schedule) const;
+    void backward_single() const;
 };
+
+// 1 / (1 + e^-x), in a form that does not overflow for either sign
+float logistic(float x);
+
+// Cross-entropy of the softmax of logits against class target, that is
+// -log_softmax(logits)[target], as one node. Computed with the max
+// subtracted, so large logits do not overflow; the softmax is saved for
+// backward, where d/dlogits[i] = softmax[i] - (i == target). Throws
+// std::invalid_argument unless 0 <= target < logits.size().
+Value cross_entropy(std::span<const Value> logits, int target);
+
+// Losses over a batch. outputs and targets hold one sample after the other
+// and the loss is the sum of the per-sample losses divided by the batch size:
+//   MSE                  sum_j (y_j - t_j)^2
+//   Hinge                sum_j max(0, 1 - y_j t_j), with targets -1 or +1
+//   SoftmaxCrossEntropy  -log softmax(y)[t], one target (class index) per sample
+enum class Loss : uint8_t { MSE, Hinge, SoftmaxCrossEntropy };
+
+// Loss of rows samples of n outputs each, times scale, writing
+// scale * dL/d(outputs) to grads in the same pass. SoftmaxCrossEntropy
+// targets must have passed check_class_targets.
+float loss_kernel(Loss kind, const float* outputs, const float* targets, int rows, int n, float scale, float* grads);
+// Throws std::invalid_argument unless each of the rows targets is a whole
+// number in [0, n), a class of n outputs
+void check_class_targets(const float* targets, int rows, int n);
+
+// The whole batch loss as one node; its backward is one multiply per output
+// (the closed-form gradients are saved in forward). targets are data and
+// get no gradient. Throws std::invalid_argument if the sizes do not match
+// the batch.
+Value loss(std::span<const Value> outputs, std::span<const Value> targets, int batch, Loss kind = Loss::MSE);
+
+
+// Dense row-major matrix used by the batched (tensor-level) path, one sample
+// per row. resize() keeps the allocation, so reusing a Matrix across steps
+// does not allocate once it has reached its largest shape.
+class Matrix
+{
+private:
+    int rows;
+    int cols;
+    std::vector<float> values;
+
+public:
+    Matrix(int rows = 0, int cols = 0, float fill = 0.0f)
+        : rows(rows), cols(cols), values(static_cast<size_t>(rows) * cols, fill) {}
+
+    int get_rows() const { return rows; }
+    int get_cols() const { return cols; }
+
+    void resize(int rows, int cols) {
+        this->rows = rows;
+        this->cols = cols;
+        values.resize(static_cast<size_t>(rows) * cols);
+    }
+    void fill(float value) { std::fill(values.begin(), values.end(), value); }
+    // allocated floats, which can be more than rows * cols after a resize
+    size_t capacity() const { return values.capacity(); }
+
+    float* data() { return values.data(); }
+    const float* data() const { return values.data(); }
+    float* row(int r) { return values.data() + static_cast<size_t>(r) * cols; }
+    const float* row(int r) const { return values.data() + static_cast<size_t>(r) * cols; }
+    float& operator()(int r, int c) { return values[static_cast<size_t>(r) * cols + c]; }
+    float operator()(int r, int c) const { return values[static_cast<size_t>(r) * cols + c]; }
+};
+
+// Compressed sparse row (CSR) matrix for inputs that are mostly zero. Row r
+// is the (column, value) pairs from get_offsets()[r] to get_offsets()[r + 1],
+// columns increasing. Built row by row: add the pairs of a row, then end_row.
+class SparseMatrix
+{
+private:
+    int rows = 0;
+    int cols;
+    std::vector<size_t> offsets = { 0 };
+    std::vector<int32_t> indices;
+    std::vector<float> values;
+
+public:
+    explicit SparseMatrix(int cols = 0) : cols(cols) {}
+    // Nonzeros of a dense matrix
+    static SparseMatrix from_dense(const Matrix& dense);
+
+    int get_rows() const { return rows; }
+    int get_cols() const { return cols; }
+    size_t nnz() const { return values.size(); }
+    const size_t* get_offsets() const { return offsets.data(); }
+
+    // Append to the open row; std::invalid_argument for a column out of
+    // range or not after the previous one
+    void add(int32_t column, float value);
+    void end_row();
+    // Drop every row, keeping the allocations
+    void clear();
+    // Rows [begin, end) of other
+    void assign_rows(const SparseMatrix& other, int begin, int end);
+
+    int row_size(int r) const { return static_cast<int>(offsets[r + 1] - offsets[r]); }
+    const int32_t* row_indices(int r) const { return indices.data() + offsets[r]; }
+    const float* row_values(int r) const { return values.data() + offsets[r]; }
+};
+
+// Arithmetic of the batched path. Single does everything in float32; Mixed
+// keeps data and parameters in float32 but accumulates dot products and the
+// sums over the batch (parameter and input gradients) in float64, for long
+// rows and for a high-precision reference next to a Single model.
+enum class Precision : uint8_t { Single, Mixed };
+
+// Storage of inference weights: float32, IEEE half or bfloat16
+enum class WeightFormat : uint8_t { F32, F16, BF16 };
+
+// y = tanh(x * weights^T + bias) for batch rows of x (n_inputs wide) into
+// rows of y (n_outputs wide). The forward kernel of DenseTanh, also used
+// directly by inference paths that record nothing.
+void dense_tanh(const float* x, int batch, int n_inputs,
+                const float* weights, const float* bias, int n_outputs, float* y,
+                Precision precision = Precision::Single);
+// Same with 16-bit weights (format F16 or BF16), converted on the fly
+void dense_tanh(const float* x, int batch, int n_inputs, const uint16_t* weights, WeightFormat format,
+                const float* bias, int n_outputs, float* y);
+
+// Batch loss on the batched path, one sample per row; targets has one row
+// per sample (one column, the class, for SoftmaxCrossEntropy). Returns the
+// loss and writes dL/d(outputs) to output_grads.
+float loss(const Matrix& outputs, const Matrix& targets, Matrix& output_grads, Loss kind = Loss::MSE);
+
+// Batched fully connected tanh node: output = tanh(input * weights^T + bias)
+// over a whole minibatch. weights has one row of n_inputs per output. The
+// parameters and their gradients are borrowed; the node only owns what it
+// saves for backward. backward accumulates into the weight and bias grads
+// and writes the input grads (if asked for) in one fused pass per sample.
+// The inner loops run on the SIMD kernels from kernels.h.
+class DenseTanh
+{
+private:
+    int n_inputs;
+    int n_outputs;
+    const float* weights = nullptr;
+    const float* bias = nullptr;
+    float* weight_grads = nullptr;
+    float* bias_grads = nullptr;
+
+    const Matrix* input = nullptr;
+    const SparseMatrix* sparse_input = nullptr;
+    Matrix output;
+    // where the last forward wrote its output, nullptr for output above
+    Matrix* result = nullptr;
+    // dL/d(pre-activation) of one sample, scratch for backward
+    std::vector<float> delta;
+    Precision precision = Precision::Single;
+    // Mixed precision backward: parameter gradient sums over the batch, then
+    // one input gradient row
+    std::vector<double> grad_sums;
+    std::vector<double> input_sums;
+
+    void backward_mixed(const Matrix& output_grads, Matrix* input_grads);
+    void backward_sparse(const Matrix& output_grads);
+
+public:
+    DenseTanh(int n_inputs, int n_outputs) : n_inputs(n_inputs), n_outputs(n_outputs) {}
+
+    void set_parameters(const float* weights, const float* bias, float* weight_grads, float* bias_grads);
+    void set_precision(Precision precision) { this->precision = precision; }
+    Precision get_precision() const { return precision; }
+
+    // input must stay alive until backward. Both input kinds must be n_inputs
+    // wide, or std::invalid_argument.
+    const Matrix& forward(const Matrix& input);
+    // Same, writing into output instead, which must also stay alive (and
+    // unchanged) until backward
+    const Matrix& forward(const Matrix& input, Matrix& output);
+    // Sparse input batch: the products only visit the nonzeros, and backward
+    // only adds to the weight grads of the columns the batch touches. It
+    // cannot produce input grads, and always sums in float32.
+    const Matrix& forward(const SparseMatrix& input);
+    const Matrix& forward(const SparseMatrix& input, Matrix& output);
+    void backward(const Matrix& output_grads, Matrix* input_grads);
+
+    const Matrix& get_output() const { return result ? *result : output; }
+};
\ No newline at end of file
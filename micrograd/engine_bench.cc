@@ -0,0 +1,259 @@
+// Benchmarks for micrograd/engine.h
+//
+// value ops: cost of recording one op on a rewound tape (construction), and
+// of a full Value::backward (sort + kernels) per node, for a neuron graph.
+// backward dispatch: per-node cost of Value backward with the op table,
+// against a copy of the old string-keyed nodes (std::string op/label and a
+// std::vector of children per node) on the same neuron-shaped graph.
+// compiled program: one training step (forward + backward with new inputs)
+// by rebuilding the graph on a rewound tape, against replaying a Program,
+// as compiled and after optimize().
+// batch loss: forward + backward of an MSE over a batch of outputs, composed
+// from per-element Value ops against the fused loss() node.
+// graph export: streaming a layer-sized graph to DOT and JSON files, in
+// full and with neurons collapsed.
+
+#include "graph_system.h"
+#include "program.h"
+#include "bench.h"
+
+#include <vector>
+#include <string>
+
+// The node layout and dispatch used before ops became an enum
+struct StringNode {
+    float data;
+    std::vector<StringNode*> children;
+    std::string op;
+    std::string label;
+    float grad;
+
+    void backward_single()
+    {
+        if (op == "") {}
+        else if (op == "+") {
+            children[0]->grad += grad;
+            children[1]->grad += grad;
+        } else if (op == "-") {
+            children[0]->grad += grad;
+            children[1]->grad -= grad;
+        } else if (op == "*") {
+            children[0]->grad += grad * children[1]->data;
+            children[1]->grad += grad * children[0]->data;
+        } else if (op == "tanh") {
+            children[0]->grad += grad * (1 - std::pow(std::tanh(children[0]->data), 2));
+        }
+    }
+};
+
+// n_neurons neurons of width n_inputs: sum_i x_i * w_i + b, then tanh
+static std::vector<StringNode> build_string_graph(int n_neurons, int n_inputs)
+{
+    std::vector<StringNode> nodes;
+    nodes.reserve(n_neurons * (4 * n_inputs + 4));
+    auto add = [&](float data, std::vector<StringNode*> children, std::string op) {
+        nodes.push_back(StringNode{data, children, op, "", 0.0f});
+        return &nodes.back();
+    };
+    for (int n = 0; n < n_neurons; n++) {
+        StringNode* sum = add(0.0f, {}, "");
+        for (int i = 0; i < n_inputs; i++) {
+            StringNode* x = add(0.5f, {}, "");
+            StringNode* w = add(0.1f, {}, "");
+            StringNode* xw = add(x->data * w->data, {x, w}, "*");
+            sum = add(sum->data + xw->data, {sum, xw}, "+");
+        }
+        StringNode* b = add(0.1f, {}, "");
+        sum = add(sum->data + b->data, {sum, b}, "+");
+        add(std::tanh(sum->data), {sum}, "tanh");
+    }
+    return nodes;
+}
+
+static void build_tape_graph(int n_neurons, int n_inputs)
+{
+    for (int n = 0; n < n_neurons; n++) {
+        Value sum(0.0f);
+        for (int i = 0; i < n_inputs; i++) {
+            sum += Value(0.5f) * Value(0.1f);
+        }
+        sum += Value(0.1f);
+        sum.tanh();
+    }
+}
+
+void bench_backward_dispatch(int n_neurons, int n_inputs)
+{
+    std::vector<StringNode> string_nodes = build_string_graph(n_neurons, n_inputs);
+    double n_nodes = string_nodes.size();
+    double string_ns = time_ns([&]() {
+        for (auto it = string_nodes.rbegin(); it != string_nodes.rend(); ++it) {
+            it->grad = 1.0f;
+            it->backward_single();
+        }
+    }, 20);
+
+    Tape& tape = Tape::current();
+    tape.clear();
+    build_tape_graph(n_neurons, n_inputs);
+    double table_ns = time_ns([&]() {
+        for (uint32_t id = tape.size(); id-- > 0;) {
+            tape[id].grad = 1.0f;
+            tape.backward_node(id);
+        }
+    }, 20);
+
+    std::printf("backward over %d neurons x %d inputs (%.0f nodes)\n", n_neurons, n_inputs, n_nodes);
+    report("  string dispatch, per node", string_ns / n_nodes, "ns");
+    report("  op table, per node", table_ns / n_nodes, "ns");
+    report("  string node size", sizeof(StringNode), "bytes");
+    report("  tape node size", sizeof(Node), "bytes");
+    tape.clear();
+}
+
+// A layer of n_neurons tanh neurons over shared inputs, summed into one root
+static Value build_layer_graph(std::span<const Value> inputs, int n_neurons)
+{
+    Value total(0.0f);
+    for (int n = 0; n < n_neurons; n++) {
+        Value sum(0.1f);
+        for (const Value& x : inputs) {
+            sum += x * Value(0.01f * n);
+        }
+        total += sum.tanh();
+    }
+    return total;
+}
+
+void bench_value_ops(int n_neurons, int n_inputs)
+{
+    Tape& tape = Tape::current();
+    tape.clear();
+    std::vector<Value> inputs;
+    for (int i = 0; i < n_inputs; i++) {
+        inputs.push_back(Value(0.5f));
+    }
+    size_t mark = tape.mark();
+    Value root = build_layer_graph(inputs, n_neurons);
+    double n_nodes = tape.size() - mark;
+    double construct_ns = time_ns([&]() {
+        tape.rewind(mark);
+        root = build_layer_graph(inputs, n_neurons);
+    }, 20);
+    double backward_ns = time_ns([&]() { root.backward(); }, 20);
+
+    std::printf("value ops over %d neurons x %d inputs (%.0f nodes)\n", n_neurons, n_inputs, n_nodes);
+    report("  construction, per node", construct_ns / n_nodes, "ns");
+    report("  backward (sort + kernels), per node", backward_ns / n_nodes, "ns");
+    tape.clear();
+}
+
+void bench_program_replay(int n_neurons, int n_inputs)
+{
+    Tape& tape = Tape::current();
+    tape.clear();
+    std::vector<float> data(n_inputs, 0.5f);
+    std::vector<Value> inputs;
+    Schedule schedule;
+    double rebuild_ns = time_ns([&]() {
+        tape.rewind(0);
+        inputs.clear();
+        for (float d : data) {
+            inputs.push_back(Value(d));
+        }
+        build_layer_graph(inputs, n_neurons).backward(schedule);
+    }, 20);
+
+    tape.clear();
+    inputs.clear();
+    for (float d : data) {
+        inputs.push_back(Value(d));
+    }
+    Program program = Program::compile(build_layer_graph(inputs, n_neurons), inputs);
+    double replay_ns = time_ns([&]() {
+        program.forward(data);
+        program.backward();
+    }, 20);
+    size_t n_instructions = program.get_instructions().size();
+    program.optimize();
+    double optimized_ns = time_ns([&]() {
+        program.forward(data);
+        program.backward();
+    }, 20);
+
+    std::printf("training step over %d neurons x %d inputs (%zu instructions, %zu optimized)\n",
+                n_neurons, n_inputs, n_instructions, program.get_instructions().size());
+    report("  rebuild graph + backward", rebuild_ns / 1e3, "us");
+    report("  compiled program replay", replay_ns / 1e3, "us");
+    report("  optimized program replay", optimized_ns / 1e3, "us");
+    report("  speedup, compiled", rebuild_ns / replay_ns, "x");
+    report("  speedup, optimized", rebuild_ns / optimized_ns, "x");
+    tape.clear();
+}
+
+void bench_batch_loss(int batch, int n_outputs)
+{
+    Tape& tape = Tape::current();
+    tape.clear();
+    size_t n = static_cast<size_t>(batch) * n_outputs;
+    std::vector<Value> outputs, targets;
+    for (size_t i = 0; i < n; i++) {
+        outputs.push_back(Value(0.01f * (i % 100)));
+        targets.push_back(Value(i % 2 ? 1.0f : 0.0f));
+    }
+    size_t mark = tape.mark();
+    double composed_ns = time_ns([&]() {
+        tape.rewind(mark);
+        Value sum(0.0f);
+        for (size_t i = 0; i < n; i++) {
+            Value diff = outputs[i] - targets[i];
+            sum += diff * diff;
+        }
+        (sum / static_cast<float>(batch)).backward();
+    }, 20);
+    size_t composed_nodes = tape.size() - mark;
+    double fused_ns = time_ns([&]() {
+        tape.rewind(mark);
+        loss(outputs, targets, batch).backward();
+    }, 20);
+
+    std::printf("mse loss over %d x %d outputs (%zu nodes composed, 1 fused)\n", batch, n_outputs, composed_nodes);
+    report("  composed", composed_ns / 1e3, "us");
+    report("  fused", fused_ns / 1e3, "us");
+    report("  speedup", composed_ns / fused_ns, "x");
+    tape.clear();
+}
+
+void bench_graph_export(int n_neurons, int n_inputs)
+{
+    Tape& tape = Tape::current();
+    tape.clear();
+    std::vector<Value> inputs;
+    for (int i = 0; i < n_inputs; i++) {
+        inputs.push_back(Value(0.5f));
+    }
+    Value root = build_layer_graph(inputs, n_neurons);
+    GraphOptions collapsed;
+    collapsed.collapse_neurons = true;
+    size_t n_nodes = 0;
+    std::printf("graph export, %zu tape nodes\n", tape.size());
+    report("  dot", time_ns([&]() { n_nodes = Graph().write_dot(root, "/tmp/micrograd_bench_graph.dot"); }, 3) / 1e6,
+           "ms");
+    report("  json", time_ns([&]() { Graph().write_json(root, "/tmp/micrograd_bench_graph.json"); }, 3) / 1e6, "ms");
+    report("  dot, neurons collapsed",
+           time_ns([&]() { Graph(collapsed).write_dot(root, "/tmp/micrograd_bench_graph.dot"); }, 3) / 1e6, "ms");
+    report("  nodes written", static_cast<double>(n_nodes), "");
+    tape.clear();
+}
+
+int main()
+{
+    bench_value_ops(128, 784);
+    bench_backward_dispatch(128, 784);
+    bench_backward_dispatch(1024, 16);
+    bench_program_replay(128, 64);
+    bench_program_replay(1024, 16);
+    bench_batch_loss(64, 10);
+    bench_batch_loss(256, 100);
+    bench_graph_export(128, 784);
+}
@@ -2,9 +2,13 @@
 //
 #include <assert.h> 
 #include <iostream>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <sstream>
 
-// #include "engine.cc"
-#include "graph_system.cc"
+#include "graph_system.h"
+#include "program.h"
 
 void test_value_constructor()
 {
@@ -119,6 +123,218 @@ void test_float_ops()
     assert(v2.get_data() == 7.0);
 }
 
+void test_math_functions()
+{
+    // Every op's gradient against a central finite difference, on the tape
+    // and in a compiled program
+    Tape& tape = Tape::current();
+    size_t mark = tape.mark();
+    std::function<Value(Value)> functions[] = {
+        [](Value x) { return Value(1.5f) / x; },
+        [](Value x) { return x / 4.0f; },
+        [](Value x) { return x.pow(3.0f); },
+        [](Value x) { return x.pow(-0.5f); },
+        [](Value x) { return x.exp(); },
+        [](Value x) { return x.log(); },
+        [](Value x) { return (x - 1.0f).relu() + (-x).relu(); },
+        [](Value x) { return (x * 3.0f).sigmoid(); },
+        [](Value x) { Value y = x; y /= x + 1.0f; return y; },
+    };
+    for (auto& f : functions) {
+        for (float x : { 0.3f, 1.7f }) {
+            Value input(x);
+            Value y = f(input);
+            y.backward();
+            float h = 1e-3f;
+            float numeric = (f(Value(x + h)).get_data() - f(Value(x - h)).get_data()) / (2 * h);
+            assert(std::fabs(input.get_grad() - numeric) < 1e-2f * std::max(1.0f, std::fabs(numeric)));
+
+            Value inputs[] = { input };
+            Program program = Program::compile(y, inputs);
+            assert(program.forward() == y.get_data());
+            program.backward();
+            assert(std::fabs(program.get_input_grads()[0] - input.get_grad()) < 1e-6f);
+            tape.rewind(mark);
+        }
+    }
+
+    // the sigmoid does not overflow for large inputs
+    assert(Value(-200.0f).sigmoid().get_data() == 0.0f);
+    assert(Value(200.0f).sigmoid().get_data() == 1.0f);
+    tape.rewind(mark);
+}
+
+void test_cross_entropy()
+{
+    // Fused loss against the same loss built from exp / log
+    Tape& tape = Tape::current();
+    size_t mark = tape.mark();
+    std::vector<Value> logits = { Value(1.0f), Value(-2.0f), Value(0.5f), Value(3.0f) };
+    Value loss = cross_entropy(logits, 2);
+    loss.backward();
+
+    std::vector<Value> copies;
+    Value sum(0.0f);
+    for (const Value& z : logits) {
+        copies.push_back(Value(z.get_data()));
+        sum += copies.back().exp();
+    }
+    Value expected = sum.log() - copies[2];
+    expected.backward();
+    assert(std::fabs(loss.get_data() - expected.get_data()) < 1e-5f);
+    for (size_t i = 0; i < logits.size(); i++) {
+        assert(std::fabs(logits[i].get_grad() - copies[i].get_grad()) < 1e-5f);
+    }
+
+    // stable for logits far out of exp's range
+    std::vector<Value> large = { Value(1000.0f), Value(990.0f) };
+    Value stable = cross_entropy(large, 1);
+    assert(std::fabs(stable.get_data() - 10.0f) < 1e-3f);
+
+    // a compiled program recomputes it for new logits
+    Program program = Program::compile(loss, logits);
+    float data[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    assert(std::fabs(program.forward(data) - std::log(4.0f)) < 1e-6f);
+    program.backward();
+    assert(std::fabs(program.get_input_grads()[2] - (0.25f - 1.0f)) < 1e-6f);
+    assert(std::fabs(program.get_input_grads()[0] - 0.25f) < 1e-6f);
+
+    // rewinding cuts the side arrays with the node
+    size_t inner = tape.mark();
+    cross_entropy(logits, 0);
+    tape.rewind(inner);
+    assert(cross_entropy(logits, 2).get_data() == loss.get_data());
+
+    // a target that is not one of the logits records nothing
+    size_t before = tape.size();
+    for (int target : { -1, 4 }) {
+        bool thrown = false;
+        try {
+            cross_entropy(logits, target);
+        } catch (const std::invalid_argument&) {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+    bool thrown = false;
+    try {
+        cross_entropy(std::span<const Value>(), 0);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    assert(thrown && tape.size() == before);
+    tape.rewind(mark);
+}
+
+void test_batch_losses()
+{
+    // Each fused loss is one node and matches the loss composed from Values
+    Tape& tape = Tape::current();
+    size_t mark = tape.mark();
+    const int batch = 2;
+    float y[6] = { 0.5f, -1.0f, 2.0f, 0.1f, 0.3f, -0.7f };
+    float t[6] = { 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, -1.0f };
+    auto values = [](const float* data, int n) {
+        std::vector<Value> out;
+        for (int i = 0; i < n; i++) {
+            out.push_back(Value(data[i]));
+        }
+        return out;
+    };
+    auto composed = [&](Loss kind, std::vector<Value>& outputs) {
+        Value sum(0.0f);
+        for (int i = 0; i < 6; i++) {
+            if (kind == Loss::MSE) {
+                Value diff = outputs[i] - t[i];
+                sum += diff * diff;
+            } else {
+                sum += (outputs[i] * -t[i] + 1.0f).relu();
+            }
+        }
+        return sum / static_cast<float>(batch);
+    };
+
+    for (Loss kind : { Loss::MSE, Loss::Hinge }) {
+        std::vector<Value> outputs = values(y, 6);
+        std::vector<Value> targets = values(t, 6);
+        size_t before = tape.size();
+        Value fused = loss(outputs, targets, batch, kind);
+        assert(tape.size() == before + 1);
+        fused.backward();
+
+        std::vector<Value> copies = values(y, 6);
+        Value expected = composed(kind, copies);
+        expected.backward();
+        assert(std::fabs(fused.get_data() - expected.get_data()) < 1e-5f);
+        for (int i = 0; i < 6; i++) {
+            assert(std::fabs(outputs[i].get_grad() - copies[i].get_grad()) < 1e-5f);
+            assert(targets[i].get_grad() == 0.0f);
+        }
+
+        // the batched version gives the same loss and gradients
+        Matrix outputs_matrix(batch, 3), targets_matrix(batch, 3), grads;
+        std::copy(y, y + 6, outputs_matrix.data());
+        std::copy(t, t + 6, targets_matrix.data());
+        assert(std::fabs(loss(outputs_matrix, targets_matrix, grads, kind) - fused.get_data()) < 1e-6f);
+        for (int i = 0; i < 6; i++) {
+            assert(std::fabs(grads.data()[i] - outputs[i].get_grad()) < 1e-6f);
+        }
+        tape.rewind(mark);
+    }
+
+    // softmax cross-entropy is the mean of the per-sample cross_entropy
+    std::vector<Value> logits = values(y, 6);
+    std::vector<Value> classes = { Value(2.0f), Value(0.0f) };
+    Value fused = loss(logits, classes, batch, Loss::SoftmaxCrossEntropy);
+    fused.backward();
+    std::vector<Value> copies = values(y, 6);
+    Value expected = (cross_entropy(std::span(copies).first(3), 2) + cross_entropy(std::span(copies).last(3), 0)) * 0.5f;
+    expected.backward();
+    assert(std::fabs(fused.get_data() - expected.get_data()) < 1e-5f);
+    for (int i = 0; i < 6; i++) {
+        assert(std::fabs(logits[i].get_grad() - copies[i].get_grad()) < 1e-5f);
+    }
+
+    // a compiled program recomputes the loss and its gradient for new outputs
+    Program program = Program::compile(fused, logits);
+    float zeros[6] = {};
+    assert(std::fabs(program.forward(zeros) - std::log(3.0f)) < 1e-6f);
+    program.backward();
+    assert(std::fabs(program.get_input_grads()[2] - (1.0f / 3 - 1.0f) / batch) < 1e-6f);
+    assert(std::fabs(program.get_input_grads()[4] - 1.0f / 3 / batch) < 1e-6f);
+
+    bool thrown = false;
+    try {
+        loss(logits, classes, 4);
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    assert(thrown);
+
+    // class targets that are not one of the 3 outputs record nothing
+    auto refused = [](auto&& compute) {
+        try {
+            compute();
+        } catch (const std::invalid_argument&) {
+            return true;
+        }
+        return false;
+    };
+    Program targets_program = Program::compile(fused, classes);
+    for (float bad : { -1.0f, 3.0f, 0.5f, NAN }) {
+        std::vector<Value> wrong = { Value(2.0f), Value(bad) };
+        size_t before = tape.size();
+        assert(refused([&]() { loss(logits, wrong, batch, Loss::SoftmaxCrossEntropy); }));
+        assert(tape.size() == before);
+        Matrix outputs_matrix(batch, 3), targets_matrix(batch, 1), grads;
+        targets_matrix(1, 0) = bad;
+        assert(refused([&]() { loss(outputs_matrix, targets_matrix, grads, Loss::SoftmaxCrossEntropy); }));
+        float inputs[2] = { 2.0f, bad };
+        assert(refused([&]() { targets_program.forward(inputs); }));
+    }
+    tape.rewind(mark);
+}
+
 void test_imitation_of_training()
 {
     // Test imitation of training
@@ -166,6 +382,297 @@ void test_imitation_of_training()
     assert((v15.get_data() - y) < (v10.get_data() - y));
 }
 
+void test_temporaries_in_graph()
+{
+    // Constants and intermediate results only live on the tape,
+    // backward must still reach them after the handles are gone
+    Value x(3.0, "x");
+    Value y = (x + 2.0f) * x;
+    y.backward();
+    assert(y.get_data() == 15.0);
+    assert(x.get_grad() == 8.0);  // d/dx (x^2 + 2x) = 2x + 2
+
+    Value a(2.0, "a");
+    Value acc(0.0);
+    for (int i = 0; i < 3; i++) {
+        acc += a * a;
+    }
+    acc.backward();
+    assert(acc.get_data() == 12.0);
+    assert(a.get_grad() == 12.0);  // d/da 3a^2 = 6a
+}
+
+void test_tape_rewind()
+{
+    // Rewinding drops the graph but keeps the nodes before the mark
+    // and the capacity of the tape
+    Tape& tape = Tape::current();
+    Value w(0.5, "w");
+    size_t mark = tape.mark();
+
+    size_t capacity = 0;
+    for (int step = 0; step < 3; step++) {
+        Value x(2.0, "x");
+        Value y = (x * w).tanh();
+        y.backward();
+        if (step == 0) {
+            capacity = tape.capacity();
+        }
+        assert(tape.capacity() == capacity);
+        tape.rewind(mark);
+        assert(tape.size() == mark);
+        assert(tape.get_label(mark) == "");
+    }
+    assert(w.get_label() == "w");
+    assert(w.get_data() == 0.5f);
+}
+
+void test_deep_graph_backward()
+{
+    // A long += chain is as deep as it is long; backward must not recurse
+    Value x(1.0, "x");
+    Value acc(0.0);
+    for (int i = 0; i < 1000000; i++) {
+        acc += x;
+    }
+    acc.backward();
+    assert(x.get_grad() == 1000000.0);
+    Tape::current().clear();
+}
+
+void test_backward_schedule()
+{
+    // Replaying a cached schedule gives the same gradients as sorting again
+    Tape& tape = Tape::current();
+    size_t mark = tape.mark();
+    Schedule schedule;
+    for (int step = 0; step < 3; step++) {
+        Value a(2.0, "a");
+        Value b(-3.0, "b");
+        Value y = (a * b + a).tanh();
+        if (step > 0) {
+            assert(schedule.matches(y.get_id(), tape));
+        }
+        y.backward(schedule);
+        float expected = (1 - y.get_data() * y.get_data()) * (b.get_data() + 1);
+        assert(std::fabs(a.get_grad() - expected) < 1e-6);
+        tape.rewind(mark);
+    }
+}
+
+void test_bind_parameters()
+{
+    // Bound nodes copy the parameters in and add their grads back out
+    float data[2] = { 2.0f, -1.0f };
+    float grad[2] = { 0.5f, 0.0f };
+    Tape& tape = Tape::current();
+    size_t mark = tape.mark();
+    uint32_t first = tape.bind(data, grad, 2);
+    Value a(&tape, first);
+    Value b(&tape, first + 1);
+    assert(a.get_data() == 2.0f && b.get_data() == -1.0f);
+
+    Value y = a * b;
+    y.backward();
+    assert(grad[0] == 0.5f - 1.0f);
+    assert(grad[1] == 2.0f);
+    // a second backward adds again instead of re-adding the first one
+    y.backward();
+    assert(grad[1] == 4.0f);
+
+    tape.rewind(mark);
+    Value z = Value(1.0) * 2.0f;
+    z.backward();
+    assert(grad[1] == 4.0f);
+    tape.rewind(mark);
+
+    // With an owner, grads only reach the block while the owner lives
+    auto owner = std::make_shared<std::vector<float>>(4, 0.0f);
+    first = tape.bind(data, owner->data(), 2, owner);
+    Value c(&tape, first);
+    Value w = c * 3.0f;
+    w.backward();
+    assert((*owner)[0] == 3.0f);
+    std::weak_ptr<std::vector<float>> alive = owner;
+    owner.reset();
+    assert(alive.expired());
+    w.backward();
+    assert(c.get_grad() == 0.0f);
+    tape.rewind(mark);
+}
+
+void test_program_replay()
+{
+    // A compiled program matches the tape on the graph it was compiled
+    // from, and replaying it with new inputs matches rebuilding the graph
+    Tape& tape = Tape::current();
+    size_t mark = tape.mark();
+    auto build = [](Value x1, Value x2, Value w1, Value w2) {
+        Value y = (x1 * w1 + x2 * w2 + 0.5f).tanh();
+        return y * y - x1 + (-x2);
+    };
+
+    Value x1(0.3f), x2(-1.2f), w1(0.7f), w2(-0.4f);
+    Value y = build(x1, x2, w1, w2);
+    Value inputs[] = { x1, x2 };
+    Program program = Program::compile(y, inputs);
+    assert(program.get_n_inputs() == 2);
+    assert(program.get_n_leaves() == 5);
+    assert(program.get_instructions().size() == 9);
+    assert(program.forward() == y.get_data());
+
+    y.backward();
+    program.backward();
+    assert(program.get_input_grads()[0] == x1.get_grad());
+    assert(program.get_input_grads()[1] == x2.get_grad());
+    assert(program.get_grads()[program.get_slot(w1)] == w1.get_grad());
+    assert(program.get_grads()[program.get_slot(w2)] == w2.get_grad());
+    tape.rewind(mark);
+
+    for (int step = 0; step < 3; step++) {
+        float data[2] = { 0.1f * step, 1.0f - step };
+        Value a(data[0]), b(data[1]);
+        Value rebuilt = build(a, b, Value(0.7f), Value(-0.4f));
+        rebuilt.backward();
+        assert(program.forward(data) == rebuilt.get_data());
+        program.backward();
+        assert(program.get_input_grads()[0] == a.get_grad());
+        assert(program.get_input_grads()[1] == b.get_grad());
+        tape.rewind(mark);
+    }
+
+    // only leaves can be inputs
+    Value z = Value(1.0f) + Value(2.0f);
+    bool thrown = false;
+    try {
+        Program::compile(z, std::span<const Value>(&z, 1));
+    } catch (const std::invalid_argument&) {
+        thrown = true;
+    }
+    assert(thrown);
+    tape.rewind(mark);
+}
+
+void test_program_optimize()
+{
+    // Folding, CSE and fusion keep the values and gradients
+    Tape& tape = Tape::current();
+    size_t mark = tape.mark();
+    Value x[3] = { Value(0.3f), Value(-1.2f), Value(0.8f) };
+    Value w[3] = { Value(0.7f), Value(-0.4f), Value(0.2f) };
+    Value b(0.1f);
+
+    // a neuron, a repeated subexpression and a constant-only subexpression
+    Value sum(0.0f);
+    for (int i = 0; i < 3; i++) {
+        sum += x[i] * w[i];
+    }
+    Value neuron = (sum + b).tanh();
+    Value k = Value(&tape, tape.push(2.0f, Op::Const)) * 3.0f;
+    Value y = neuron * (x[0] * w[1]) + (x[0] * w[1]) * k + neuron * 1.0f;
+    y.backward();
+
+    Program program = Program::compile(y, x);
+    Program optimized = Program::compile(y, x);
+    optimized.optimize();
+    assert(optimized.get_instructions().size() < program.get_instructions().size());
+    assert(optimized.get_n_registers() < program.get_n_registers());
+    int n_fused = 0;
+    for (const Instruction& in : optimized.get_instructions()) {
+        n_fused += in.op == Op::DotTanh;
+        assert(in.op != Op::Tanh);
+    }
+    assert(n_fused == 1);
+
+    for (int step = 0; step < 3; step++) {
+        float data[3] = { 0.3f - step, -1.2f + 0.5f * step, 0.8f };
+        float expected = program.forward(data);
+        program.backward();
+        assert(std::fabs(optimized.forward(data) - expected) < 1e-5);
+        optimized.backward();
+        for (int i = 0; i < 3; i++) {
+            assert(std::fabs(optimized.get_input_grads()[i] - program.get_input_grads()[i]) < 1e-5);
+            uint32_t slot = program.get_slot(w[i]);
+            assert(optimized.get_slot(w[i]) == slot);
+            assert(std::fabs(optimized.get_grads()[slot] - program.get_grads()[slot]) < 1e-5);
+        }
+    }
+    tape.rewind(mark);
+}
+
+void test_graph_export()
+{
+    // Nodes are keyed by tape index: equal labels stay separate nodes
+    Tape& tape = Tape::current();
+    size_t mark = tape.mark();
+    Value a(2.0f, "x");
+    Value b(3.0f, "x");
+    Value y = (a * b + a).tanh();
+    std::ostringstream dot;
+    assert(Graph().write_dot(y, dot) == 5);
+    std::string text = dot.str();
+    assert(text.find("node" + std::to_string(a.get_id()) + " [") != std::string::npos);
+    assert(text.find("node" + std::to_string(b.get_id()) + " [") != std::string::npos);
+    assert(text.back() == '\n' && text[text.size() - 2] == '}');
+
+    // depth cap: the root, its add, and the add's children
+    GraphOptions shallow;
+    shallow.max_depth = 2;
+    std::ostringstream json;
+    assert(Graph(shallow).write_json(y, json) == 4);
+    assert(json.str().find("\"truncated\":true") != std::string::npos);
+    assert(json.str().rfind("{\"nodes\":[", 0) == 0);
+
+    // a neuron as Neuron::forward records it collapses into one node fed by
+    // its inputs only
+    std::vector<Value> x = { Value(0.5f, "x0"), Value(-1.0f, "x1"), Value(2.0f, "x2") };
+    Value sum(0.0f);
+    for (int i = 0; i < 3; i++) {
+        sum += x[i] * Value(0.1f * i);
+    }
+    Value neuron = (sum + Value(0.2f)).tanh();
+    GraphOptions collapsed;
+    collapsed.collapse_neurons = true;
+    std::ostringstream out;
+    assert(Graph(collapsed).write_json(neuron, out) == 4);
+    assert(out.str().find("\"op\":\"neuron\"") != std::string::npos);
+    assert(out.str().find("\"weights\":3") != std::string::npos);
+    assert(Graph().write_dot(neuron, dot) == 16);
+    std::ostringstream clustered;
+    Graph(collapsed).write_dot(neuron, clustered);
+    assert(clustered.str().find("subgraph cluster_" + std::to_string(neuron.get_id()) + " {") != std::string::npos);
+
+    // a computed last addend is not a bias: drawn expanded
+    Value computed = (sum + Value(0.1f) * Value(2.0f)).tanh();
+    std::ostringstream expanded;
+    assert(Graph(collapsed).write_json(computed, expanded) == Graph().write_dot(computed, dot));
+    assert(expanded.str().find("\"op\":\"neuron\"") == std::string::npos);
+
+    // a deep chain is written iteratively
+    Value acc(0.0f);
+    for (int i = 0; i < 100000; i++) {
+        acc += a;
+    }
+    std::ostringstream deep;
+    assert(Graph().write_dot(acc, deep) == 100002);
+
+    // rendering never goes through a shell: a quote in a path is just part
+    // of the name, and only known formats are accepted
+    const std::string marker = "/tmp/micrograd_render_injected";
+    std::remove(marker.c_str());
+    Graph::render("missing.dot'; touch " + marker + "; '", "out.png");
+    std::ifstream injected(marker);
+    assert(!injected);
+    bool refused = false;
+    try {
+        Graph::render("missing.dot", "out", "png -o /tmp/x");
+    } catch (const std::invalid_argument&) {
+        refused = true;
+    }
+    assert(refused);
+    tape.rewind(mark);
+}
+
 int main()
 {
     // test_value_constructor();
@@ -179,4 +686,15 @@ int main()
     // test_integer_ops();
     // test_float_ops();
     test_imitation_of_training();
+    test_temporaries_in_graph();
+    test_tape_rewind();
+    test_deep_graph_backward();
+    test_backward_schedule();
+    test_bind_parameters();
+    test_program_replay();
+    test_program_optimize();
+    test_math_functions();
+    test_cross_entropy();
+    test_batch_losses();
+    test_graph_export();
 }
\ No newline at end of file
@@ -1,140 +1,234 @@
-// System setup for graphviz. Builds a graph of the computation graph
-// for the Value class.
+// Implementations from graph_system.h
+//
 
-// Graphs are setup left to right to make it similar to neural network
-// representations. For any value in the graph, we have a rectangular
-// box with the value in the middle, label on the left, and the gradient
-// on the right. The gradient is only shown if it is not zero. All value
-// boxes except he output value are connected to operation nodes. The
-// operation nodes are circles with the operation name in the middle.
+#include "graph_system.h"
 
-
-#include <iostream>
-#include <string>
-#include <sstream>
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
 #include <fstream>
-#include <unordered_set>
-
-#include "engine.cc"
-
-class Graph {
-private:
-    std::string graph;
-    int node_count;
-    // string to value nodes str, value
-    // nodes -> node.get_key(); <node.to_string(), node.get_label(), node.get_op(), node.get_grad(), node.get_data()>
-    std::unordered_map<std::string, std::tuple<std::string, std::string, std::string, float, float>> nodes;
-    std::unordered_map<std::string, std::pair<std::string, std::string>> edges;
-
-public:
-    Graph() : graph("digraph G {\n rankdir=LR;\n splines=ortho"), node_count(0) {}
-
-    std::string get_label_rpr(std::string node_key) {
-        std::string label = std::get<1>(nodes[node_key]);
-        float data = std::get<4>(nodes[node_key]);
-        float grad = std::get<3>(nodes[node_key]);
-        // arrange precision
-        std::stringstream ss;
-        ss << "{ " << label << " | ";
-        ss.precision(4);
-        ss << std::fixed << data;
-        ss << " | ";
-        ss.precision(4);
-        ss << std::fixed << grad;
-        ss << " }";
-        return ss.str();
-    }
-
-    std::string get_op_str(std::string op) {
-        // convert op to string;
-        // + -> add / - -> sub / * -> mul / / -> div
-        if (op == "+") {
-            return "add";
-        } else if (op == "-") {
-            return "sub";
-        } else if (op == "*") {
-            return "mul";
-        } else if (op == "/") {
-            return "div";
+#include <iterator>
+#include <stdexcept>
+
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char** environ;
+
+// Graphviz record labels treat {}|<> as structure, and both formats need
+// quotes and backslashes escaped
+static void write_escaped(std::ostream& out, const std::string& text)
+{
+    for (char c : text) {
+        if (c == '"' || c == '\\' || c == '{' || c == '}' || c == '|' || c == '<' || c == '>') {
+            out << '\\';
+        }
+        out << c;
+    }
+}
+
+static void write_json_string(std::ostream& out, const std::string& text)
+{
+    out << '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out << escaped;
         } else {
-            return op;
+            out << c;
         }
     }
-
-    void add_node(std::string id, std::string label, std::string args="color=black", bool is_op=false) {
-        std::stringstream ss;
-        id = "node" + id;
-        if (is_op) {
-            ss << "\t" << id << " [label=\"" << label << "\",shape=circle," << args << "];\n";
-        } 
-        else {
-            ss << "\t" << id << " [label=\"" << label << "\",shape=record," << args << "];\n";
+    out << '"';
+}
+
+// JSON has no inf or nan
+static void write_json_number(std::ostream& out, float x)
+{
+    if (std::isfinite(x)) {
+        out << x;
+    } else {
+        out << "null";
+    }
+}
+
+// Opens path for writing, std::runtime_error if that fails
+static std::ofstream open_output(const std::string& path)
+{
+    std::ofstream file(path);
+    if (!file) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    return file;
+}
+
+// Export
+int Graph::match_neuron(const Tape& tape, uint32_t id)
+{
+    neuron_inputs.clear();
+    const Node& top = tape[id];
+    if (top.op != Op::Tanh || tape[top.children[0]].op != Op::Add) {
+        return 0;
+    }
+    // (((0 + x0 * w0) + x1 * w1) ... + b), walked from the bias down; the
+    // bias and the weights are folded into the node, so they must be leaves
+    const Node* add = &tape[top.children[0]];
+    if (tape[add->children[1]].op != Op::Leaf) {
+        return 0;
+    }
+    int n_weights = 0;
+    uint32_t next = add->children[0];
+    while (tape[next].op == Op::Add && tape[tape[next].children[1]].op == Op::Mul) {
+        const Node& product = tape[tape[next].children[1]];
+        if (tape[product.children[1]].op != Op::Leaf) {
+            break;
         }
-        graph += ss.str();
+        neuron_inputs.push_back(product.children[0]);
+        n_weights++;
+        next = tape[next].children[0];
     }
-
-    void add_edge(std::string from, std::string to) {
-        std::stringstream ss;
-        from = "node" + from;
-        to = "node" + to;
-        ss << "\t" << from << " -> " << to << ";\n";
-        graph += ss.str();
+    if (n_weights == 0 || !(tape[next].op == Op::Leaf || tape[next].op == Op::Const)) {
+        neuron_inputs.clear();
+        return 0;
     }
-
-    void trace_nodes_and_edges(Value* v) {
-        if (nodes.find(v->get_key()) != nodes.end()) {
-            return;
+    return n_weights;
+}
+
+void Graph::write_node(std::ostream& out, Format format, const Tape& tape, uint32_t id, int n_weights, bool truncated,
+                bool first)
+{
+    const Node& node = tape[id];
+    std::string label = tape.get_label(id);
+    const char* op = n_weights > 0 ? "neuron" : op_name(node.op);
+    if (format == Format::Json) {
+        out << (first ? "\n" : ",\n") << "{\"id\":" << id << ",\"label\":";
+        write_json_string(out, label);
+        out << ",\"op\":\"" << op << "\",\"data\":";
+        write_json_number(out, node.data);
+        out << ",\"grad\":";
+        write_json_number(out, node.grad);
+        out << ",\"depth\":" << depth[id];
+        if (n_weights > 0) {
+            out << ",\"weights\":" << n_weights;
         }
-        std::string node_key = v->get_key();
-        nodes[node_key] = std::make_tuple(v->to_string(), v->get_label(), v->get_op(), v->get_grad(), v->get_data());
-        for (Value* child : v->get_children()) {
-            std::string child_key = child->get_key();
-            if (edges.find(child_key + node_key) == edges.end()) {
-                edges[child_key + node_key] = std::make_pair(child_key, node_key);
-                trace_nodes_and_edges(child);
-            }
+        if (truncated) {
+            out << ",\"truncated\":true";
         }
+        out << ",\"children\":[";
+        return;  // children are written as they are reached
     }
 
-    void trace_graph(Value v) {
-        trace_nodes_and_edges(&v);
-        for (auto& node : nodes) {
-            std::string node_key = node.first;
-            std::string label = get_label_rpr(node_key);
-            std::string op = std::get<2>(node.second);
-            std::string node_op_str = get_op_str(op);
-            add_node(node_key, label,
-            "color=white,style=\"filled,rounded\",fillcolor=\"indianred4:lightcoral\",fontcolor=white,border=3");
-            if (node_op_str != ""){
-                add_node(node_key + node_op_str, op, "color=white,style=filled,fillcolor=\"webmaroon\",fontcolor=oldlace", true);
-                add_edge(node_key + node_op_str, node_key);
+    // A collapsed neuron is drawn as a cluster around its op and value nodes
+    if (n_weights > 0) {
+        out << "\tsubgraph cluster_" << id << " {\n\tlabel=\"neuron " << id
+            << "\";style=\"rounded,dashed\";color=webmaroon;\n";
+    }
+    char numbers[64];
+    std::snprintf(numbers, sizeof(numbers), " | %.4f | %.4f }", node.data, node.grad);
+    out << "\tnode" << id << " [label=\"{ ";
+    write_escaped(out, label);
+    out << numbers << "\",shape=record,color=white,style=\"filled,rounded"
+        << (truncated ? ",dashed" : "")
+        << "\",fillcolor=\"indianred4:lightcoral\",fontcolor=white];\n";
+    if (*op != '\0') {
+        out << "\tnode" << id << "_op [label=\"" << op;
+        if (n_weights > 0) {
+            out << "\\n" << n_weights << " weights";
+        }
+        out << "\",shape=" << (n_weights > 0 ? "box" : "circle")
+            << ",color=white,style=filled,fillcolor=\"webmaroon\",fontcolor=oldlace];\n";
+        out << "\tnode" << id << "_op -> node" << id << ";\n";
+    }
+    if (n_weights > 0) {
+        out << "\t}\n";
+    }
+}
+
+void Graph::write_edge(std::ostream& out, Format format, uint32_t child, uint32_t parent, bool first)
+{
+    if (format == Format::Json) {
+        out << (first ? "" : ",") << child;
+    } else {
+        out << "\tnode" << child << " -> node" << parent << "_op;\n";
+    }
+}
+
+size_t Graph::write(const Value& root, std::ostream& out, Format format)
+{
+    const Tape& tape = *root.get_tape();
+    depth.assign(tape.size(), -1);
+    queue.clear();
+    queue.push_back(root.get_id());
+    depth[root.get_id()] = 0;
+    out << (format == Format::Json ? "{\"nodes\":[" : "digraph G {\n rankdir=LR;\n");
+
+    for (size_t head = 0; head < queue.size(); head++) {
+        uint32_t id = queue[head];
+        int n_weights = options.collapse_neurons ? match_neuron(tape, id) : 0;
+        std::span<const uint32_t> children = n_weights > 0 ? std::span<const uint32_t>(neuron_inputs)
+                                                           : tape.get_children(id);
+        bool expand = options.max_depth < 0 || depth[id] < options.max_depth;
+        write_node(out, format, tape, id, n_weights, !expand && !children.empty(), head == 0);
+        if (!expand) {
+            children = {};
+        }
+        bool first = true;
+        for (uint32_t child : children) {
+            if (depth[child] < 0) {
+                depth[child] = depth[id] + 1;
+                queue.push_back(child);
             }
+            write_edge(out, format, child, id, first);
+            first = false;
         }
-        for (auto& edge : edges) {
-            std::string to_op = get_op_str(std::get<2>(nodes[edge.second.second]));
-            add_edge(edge.second.first, edge.second.second + to_op);
+        if (format == Format::Json) {
+            out << "]}";
         }
-
-        graph += "}";
     }
-
-    void write_to_file(const std::string& filename) {
-        std::ofstream file;
-        file.open(filename + ".dot");
-        file << graph;
-        file.close();
+    out << (format == Format::Json ? "\n]}\n" : "}\n");
+    return queue.size();
+}
+
+size_t Graph::write_dot(const Value& root, const std::string& path)
+{
+    std::ofstream file = open_output(path);
+    return write(root, file, Format::Dot);
+}
+
+size_t Graph::write_json(const Value& root, const std::string& path)
+{
+    std::ofstream file = open_output(path);
+    return write(root, file, Format::Json);
+}
+
+// Rendering
+bool Graph::render(const std::string& dot_path, const std::string& image_path, const std::string& format)
+{
+    static const char* formats[] = { "png", "svg", "pdf", "jpg", "gif", "ps", "json" };
+    if (std::find(std::begin(formats), std::end(formats), format) == std::end(formats)) {
+        throw std::invalid_argument("unknown graphviz format " + format);
     }
-
-    void draw(const Value v, const std::string& filename) {
-        trace_graph(v);
-        write_to_file(filename);
-        
-        // gout renders the graph
-        std::string cmd = "dot -Tpng " + filename + ".dot -o " + filename + ".png";
-        system(cmd.c_str());
+    // dot gets the paths as arguments, never through a shell
+    std::string type = "-T" + format;
+    const char* args[] = { "dot", type.c_str(), dot_path.c_str(), "-o", image_path.c_str(), nullptr };
+    pid_t pid;
+    if (posix_spawnp(&pid, "dot", nullptr, nullptr, const_cast<char* const*>(args), environ) != 0) {
+        return false;
     }
-
-    ~Graph() {
-        // std::cout << graph << std::endl;
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
     }
-};
\ No newline at end of file
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void Graph::draw(const Value& v, const std::string& filename)
+{
+    write_dot(v, filename + ".dot");
+    render(filename + ".dot", filename + ".png");
+}
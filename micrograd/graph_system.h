@@ -0,0 +1,78 @@
+#pragma once
+
+// System setup for graphviz. Builds a graph of the computation graph
+// for the Value class.
+
+// Graphs are setup left to right to make it similar to neural network
+// representations. For any value in the graph, we have a rectangular
+// box with the value in the middle, label on the left, and the gradient
+// on the right. All value boxes except the leaves are fed by operation
+// nodes. The operation nodes are circles with the operation name in the
+// middle.
+//
+// The exporter walks the graph once, breadth first from the root, and
+// streams every node to the output as it is reached, so memory stays at
+// one depth per tape node whatever the size of the graph. Nodes are keyed by
+// their tape index, never by label. Rendering the DOT file with graphviz is
+// a separate, optional step.
+
+#include "engine.h"
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+struct GraphOptions {
+    // Only nodes at most this many edges below the root; -1 for all.
+    // Nodes at the limit whose children were left out are marked truncated.
+    int max_depth = -1;
+    // Draw each neuron (tanh of a chain of x * w additions plus a bias, as
+    // Neuron::forward records it, with leaf weights and bias) as one node fed
+    // by its inputs, the weights and bias folded in. In DOT the node sits in
+    // its own subgraph cluster_<id>. Anything else that ends in a tanh is
+    // drawn expanded.
+    bool collapse_neurons = false;
+};
+
+class Graph {
+private:
+    GraphOptions options;
+    // Depth of every visited node (-1 if not reached), by tape index, and
+    // the breadth-first queue
+    std::vector<int> depth;
+    std::vector<uint32_t> queue;
+    // Inputs of the neuron being collapsed
+    std::vector<uint32_t> neuron_inputs;
+
+    enum class Format { Dot, Json };
+
+    // Matches the neuron ending at id and collects its inputs; returns the
+    // number of weights, 0 if id is not a neuron
+    int match_neuron(const Tape& tape, uint32_t id);
+    void write_node(std::ostream& out, Format format, const Tape& tape, uint32_t id, int n_weights, bool truncated,
+                    bool first);
+    void write_edge(std::ostream& out, Format format, uint32_t child, uint32_t parent, bool first);
+    size_t write(const Value& root, std::ostream& out, Format format);
+
+public:
+    explicit Graph(GraphOptions options = {}) : options(options) {}
+
+    // Stream the graph below root; return the number of value nodes written.
+    // The path versions throw std::runtime_error if the file cannot be opened.
+    size_t write_dot(const Value& root, std::ostream& out) { return write(root, out, Format::Dot); }
+    size_t write_dot(const Value& root, const std::string& path);
+
+    // JSON: {"nodes": [...]} in breadth-first order, each node with its tape
+    // id, label, op, data, grad, depth and the ids of its children
+    size_t write_json(const Value& root, std::ostream& out) { return write(root, out, Format::Json); }
+    size_t write_json(const Value& root, const std::string& path);
+
+    // Run graphviz (dot, found on the PATH) on a DOT file; false if it could
+    // not be rendered. The paths go to dot as arguments, without a shell.
+    // format is one of png, svg, pdf, jpg, gif, ps or json, otherwise
+    // std::invalid_argument.
+    static bool render(const std::string& dot_path, const std::string& image_path, const std::string& format = "png");
+
+    // Write filename.dot and render it to filename.png
+    void draw(const Value& v, const std::string& filename);
+};
@@ -0,0 +1,785 @@
+// Implementations from kernels.h
+//
+// tanh is computed as sign(x) * (1 - e) / (1 + e) with e = exp(-2|x|) and a
+// Cephes-style exp: round to a power of two, degree 6 polynomial for the rest.
+// All versions use the same formula so they agree to rounding.
+
+#include "kernels.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define MICROGRAD_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+constexpr float exp_min = -87.0f;
+constexpr float log2e = 1.44269504088896341f;
+constexpr float ln2_hi = 0.693359375f;
+constexpr float ln2_lo = -2.12194440e-4f;
+constexpr float exp_p0 = 1.9875691500e-4f;
+constexpr float exp_p1 = 1.3981999507e-3f;
+constexpr float exp_p2 = 8.3334519073e-3f;
+constexpr float exp_p3 = 4.1665795894e-2f;
+constexpr float exp_p4 = 1.6666665459e-1f;
+constexpr float exp_p5 = 5.0000001201e-1f;
+
+// exp(z) for z in [exp_min, 0]
+inline float exp_neg(float z)
+{
+    z = z < exp_min ? exp_min : z;
+    float n = std::nearbyint(z * log2e);
+    float r = z - n * ln2_hi - n * ln2_lo;
+    float p = exp_p0;
+    p = p * r + exp_p1;
+    p = p * r + exp_p2;
+    p = p * r + exp_p3;
+    p = p * r + exp_p4;
+    p = p * r + exp_p5;
+    p = p * r * r + r + 1.0f;
+    int32_t bits = (static_cast<int32_t>(n) + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+inline float tanh_scalar(float x)
+{
+    float e = exp_neg(-2.0f * std::fabs(x));
+    return std::copysign((1.0f - e) / (1.0f + e), x);
+}
+
+// Portable kernels, plain loops the compiler is free to vectorize
+
+float dot_portable(const float* a, const float* b, int n)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+void axpy_portable(float alpha, const float* x, float* y, int n)
+{
+    for (int i = 0; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+void tanh_portable(const float* x, float* y, int n)
+{
+    for (int i = 0; i < n; i++) {
+        y[i] = tanh_scalar(x[i]);
+    }
+}
+
+void tanh_backward_portable(const float* y, const float* dy, float* dx, int n)
+{
+    for (int i = 0; i < n; i++) {
+        dx[i] = dy[i] * (1.0f - y[i] * y[i]);
+    }
+}
+
+double dot_mixed_portable(const float* a, const float* b, int n)
+{
+    double sum = 0.0;
+    for (int i = 0; i < n; i++) {
+        sum += static_cast<double>(a[i]) * b[i];
+    }
+    return sum;
+}
+
+void axpy_mixed_portable(float alpha, const float* x, double* y, int n)
+{
+    for (int i = 0; i < n; i++) {
+        y[i] += static_cast<double>(alpha) * x[i];
+    }
+}
+
+float dot_f16_portable(const float* x, const uint16_t* w, int n)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++) {
+        sum += x[i] * f16_to_float(w[i]);
+    }
+    return sum;
+}
+
+float dot_bf16_portable(const float* x, const uint16_t* w, int n)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++) {
+        sum += x[i] * bf16_to_float(w[i]);
+    }
+    return sum;
+}
+
+float dot_sparse_portable(const float* values, const int32_t* indices, int nnz, const float* w)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < nnz; i++) {
+        sum += values[i] * w[indices[i]];
+    }
+    return sum;
+}
+
+void axpy_sparse_portable(float alpha, const float* values, const int32_t* indices, int nnz, float* y)
+{
+    for (int i = 0; i < nnz; i++) {
+        y[indices[i]] += alpha * values[i];
+    }
+}
+
+int32_t dot_i8_portable(const int8_t* a, const int8_t* b, int n)
+{
+    int32_t sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+void dot_i8_rows4_portable(const int8_t* x, const int8_t* w, size_t stride, int n, int32_t* out)
+{
+    for (int k = 0; k < 4; k++) {
+        out[k] = dot_i8_portable(x, w + k * stride, n);
+    }
+}
+
+void quantize_i8_portable(const float* x, float scale, int8_t* q, int n)
+{
+    for (int i = 0; i < n; i++) {
+        float v = std::fmin(std::fmax(x[i] * scale, -127.0f), 127.0f);
+        q[i] = static_cast<int8_t>(std::nearbyint(v));
+    }
+}
+
+#ifdef MICROGRAD_X86_KERNELS
+
+// AVX2 + FMA, 8 floats per register, scalar tails
+
+__attribute__((target("avx2,fma")))
+inline __m256 exp_neg_avx2(__m256 z)
+{
+    z = _mm256_max_ps(z, _mm256_set1_ps(exp_min));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(z, _mm256_set1_ps(log2e)),
+                               _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(ln2_hi), z);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(ln2_lo), r);
+    __m256 p = _mm256_set1_ps(exp_p0);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(exp_p1));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(exp_p2));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(exp_p3));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(exp_p4));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(exp_p5));
+    p = _mm256_fmadd_ps(_mm256_mul_ps(p, r), r, _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+    __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(bits));
+}
+
+__attribute__((target("avx2,fma")))
+float dot_avx2(const float* a, const float* b, int n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+    float result = _mm_cvtss_f32(sum);
+    for (; i < n; i++) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+// float products are exact in double, so the mixed kernels widen each half
+// of a float register and accumulate with double FMAs
+__attribute__((target("avx2,fma")))
+double dot_mixed_avx2(const float* a, const float* b, int n)
+{
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 va = _mm256_loadu_ps(a + i);
+        __m256 vb = _mm256_loadu_ps(b + i);
+        acc0 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(va)),
+                               _mm256_cvtps_pd(_mm256_castps256_ps128(vb)), acc0);
+        acc1 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(va, 1)),
+                               _mm256_cvtps_pd(_mm256_extractf128_ps(vb, 1)), acc1);
+    }
+    __m256d acc = _mm256_add_pd(acc0, acc1);
+    __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+    double result = _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+    for (; i < n; i++) {
+        result += static_cast<double>(a[i]) * b[i];
+    }
+    return result;
+}
+
+__attribute__((target("avx2,fma")))
+void axpy_mixed_avx2(float alpha, const float* x, double* y, int n)
+{
+    __m256d a = _mm256_set1_pd(alpha);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d vx = _mm256_cvtps_pd(_mm_loadu_ps(x + i));
+        _mm256_storeu_pd(y + i, _mm256_fmadd_pd(a, vx, _mm256_loadu_pd(y + i)));
+    }
+    for (; i < n; i++) {
+        y[i] += static_cast<double>(alpha) * x[i];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline float reduce_avx2(__m256 acc)
+{
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+    return _mm_cvtss_f32(sum);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+float dot_f16_avx2(const float* x, const uint16_t* w, int n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 vw = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w + i)));
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), vw, acc);
+    }
+    float result = reduce_avx2(acc);
+    for (; i < n; i++) {
+        result += x[i] * f16_to_float(w[i]);
+    }
+    return result;
+}
+
+__attribute__((target("avx2,fma")))
+float dot_bf16_avx2(const float* x, const uint16_t* w, int n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(w + i)));
+        __m256 vw = _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16));
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), vw, acc);
+    }
+    float result = reduce_avx2(acc);
+    for (; i < n; i++) {
+        result += x[i] * bf16_to_float(w[i]);
+    }
+    return result;
+}
+
+__attribute__((target("avx2,fma")))
+float dot_sparse_avx2(const float* values, const int32_t* indices, int nnz, const float* w)
+{
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= nnz; i += 8) {
+        __m256i vi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices + i));
+        acc = _mm256_fmadd_ps(_mm256_loadu_ps(values + i), _mm256_i32gather_ps(w, vi, 4), acc);
+    }
+    float result = reduce_avx2(acc);
+    for (; i < nnz; i++) {
+        result += values[i] * w[indices[i]];
+    }
+    return result;
+}
+
+__attribute__((target("avx2,fma")))
+inline int32_t reduce_epi32_avx2(__m256i acc)
+{
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+}
+
+// maddubs multiplies unsigned by signed bytes and adds pairs into int16:
+// |a| times b with the sign of a moved onto b. With both in [-127, 127] a
+// pair sums to at most 2 * 127 * 127, so the int16 never saturates.
+__attribute__((target("avx2,fma")))
+int32_t dot_i8_avx2(const int8_t* a, const int8_t* b, int n)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        __m256i pairs = _mm256_maddubs_epi16(_mm256_abs_epi8(va), _mm256_sign_epi8(vb, va));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pairs, ones));
+    }
+    int32_t result = reduce_epi32_avx2(acc);
+    for (; i < n; i++) {
+        result += a[i] * b[i];
+    }
+    return result;
+}
+
+// Clamped in float, rounded by the conversion (to nearest even, as
+// nearbyint), then packed down to bytes
+__attribute__((target("avx2,fma")))
+void quantize_i8_avx2(const float* x, float scale, int8_t* q, int n)
+{
+    const __m256 s = _mm256_set1_ps(scale);
+    const __m256 low = _mm256_set1_ps(-127.0f);
+    const __m256 high = _mm256_set1_ps(127.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(x + i), s), low), high);
+        __m256i v32 = _mm256_cvtps_epi32(v);
+        __m128i v16 = _mm_packs_epi32(_mm256_castsi256_si128(v32), _mm256_extracti128_si256(v32, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(q + i), _mm_packs_epi16(v16, v16));
+    }
+    for (; i < n; i++) {
+        float v = std::fmin(std::fmax(x[i] * scale, -127.0f), 127.0f);
+        q[i] = static_cast<int8_t>(std::nearbyint(v));
+    }
+}
+
+// |x| and the sign are taken once per chunk of x for all four rows
+__attribute__((target("avx2,fma")))
+void dot_i8_rows4_avx2(const int8_t* x, const int8_t* w, size_t stride, int n, int32_t* out)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(),
+                       _mm256_setzero_si256() };
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i vx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i));
+        __m256i ax = _mm256_abs_epi8(vx);
+        for (int k = 0; k < 4; k++) {
+            __m256i vw = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + k * stride + i));
+            __m256i pairs = _mm256_maddubs_epi16(ax, _mm256_sign_epi8(vw, vx));
+            acc[k] = _mm256_add_epi32(acc[k], _mm256_madd_epi16(pairs, ones));
+        }
+    }
+    for (int k = 0; k < 4; k++) {
+        int32_t result = reduce_epi32_avx2(acc[k]);
+        for (int t = i; t < n; t++) {
+            result += x[t] * w[k * stride + t];
+        }
+        out[k] = result;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void axpy_avx2(float alpha, const float* x, float* y, int n)
+{
+    __m256 a = _mm256_set1_ps(alpha);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(a, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    }
+    for (; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void tanh_avx2(const float* x, float* y, int n)
+{
+    const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps(x + i);
+        __m256 sign = _mm256_and_ps(v, sign_mask);
+        __m256 abs = _mm256_andnot_ps(sign_mask, v);
+        __m256 e = exp_neg_avx2(_mm256_mul_ps(abs, _mm256_set1_ps(-2.0f)));
+        __m256 t = _mm256_div_ps(_mm256_sub_ps(one, e), _mm256_add_ps(one, e));
+        _mm256_storeu_ps(y + i, _mm256_or_ps(t, sign));
+    }
+    for (; i < n; i++) {
+        y[i] = tanh_scalar(x[i]);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+void tanh_backward_avx2(const float* y, const float* dy, float* dx, int n)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps(y + i);
+        __m256 slope = _mm256_fnmadd_ps(v, v, one);
+        _mm256_storeu_ps(dx + i, _mm256_mul_ps(_mm256_loadu_ps(dy + i), slope));
+    }
+    for (; i < n; i++) {
+        dx[i] = dy[i] * (1.0f - y[i] * y[i]);
+    }
+}
+
+// AVX-512, 16 floats per register, masked tails
+
+__attribute__((target("avx512f")))
+inline __m512 exp_neg_avx512(__m512 z)
+{
+    z = _mm512_max_ps(z, _mm512_set1_ps(exp_min));
+    __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(z, _mm512_set1_ps(log2e)),
+                                    _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(ln2_hi), z);
+    r = _mm512_fnmadd_ps(n, _mm512_set1_ps(ln2_lo), r);
+    __m512 p = _mm512_set1_ps(exp_p0);
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(exp_p1));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(exp_p2));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(exp_p3));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(exp_p4));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(exp_p5));
+    p = _mm512_fmadd_ps(_mm512_mul_ps(p, r), r, _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+    __m512i bits = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+    return _mm512_mul_ps(p, _mm512_castsi512_ps(bits));
+}
+
+__attribute__((target("avx512f")))
+inline __mmask16 tail_mask(int remaining)
+{
+    return remaining >= 16 ? 0xffff : static_cast<__mmask16>((1u << remaining) - 1);
+}
+
+__attribute__((target("avx512f")))
+float dot_avx512(const float* a, const float* b, int n)
+{
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i < n; i += 16) {
+        __mmask16 m = tail_mask(n - i);
+        acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), acc0);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f")))
+void axpy_avx512(float alpha, const float* x, float* y, int n)
+{
+    __m512 a = _mm512_set1_ps(alpha);
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 m = tail_mask(n - i);
+        __m512 r = _mm512_fmadd_ps(a, _mm512_maskz_loadu_ps(m, x + i), _mm512_maskz_loadu_ps(m, y + i));
+        _mm512_mask_storeu_ps(y + i, m, r);
+    }
+}
+
+__attribute__((target("avx512f")))
+void tanh_avx512(const float* x, float* y, int n)
+{
+    const __m512i sign_mask = _mm512_set1_epi32(INT32_MIN);
+    const __m512 one = _mm512_set1_ps(1.0f);
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 m = tail_mask(n - i);
+        __m512i v = _mm512_castps_si512(_mm512_maskz_loadu_ps(m, x + i));
+        __m512i sign = _mm512_and_si512(v, sign_mask);
+        __m512 abs = _mm512_castsi512_ps(_mm512_andnot_si512(sign_mask, v));
+        __m512 e = exp_neg_avx512(_mm512_mul_ps(abs, _mm512_set1_ps(-2.0f)));
+        __m512 t = _mm512_div_ps(_mm512_sub_ps(one, e), _mm512_add_ps(one, e));
+        _mm512_mask_storeu_ps(y + i, m, _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(t), sign)));
+    }
+}
+
+__attribute__((target("avx512f")))
+void tanh_backward_avx512(const float* y, const float* dy, float* dx, int n)
+{
+    const __m512 one = _mm512_set1_ps(1.0f);
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 m = tail_mask(n - i);
+        __m512 v = _mm512_maskz_loadu_ps(m, y + i);
+        __m512 slope = _mm512_fnmadd_ps(v, v, one);
+        _mm512_mask_storeu_ps(dx + i, m, _mm512_mul_ps(_mm512_maskz_loadu_ps(m, dy + i), slope));
+    }
+}
+
+__attribute__((target("avx512f")))
+double dot_mixed_avx512(const float* a, const float* b, int n)
+{
+    __m512d acc0 = _mm512_setzero_pd();
+    __m512d acc1 = _mm512_setzero_pd();
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 m = tail_mask(n - i);
+        __m512 va = _mm512_maskz_loadu_ps(m, a + i);
+        __m512 vb = _mm512_maskz_loadu_ps(m, b + i);
+        acc0 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(va)),
+                               _mm512_cvtps_pd(_mm512_castps512_ps256(vb)), acc0);
+        acc1 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(va), 1))),
+                               _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(vb), 1))),
+                               acc1);
+    }
+    return _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+}
+
+__attribute__((target("avx512f")))
+void axpy_mixed_avx512(float alpha, const float* x, double* y, int n)
+{
+    __m512d a = _mm512_set1_pd(alpha);
+    for (int i = 0; i < n; i += 8) {
+        __mmask16 m16 = tail_mask(n - i) & 0xff;
+        __mmask8 m = static_cast<__mmask8>(m16);
+        __m512d vx = _mm512_cvtps_pd(_mm512_castps512_ps256(_mm512_maskz_loadu_ps(m16, x + i)));
+        _mm512_mask_storeu_pd(y + i, m, _mm512_fmadd_pd(a, vx, _mm512_maskz_loadu_pd(m, y + i)));
+    }
+}
+
+__attribute__((target("avx512f")))
+float dot_f16_avx512(const float* x, const uint16_t* w, int n)
+{
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 vw = _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + i)));
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), vw, acc);
+    }
+    float result = _mm512_reduce_add_ps(acc);
+    for (; i < n; i++) {
+        result += x[i] * f16_to_float(w[i]);
+    }
+    return result;
+}
+
+__attribute__((target("avx512f")))
+float dot_bf16_avx512(const float* x, const uint16_t* w, int n)
+{
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i wide = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(w + i)));
+        acc = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_castsi512_ps(_mm512_slli_epi32(wide, 16)), acc);
+    }
+    float result = _mm512_reduce_add_ps(acc);
+    for (; i < n; i++) {
+        result += x[i] * bf16_to_float(w[i]);
+    }
+    return result;
+}
+
+__attribute__((target("avx512f")))
+float dot_sparse_avx512(const float* values, const int32_t* indices, int nnz, const float* w)
+{
+    __m512 acc = _mm512_setzero_ps();
+    for (int i = 0; i < nnz; i += 16) {
+        __mmask16 m = tail_mask(nnz - i);
+        __m512i vi = _mm512_maskz_loadu_epi32(m, indices + i);
+        __m512 vw = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), m, vi, w, 4);
+        acc = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, values + i), vw, acc);
+    }
+    return _mm512_reduce_add_ps(acc);
+}
+
+__attribute__((target("avx512f")))
+void axpy_sparse_avx512(float alpha, const float* values, const int32_t* indices, int nnz, float* y)
+{
+    // distinct indices, so the gather / scatter pairs never overlap
+    __m512 a = _mm512_set1_ps(alpha);
+    for (int i = 0; i < nnz; i += 16) {
+        __mmask16 m = tail_mask(nnz - i);
+        __m512i vi = _mm512_maskz_loadu_epi32(m, indices + i);
+        __m512 vy = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), m, vi, y, 4);
+        vy = _mm512_fmadd_ps(a, _mm512_maskz_loadu_ps(m, values + i), vy);
+        _mm512_mask_i32scatter_ps(y, m, vi, vy, 4);
+    }
+}
+
+// Byte instructions are AVX512BW; as in the AVX2 version, with the sign of
+// a moved onto b by a masked negation
+__attribute__((target("avx512f,avx512bw")))
+int32_t dot_i8_avx512(const int8_t* a, const int8_t* b, int n)
+{
+    const __m512i ones = _mm512_set1_epi16(1);
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i acc = _mm512_setzero_si512();
+    for (int i = 0; i < n; i += 64) {
+        __mmask64 m = n - i >= 64 ? ~0ull : (1ull << (n - i)) - 1;
+        __m512i va = _mm512_maskz_loadu_epi8(m, a + i);
+        __m512i vb = _mm512_maskz_loadu_epi8(m, b + i);
+        vb = _mm512_mask_sub_epi8(vb, _mm512_movepi8_mask(va), zero, vb);
+        __m512i pairs = _mm512_maddubs_epi16(_mm512_abs_epi8(va), vb);
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(pairs, ones));
+    }
+    return _mm512_reduce_add_epi32(acc);
+}
+
+__attribute__((target("avx512f")))
+void quantize_i8_avx512(const float* x, float scale, int8_t* q, int n)
+{
+    const __m512 s = _mm512_set1_ps(scale);
+    const __m512 low = _mm512_set1_ps(-127.0f);
+    const __m512 high = _mm512_set1_ps(127.0f);
+    for (int i = 0; i < n; i += 16) {
+        __mmask16 m = tail_mask(n - i);
+        __m512 v = _mm512_mul_ps(_mm512_maskz_loadu_ps(m, x + i), s);
+        v = _mm512_min_ps(_mm512_max_ps(v, low), high);
+        _mm512_mask_cvtsepi32_storeu_epi8(q + i, m, _mm512_cvtps_epi32(v));
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void dot_i8_rows4_avx512(const int8_t* x, const int8_t* w, size_t stride, int n, int32_t* out)
+{
+    const __m512i ones = _mm512_set1_epi16(1);
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i acc[4] = { zero, zero, zero, zero };
+    for (int i = 0; i < n; i += 64) {
+        __mmask64 m = n - i >= 64 ? ~0ull : (1ull << (n - i)) - 1;
+        __m512i vx = _mm512_maskz_loadu_epi8(m, x + i);
+        __m512i ax = _mm512_abs_epi8(vx);
+        __mmask64 negative = _mm512_movepi8_mask(vx);
+        for (int k = 0; k < 4; k++) {
+            __m512i vw = _mm512_maskz_loadu_epi8(m, w + k * stride + i);
+            vw = _mm512_mask_sub_epi8(vw, negative, zero, vw);
+            acc[k] = _mm512_add_epi32(acc[k], _mm512_madd_epi16(_mm512_maddubs_epi16(ax, vw), ones));
+        }
+    }
+    for (int k = 0; k < 4; k++) {
+        out[k] = _mm512_reduce_add_epi32(acc[k]);
+    }
+}
+
+#endif  // MICROGRAD_X86_KERNELS
+
+}  // namespace
+
+// 16-bit conversions
+uint16_t float_to_f16(float x)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+    bits &= 0x7fffffff;
+    if (bits >= 0x7f800000) {
+        // infinity, or NaN kept quiet
+        return sign | 0x7c00 | (bits > 0x7f800000 ? 0x200 : 0);
+    }
+    if (bits >= 0x477ff000) {
+        // at least 65520, the halfway point above the largest half
+        return sign | 0x7c00;
+    }
+    uint32_t h;
+    uint32_t rest;
+    uint32_t halfway;
+    if (bits < 0x38800000) {
+        // below 2^-14: subnormal half, in units of 2^-24
+        if (bits < 0x33000000) {
+            return sign;
+        }
+        uint32_t shift = 126 - (bits >> 23);
+        uint32_t mantissa = (bits & 0x7fffff) | 0x800000;
+        h = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    } else {
+        // rebias the exponent from 127 to 15, drop 13 mantissa bits
+        h = (bits - 0x38000000) >> 13;
+        rest = bits & 0x1fff;
+        halfway = 0x1000;
+    }
+    if (rest > halfway || (rest == halfway && (h & 1))) {
+        h++;  // may carry into the exponent, which is still right
+    }
+    return sign | static_cast<uint16_t>(h);
+}
+
+float f16_to_float(uint16_t h)
+{
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else if (exponent == 0) {
+        float value = static_cast<float>(mantissa) * 0x1p-24f;
+        return sign ? -value : value;
+    } else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float x;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+uint16_t float_to_bf16(float x)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+        return static_cast<uint16_t>((bits >> 16) | 0x40);
+    }
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return static_cast<uint16_t>(bits >> 16);
+}
+
+float bf16_to_float(uint16_t h)
+{
+    uint32_t bits = static_cast<uint32_t>(h) << 16;
+    float x;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+const Kernels& portable_kernels()
+{
+    static const Kernels k = { "portable", dot_portable, axpy_portable, tanh_portable, tanh_backward_portable,
+                                dot_mixed_portable, axpy_mixed_portable, dot_f16_portable, dot_bf16_portable,
+                                dot_sparse_portable, axpy_sparse_portable, dot_i8_portable,
+                                dot_i8_rows4_portable, quantize_i8_portable };
+    return k;
+}
+
+const Kernels* avx2_kernels()
+{
+#ifdef MICROGRAD_X86_KERNELS
+    static const Kernels k = { "avx2", dot_avx2, axpy_avx2, tanh_avx2, tanh_backward_avx2,
+                               dot_mixed_avx2, axpy_mixed_avx2, dot_f16_avx2, dot_bf16_avx2,
+                               dot_sparse_avx2, axpy_sparse_portable, dot_i8_avx2,
+                               dot_i8_rows4_avx2, quantize_i8_avx2 };
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+        return &k;
+    }
+#endif
+    return nullptr;
+}
+
+const Kernels* avx512_kernels()
+{
+#ifdef MICROGRAD_X86_KERNELS
+    static const Kernels k = { "avx512", dot_avx512, axpy_avx512, tanh_avx512, tanh_backward_avx512,
+                               dot_mixed_avx512, axpy_mixed_avx512, dot_f16_avx512, dot_bf16_avx512,
+                               dot_sparse_avx512, axpy_sparse_avx512,
+                               __builtin_cpu_supports("avx512bw") ? dot_i8_avx512 : dot_i8_avx2,
+                               __builtin_cpu_supports("avx512bw") ? dot_i8_rows4_avx512 : dot_i8_rows4_avx2,
+                               quantize_i8_avx512 };
+    if (__builtin_cpu_supports("avx512f")) {
+        return &k;
+    }
+#endif
+    return nullptr;
+}
+
+const Kernels& kernels()
+{
+    static const Kernels& best = avx512_kernels() ? *avx512_kernels()
+                               : avx2_kernels() ? *avx2_kernels()
+                               : portable_kernels();
+    return best;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+// Dense float kernels behind the batched path (DenseTanh). Every kernel has a
+// portable version and, on x86-64, AVX2+FMA and AVX-512 versions. kernels()
+// returns the best set the CPU supports, picked once on first use.
+//
+// Besides float32 there are mixed precision kernels (float32 data, float64
+// sums) and dot products against 16-bit weights, either IEEE half (fp16) or
+// bfloat16 (the top half of a float32).
+//
+// The sparse kernels take a sparse vector as nnz (index, value) pairs, as one
+// row of a SparseMatrix, against a dense vector.
+//
+// dot_i8 is the integer product of quantized inference: int8 values in
+// [-127, 127] (never -128) summed in int32, exact for n below 2^17. The
+// AVX-512 set uses AVX512BW for it when the CPU has it, AVX2 otherwise.
+
+#include <cstddef>
+#include <cstdint>
+
+struct Kernels {
+    const char* name;
+    // sum_i a[i] * b[i]
+    float (*dot)(const float* a, const float* b, int n);
+    // y[i] += alpha * x[i]
+    void (*axpy)(float alpha, const float* x, float* y, int n);
+    // y[i] = tanh(x[i]), absolute error below 1e-6
+    void (*tanh)(const float* x, float* y, int n);
+    // dx[i] = dy[i] * (1 - y[i]^2) where y is the saved tanh output
+    void (*tanh_backward)(const float* y, const float* dy, float* dx, int n);
+    // sum_i a[i] * b[i] accumulated in double
+    double (*dot_mixed)(const float* a, const float* b, int n);
+    // y[i] += alpha * x[i] with y in double
+    void (*axpy_mixed)(float alpha, const float* x, double* y, int n);
+    // sum_i x[i] * w[i] with w stored as fp16 / bfloat16
+    float (*dot_f16)(const float* x, const uint16_t* w, int n);
+    float (*dot_bf16)(const float* x, const uint16_t* w, int n);
+    // sum_i values[i] * w[indices[i]]
+    float (*dot_sparse)(const float* values, const int32_t* indices, int nnz, const float* w);
+    // y[indices[i]] += alpha * values[i]; the indices must be distinct
+    void (*axpy_sparse)(float alpha, const float* values, const int32_t* indices, int nnz, float* y);
+    // sum_i a[i] * b[i] in int32
+    int32_t (*dot_i8)(const int8_t* a, const int8_t* b, int n);
+    // out[k] = sum_i x[i] * w[k * stride + i] for four rows k of w, sharing
+    // the loads of x
+    void (*dot_i8_rows4)(const int8_t* x, const int8_t* w, size_t stride, int n, int32_t* out);
+    // q[i] = x[i] * scale rounded to nearest even, clamped to [-127, 127]
+    void (*quantize_i8)(const float* x, float scale, int8_t* q, int n);
+};
+
+// 16-bit conversions, rounding to nearest even; out of range values become
+// infinity for fp16
+uint16_t float_to_f16(float x);
+float f16_to_float(uint16_t h);
+uint16_t float_to_bf16(float x);
+float bf16_to_float(uint16_t h);
+
+const Kernels& portable_kernels();
+// nullptr when the CPU (or the compiler) does not support the instruction set
+const Kernels* avx2_kernels();
+const Kernels* avx512_kernels();
+
+const Kernels& kernels();
@@ -0,0 +1,81 @@
+// Benchmarks for micrograd/kernels.h
+//
+// Each kernel set the CPU supports against a plain scalar loop (the way
+// Neuron::forward and the old tanh backward computed them) at several layer
+// widths. Times are per call.
+
+#include "kernels.h"
+#include "bench.h"
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+// Plain scalar loops; volatile sinks keep the compiler from dropping work
+static volatile float sink;
+
+static float dot_scalar(const float* a, const float* b, int n)
+{
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+void bench_width(int n)
+{
+    std::vector<float> a(n, 0.5f), b(n, -0.25f), y(n, 0.1f), out(n);
+    for (int i = 0; i < n; i++) {
+        a[i] = std::sin(0.1f * i);
+    }
+    int iters = 20000000 / n + 10;
+
+    std::printf("width %d\n", n);
+    std::vector<const Kernels*> sets = { &portable_kernels(), avx2_kernels(), avx512_kernels() };
+
+    report("  dot, scalar loop", time_ns([&]() { sink = dot_scalar(a.data(), b.data(), n); }, iters), "ns");
+    for (const Kernels* k : sets) {
+        if (k) {
+            std::string name = std::string("  dot, ") + k->name;
+            report(name.c_str(), time_ns([&]() { sink = k->dot(a.data(), b.data(), n); }, iters), "ns");
+        }
+    }
+    for (const Kernels* k : sets) {
+        if (k) {
+            std::string name = std::string("  axpy, ") + k->name;
+            report(name.c_str(), time_ns([&]() { k->axpy(1e-6f, a.data(), y.data(), n); }, iters), "ns");
+        }
+    }
+    report("  tanh, std::tanh", time_ns([&]() {
+        for (int i = 0; i < n; i++) {
+            out[i] = std::tanh(a[i]);
+        }
+        sink = out[n - 1];
+    }, iters), "ns");
+    for (const Kernels* k : sets) {
+        if (k) {
+            std::string name = std::string("  tanh, ") + k->name;
+            report(name.c_str(), time_ns([&]() { k->tanh(a.data(), out.data(), n); }, iters), "ns");
+        }
+    }
+    report("  tanh backward, std::pow(std::tanh)", time_ns([&]() {
+        for (int i = 0; i < n; i++) {
+            out[i] = b[i] * (1 - std::pow(std::tanh(a[i]), 2));
+        }
+        sink = out[n - 1];
+    }, iters), "ns");
+    for (const Kernels* k : sets) {
+        if (k) {
+            std::string name = std::string("  tanh backward, ") + k->name;
+            report(name.c_str(), time_ns([&]() { k->tanh_backward(a.data(), b.data(), out.data(), n); }, iters), "ns");
+        }
+    }
+}
+
+int main()
+{
+    for (int n : { 16, 128, 784, 4096 }) {
+        bench_width(n);
+    }
+}
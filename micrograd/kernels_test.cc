@@ -0,0 +1,255 @@
+// Testing micrograd/kernels.h implementation
+//
+#include <assert.h>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "kernels.h"
+
+// Every kernel set the CPU supports, so each one is tested on this machine
+std::vector<const Kernels*> available_kernels()
+{
+    std::vector<const Kernels*> sets = { &portable_kernels() };
+    if (avx2_kernels()) {
+        sets.push_back(avx2_kernels());
+    }
+    if (avx512_kernels()) {
+        sets.push_back(avx512_kernels());
+    }
+    return sets;
+}
+
+std::vector<float> ramp(int n, float start, float step)
+{
+    std::vector<float> v(n);
+    for (int i = 0; i < n; i++) {
+        v[i] = start + step * i;
+    }
+    return v;
+}
+
+void test_dot()
+{
+    // Lengths around the vector widths exercise the tails
+    for (const Kernels* k : available_kernels()) {
+        for (int n : { 0, 1, 7, 8, 15, 16, 17, 33, 100 }) {
+            std::vector<float> a = ramp(n, -1.0f, 0.03f);
+            std::vector<float> b = ramp(n, 0.5f, -0.01f);
+            double expected = 0.0;
+            for (int i = 0; i < n; i++) {
+                expected += static_cast<double>(a[i]) * b[i];
+            }
+            assert(std::fabs(k->dot(a.data(), b.data(), n) - expected) < 1e-4);
+        }
+    }
+}
+
+void test_axpy()
+{
+    for (const Kernels* k : available_kernels()) {
+        for (int n : { 1, 9, 16, 31 }) {
+            std::vector<float> x = ramp(n, 1.0f, 0.5f);
+            std::vector<float> y = ramp(n, -2.0f, 0.25f);
+            std::vector<float> expected = y;
+            for (int i = 0; i < n; i++) {
+                expected[i] += 0.5f * x[i];
+            }
+            k->axpy(0.5f, x.data(), y.data(), n);
+            for (int i = 0; i < n; i++) {
+                assert(std::fabs(y[i] - expected[i]) < 1e-6);
+            }
+        }
+    }
+}
+
+void test_tanh()
+{
+    // Whole range, including large inputs where tanh saturates
+    std::vector<float> x = ramp(2001, -50.0f, 0.05f);
+    x.push_back(0.0f);
+    x.push_back(-0.0f);
+    x.push_back(1e-8f);
+    std::vector<float> y(x.size());
+    for (const Kernels* k : available_kernels()) {
+        k->tanh(x.data(), y.data(), x.size());
+        for (size_t i = 0; i < x.size(); i++) {
+            assert(std::fabs(y[i] - std::tanh(x[i])) < 1e-6);
+        }
+    }
+}
+
+void test_tanh_backward()
+{
+    for (const Kernels* k : available_kernels()) {
+        std::vector<float> y = ramp(19, -0.9f, 0.1f);
+        std::vector<float> dy = ramp(19, 2.0f, -0.2f);
+        std::vector<float> dx(19);
+        k->tanh_backward(y.data(), dy.data(), dx.data(), 19);
+        for (int i = 0; i < 19; i++) {
+            assert(std::fabs(dx[i] - dy[i] * (1 - y[i] * y[i])) < 1e-6);
+        }
+    }
+}
+
+void test_mixed_precision()
+{
+    // A sum whose float rounding error is far above the double one
+    int n = 100003;
+    std::vector<float> a(n, 1.0f);
+    std::vector<float> b = ramp(n, 0.1f, 1e-5f);
+    double expected = 0.0;
+    for (int i = 0; i < n; i++) {
+        expected += b[i];
+    }
+    for (const Kernels* k : available_kernels()) {
+        for (int m : { 0, 3, 8, 17, 100 }) {
+            double small = 0.0;
+            for (int i = 0; i < m; i++) {
+                small += b[i];
+            }
+            assert(std::fabs(k->dot_mixed(a.data(), b.data(), m) - small) < 1e-12);
+        }
+        assert(std::fabs(k->dot_mixed(a.data(), b.data(), n) - expected) < 1e-9 * expected);
+
+        std::vector<double> y(19, 0.25);
+        std::vector<float> x = ramp(19, 1.0f, -0.3f);
+        k->axpy_mixed(0.5f, x.data(), y.data(), 19);
+        for (int i = 0; i < 19; i++) {
+            assert(y[i] == 0.25 + 0.5 * static_cast<double>(x[i]));
+        }
+    }
+}
+
+void test_half_conversions()
+{
+    // exact values, rounding to even, subnormals, overflow and specials
+    assert(f16_to_float(float_to_f16(1.0f)) == 1.0f);
+    assert(f16_to_float(float_to_f16(-2.5f)) == -2.5f);
+    assert(float_to_f16(65504.0f) == 0x7bff);
+    assert(float_to_f16(65520.0f) == 0x7c00);
+    assert(float_to_f16(1.0f + 0x1p-11f) == 0x3c00);                // tie, to even
+    assert(float_to_f16(1.0f + 3 * 0x1p-11f) == 0x3c02);            // tie, to even
+    assert(f16_to_float(float_to_f16(0x1p-24f)) == 0x1p-24f);       // smallest subnormal
+    assert(f16_to_float(float_to_f16(3 * 0x1p-20f)) == 3 * 0x1p-20f);
+    assert(float_to_f16(0x1p-26f) == 0);
+    assert(std::isnan(f16_to_float(float_to_f16(NAN))));
+    assert(f16_to_float(float_to_f16(INFINITY)) == INFINITY);
+    for (float x : ramp(1000, -3.0f, 0.00731f)) {
+        assert(std::fabs(f16_to_float(float_to_f16(x)) - x) <= std::fabs(x) * 0x1p-11f);
+        assert(std::fabs(bf16_to_float(float_to_bf16(x)) - x) <= std::fabs(x) * 0x1p-8f);
+    }
+    assert(float_to_bf16(1.0f + 0x1p-8f) == 0x3f80);                // tie, to even
+    assert(bf16_to_float(float_to_bf16(-3.0f)) == -3.0f);
+}
+
+void test_half_dot()
+{
+    for (const Kernels* k : available_kernels()) {
+        for (int n : { 0, 1, 7, 8, 15, 16, 17, 33, 100 }) {
+            std::vector<float> x = ramp(n, -1.0f, 0.03f);
+            std::vector<float> w = ramp(n, 0.5f, -0.01f);
+            std::vector<uint16_t> f16(n), bf16(n);
+            double expected_f16 = 0.0;
+            double expected_bf16 = 0.0;
+            for (int i = 0; i < n; i++) {
+                f16[i] = float_to_f16(w[i]);
+                bf16[i] = float_to_bf16(w[i]);
+                expected_f16 += static_cast<double>(x[i]) * f16_to_float(f16[i]);
+                expected_bf16 += static_cast<double>(x[i]) * bf16_to_float(bf16[i]);
+            }
+            assert(std::fabs(k->dot_f16(x.data(), f16.data(), n) - expected_f16) < 1e-4);
+            assert(std::fabs(k->dot_bf16(x.data(), bf16.data(), n) - expected_bf16) < 1e-4);
+        }
+    }
+}
+
+void test_sparse()
+{
+    // Every third column of a dense vector, tails included
+    std::vector<float> w = ramp(400, 0.5f, -0.01f);
+    for (const Kernels* k : available_kernels()) {
+        for (int nnz : { 0, 1, 7, 8, 15, 16, 17, 33, 100 }) {
+            std::vector<float> values = ramp(nnz, -1.0f, 0.03f);
+            std::vector<int32_t> indices(nnz);
+            double expected = 0.0;
+            for (int i = 0; i < nnz; i++) {
+                indices[i] = 3 * i + 1;
+                expected += static_cast<double>(values[i]) * w[indices[i]];
+            }
+            assert(std::fabs(k->dot_sparse(values.data(), indices.data(), nnz, w.data()) - expected) < 1e-4);
+
+            std::vector<float> y = w;
+            std::vector<float> expected_y = w;
+            for (int i = 0; i < nnz; i++) {
+                expected_y[indices[i]] += 0.5f * values[i];
+            }
+            k->axpy_sparse(0.5f, values.data(), indices.data(), nnz, y.data());
+            for (size_t i = 0; i < y.size(); i++) {
+                assert(std::fabs(y[i] - expected_y[i]) < 1e-6);
+            }
+        }
+    }
+}
+
+void test_int8_dot()
+{
+    // Exact, at the extremes of the range too, tails included
+    for (const Kernels* k : available_kernels()) {
+        for (int n : { 0, 1, 31, 32, 33, 63, 64, 65, 100, 1000 }) {
+            std::vector<int8_t> a(n), b(n);
+            int32_t expected = 0;
+            for (int i = 0; i < n; i++) {
+                a[i] = static_cast<int8_t>(i % 3 == 0 ? -127 : (i * 37) % 255 - 127);
+                b[i] = static_cast<int8_t>(i % 5 == 0 ? 127 : (i * 91) % 255 - 127);
+                expected += a[i] * b[i];
+            }
+            assert(k->dot_i8(a.data(), b.data(), n) == expected);
+            std::vector<int8_t> low(n, -127);
+            assert(k->dot_i8(low.data(), low.data(), n) == 127 * 127 * n);
+
+            // Four rows of a matrix with a wider stride
+            std::vector<int8_t> w(4 * (n + 3));
+            for (size_t i = 0; i < w.size(); i++) {
+                w[i] = static_cast<int8_t>((i * 53) % 255 - 127);
+            }
+            int32_t out[4];
+            k->dot_i8_rows4(a.data(), w.data(), n + 3, n, out);
+            for (int r = 0; r < 4; r++) {
+                assert(out[r] == k->dot_i8(a.data(), w.data() + r * (n + 3), n));
+            }
+        }
+    }
+}
+
+void test_quantize()
+{
+    // Halves round to even, out of range values clamp to +-127
+    for (const Kernels* k : available_kernels()) {
+        for (int n : { 0, 1, 7, 8, 15, 16, 17, 33, 100 }) {
+            std::vector<float> x = ramp(n, -300.0f, 6.25f);
+            std::vector<int8_t> q(n + 1, 42);
+            k->quantize_i8(x.data(), 0.5f, q.data(), n);
+            for (int i = 0; i < n; i++) {
+                float v = std::fmin(std::fmax(x[i] * 0.5f, -127.0f), 127.0f);
+                assert(q[i] == static_cast<int8_t>(std::nearbyint(v)));
+            }
+            assert(q[n] == 42);
+        }
+    }
+}
+
+int main()
+{
+    std::cout << "kernels: " << kernels().name << std::endl;
+    test_dot();
+    test_axpy();
+    test_tanh();
+    test_tanh_backward();
+    test_mixed_precision();
+    test_half_conversions();
+    test_half_dot();
+    test_sparse();
+    test_int8_dot();
+    test_quantize();
+}
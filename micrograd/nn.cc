@@ -2,24 +2,100 @@
 //
 
 #include "nn.h"
+#include "kernels.h"
+#include "profiler.h"
 
 #include <iostream>
 #include <vector>
-#include <random>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <memory>
+#include <cstdio>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Aligned buffer
+AlignedBuffer::AlignedBuffer(size_t size) : n(size)
+{
+    if (size == 0) {
+        return;
+    }
+    // calloc and align by hand: large blocks come straight from the OS
+    // already zeroed, so an untouched buffer (e.g. the grads of a model that
+    // only runs inference) costs no page faults
+    raw = std::calloc(size * sizeof(float) + 64, 1);
+    if (!raw) {
+        throw std::bad_alloc();
+    }
+    uintptr_t address = (reinterpret_cast<uintptr_t>(raw) + 63) / 64 * 64;
+    values = reinterpret_cast<float*>(address);
+}
+
+AlignedBuffer::~AlignedBuffer()
+{
+    std::free(raw);
+}
+
+// Initialization
+// SplitMix64 finalizer, a bijective hash with good avalanche
+static inline uint64_t mix64(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+uint64_t next_default_seed()
+{
+    // fill_uniform hashes the seed, so consecutive seeds give unrelated streams
+    thread_local uint64_t n_constructed = 0;
+    return default_seed + n_constructed++;
+}
+
+void fill_uniform(float* data, size_t n, float bound, uint64_t seed, uint64_t offset)
+{
+    if (bound == 0.0f) {
+        std::fill(data, data + n, 0.0f);
+        return;
+    }
+    // the i-th number of the stream is the hash of key + i * golden ratio;
+    // its top 24 bits give a float in [-1, 1)
+    uint64_t key = mix64(seed);
+    float scale = 2.0f * bound * 0x1p-24f;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t z = mix64(key + (offset + i) * 0x9e3779b97f4a7c15ull);
+        data[i] = static_cast<float>(z >> 40) * scale - bound;
+    }
+}
 
 // Constructor & Destructor
 Neuron::Neuron(int n_inputs)
+    : Neuron(n_inputs, next_default_seed())
+{
+}
+
+Neuron::Neuron(int n_inputs, uint64_t seed)
+    : storage(std::make_shared<ParameterStorage>(n_inputs + 1))
 {
     // std::cout << "Neuron constructor called" << std::endl;
-    Value weight(1.0, "weight");
     // Initialize the weights and bias with random values
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_real_distribution<> dis(-1.0, 1.0);
-    for (int i = 0; i < n_inputs; i++) {
-        weights.push_back(Value(dis(gen), "w" + std::to_string(i)));
-    }
-    bias = Value(dis(gen), "b");
+    Parameters parameters = storage->view();
+    fill_uniform(parameters.data, parameters.size, 1.0f, seed);
+    weights = parameters.slice(0, n_inputs);
+    bias = parameters.slice(n_inputs, 1);
+    this->n_inputs = n_inputs;
+}
+
+Neuron::Neuron(int n_inputs, Parameters weights, Parameters bias, std::shared_ptr<ParameterStorage> storage)
+    : storage(std::move(storage)), weights(weights), bias(bias)
+{
     this->n_inputs = n_inputs;
 }
 
@@ -29,42 +105,90 @@ Neuron::~Neuron()
 }
 
 // Forward pass
-Value Neuron::forward(const std::vector<Value>& inputs)
+Value Neuron::forward(std::span<const Value> inputs)
+{
+    Tape& tape = inputs.empty() ? Tape::current() : *inputs[0].get_tape();
+    uint32_t weights_id = tape.bind(weights.data, weights.grad, weights.size, storage);
+    uint32_t bias_id = tape.bind(bias.data, bias.grad, 1, storage);
+    return forward(inputs, weights_id, bias_id);
+}
+
+Value Neuron::forward(std::span<const Value> inputs, uint32_t weights_id, uint32_t bias_id) const
 {
+    Tape* tape = inputs.empty() ? &Tape::current() : inputs[0].get_tape();
+
     // Compute the weighted sum of the inputs
-    Value weighted_sum = Value(0.0);
-    for (int i = 0; i < inputs.size(); i++) {
-        weighted_sum += inputs[i] * weights[i];
+    Value weighted_sum = Value(tape, tape->push(0.0f, Op::Const));
+    for (size_t i = 0; i < inputs.size(); i++) {
+        weighted_sum += inputs[i] * Value(tape, weights_id + i);
     }
 
     // Add the bias
-    weighted_sum += bias;
+    weighted_sum += Value(tape, bias_id);
 
     // Return the result of the activation function
     return weighted_sum.tanh();
 }
 
-// Get the parameters of the neuron
-std::vector<Value*> Neuron::get_parameters()
+Value Neuron::forward(std::span<const Value> values, std::span<const int32_t> indices)
+{
+    Tape& tape = values.empty() ? Tape::current() : *values[0].get_tape();
+    uint32_t weights_id = tape.bind(weights.data, weights.grad, weights.size, storage);
+    uint32_t bias_id = tape.bind(bias.data, bias.grad, 1, storage);
+    return forward(values, indices, weights_id, bias_id);
+}
+
+Value Neuron::forward(std::span<const Value> values, std::span<const int32_t> indices, uint32_t weights_id,
+                      uint32_t bias_id) const
 {
-    std::vector<Value*> parameters;
-    for (int i = 0; i < n_inputs; i++) {
-        parameters.push_back(&weights[i]);
+    Tape* tape = values.empty() ? &Tape::current() : values[0].get_tape();
+
+    // Only the nonzero inputs contribute, each with its own weight
+    Value weighted_sum = Value(tape, tape->push(0.0f, Op::Const));
+    for (size_t i = 0; i < values.size(); i++) {
+        weighted_sum += values[i] * Value(tape, weights_id + indices[i]);
     }
-    parameters.push_back(&bias);
-    return parameters;
+    weighted_sum += Value(tape, bias_id);
+    return weighted_sum.tanh();
 }
 
 // Layer class
 // Constructor & Destructor
 Layer::Layer(int n_inputs, int n_neurons)
+    : Layer(n_inputs, n_neurons, next_default_seed())
+{
+}
+
+Layer::Layer(int n_inputs, int n_neurons, uint64_t seed)
+    : storage(std::make_shared<ParameterStorage>(n_parameters(n_inputs, n_neurons))), dense(n_inputs, n_neurons)
 {
     // std::cout << "Layer constructor called" << std::endl;
-    for (int i = 0; i < n_neurons; i++) {
-        neurons.push_back(Neuron(n_inputs));
-    }
     this->n_inputs = n_inputs;
     this->n_neurons = n_neurons;
+    Parameters parameters = storage->view();
+    fill_uniform(parameters.data, parameters.size, 1.0f, seed);
+    init(parameters);
+}
+
+Layer::Layer(int n_inputs, int n_neurons, Parameters parameters, std::shared_ptr<ParameterStorage> storage)
+    : storage(std::move(storage)), dense(n_inputs, n_neurons)
+{
+    this->n_inputs = n_inputs;
+    this->n_neurons = n_neurons;
+    init(parameters);
+}
+
+void Layer::init(Parameters parameters)
+{
+    // One view per neuron and the dense node on top
+    this->parameters = parameters;
+    size_t n_weights = static_cast<size_t>(n_neurons) * n_inputs;
+    for (int j = 0; j < n_neurons; j++) {
+        neurons.push_back(Neuron(n_inputs, parameters.slice(static_cast<size_t>(j) * n_inputs, n_inputs),
+                                 parameters.slice(n_weights + j, 1), storage));
+    }
+    dense.set_parameters(parameters.data, parameters.data + n_weights,
+                         parameters.grad, parameters.grad + n_weights);
 }
 
 Layer::~Layer()
@@ -73,37 +197,106 @@ Layer::~Layer()
 }
 
 // Forward pass
-std::vector<Value> Layer::forward(const std::vector<Value>& inputs)
+std::vector<Value> Layer::forward(std::span<const Value> inputs)
 {
+    Tape& tape = inputs.empty() ? Tape::current() : *inputs[0].get_tape();
     std::vector<Value> outputs;
-    for (auto neuron : neurons) {
-        outputs.push_back(neuron.forward(inputs));
+    outputs.reserve(n_neurons);
+    forward(inputs, tape.bind(parameters.data, parameters.grad, parameters.size, storage), outputs);
+    return outputs;
+}
+
+void Layer::forward(std::span<const Value> inputs, uint32_t first_id, std::vector<Value>& outputs) const
+{
+    uint32_t bias_id = first_id + static_cast<uint32_t>(n_neurons) * n_inputs;
+    outputs.clear();
+    for (int j = 0; j < n_neurons; j++) {
+        outputs.push_back(neurons[j].forward(inputs, first_id + j * n_inputs, bias_id + j));
     }
+}
+
+std::vector<Value> Layer::forward(std::span<const Value> values, std::span<const int32_t> indices)
+{
+    Tape& tape = values.empty() ? Tape::current() : *values[0].get_tape();
+    std::vector<Value> outputs;
+    outputs.reserve(n_neurons);
+    forward(values, indices, tape.bind(parameters.data, parameters.grad, parameters.size, storage), outputs);
     return outputs;
 }
 
-// Get the parameters of the layer
-std::vector<Value*> Layer::get_parameters()
+void Layer::forward(std::span<const Value> values, std::span<const int32_t> indices, uint32_t first_id,
+                    std::vector<Value>& outputs) const
 {
-    std::vector<Value*> parameters;
-    for (auto neuron : neurons) {
-        std::vector<Value*> neuron_parameters = neuron.get_parameters();
-        parameters.insert(parameters.end(), neuron_parameters.begin(), neuron_parameters.end());
+    uint32_t bias_id = first_id + static_cast<uint32_t>(n_neurons) * n_inputs;
+    outputs.clear();
+    for (int j = 0; j < n_neurons; j++) {
+        outputs.push_back(neurons[j].forward(values, indices, first_id + j * n_inputs, bias_id + j));
     }
-    return parameters;
+}
+
+// Batched forward pass
+const Matrix& Layer::forward(const Matrix& inputs)
+{
+    return dense.forward(inputs);
+}
+
+const Matrix& Layer::forward(const Matrix& inputs, Matrix& outputs)
+{
+    return dense.forward(inputs, outputs);
+}
+
+const Matrix& Layer::forward(const SparseMatrix& inputs)
+{
+    return dense.forward(inputs);
+}
+
+const Matrix& Layer::forward(const SparseMatrix& inputs, Matrix& outputs)
+{
+    return dense.forward(inputs, outputs);
+}
+
+// Batched backward pass
+void Layer::backward(const Matrix& output_grads, Matrix* input_grads)
+{
+    dense.backward(output_grads, input_grads);
 }
 
 // MLP class
 // Constructor & Destructor
+// Total number of parameters of an MLP with these sizes
+static size_t mlp_parameters(int n_inputs, const std::vector<int>& n_neurons_per_layer)
+{
+    size_t n_params = 0;
+    for (size_t i = 0; i < n_neurons_per_layer.size(); i++) {
+        int layer_inputs = i == 0 ? n_inputs : n_neurons_per_layer[i - 1];
+        n_params += Layer::n_parameters(layer_inputs, n_neurons_per_layer[i]);
+    }
+    return n_params;
+}
+
 MLP::MLP(int n_inputs, std::vector<int> n_neurons_per_layer)
+    : MLP(n_inputs, n_neurons_per_layer, Init::Uniform, next_default_seed())
 {
     // std::cout << "MLP constructor called" << std::endl;
-    for (int i = 0; i < n_neurons_per_layer.size(); i++) {
-        if (i == 0) {
-            layers.push_back(Layer(n_inputs, n_neurons_per_layer[i]));
-        } else {
-            layers.push_back(Layer(n_neurons_per_layer[i - 1], n_neurons_per_layer[i]));
-        }
+}
+
+MLP::MLP(int n_inputs, std::vector<int> n_neurons_per_layer, Init scheme, uint64_t seed)
+    : MLP(n_inputs, n_neurons_per_layer,
+          std::make_shared<ParameterStorage>(mlp_parameters(n_inputs, n_neurons_per_layer)))
+{
+    initialize(scheme, seed);
+}
+
+MLP::MLP(int n_inputs, std::vector<int> n_neurons_per_layer, std::shared_ptr<ParameterStorage> storage)
+    : storage(std::move(storage))
+{
+    size_t offset = 0;
+    for (size_t i = 0; i < n_neurons_per_layer.size(); i++) {
+        int layer_inputs = i == 0 ? n_inputs : n_neurons_per_layer[i - 1];
+        size_t size = Layer::n_parameters(layer_inputs, n_neurons_per_layer[i]);
+        layers.push_back(Layer(layer_inputs, n_neurons_per_layer[i], this->storage->view().slice(offset, size),
+                               this->storage));
+        offset += size;
     }
     this->n_inputs = n_inputs;
     this->n_neurons_per_layer = n_neurons_per_layer;
@@ -114,23 +307,686 @@ MLP::~MLP()
     // std::cout << "MLP destructor called" << std::endl;
 }
 
+// Initialization
+// The parameter block as runs sharing one bound, weights then bias of every
+// layer in storage order
+struct InitRun {
+    size_t begin;
+    size_t end;
+    float bound;
+};
+
+static std::vector<InitRun> init_runs(std::span<const Layer> layers, Init scheme)
+{
+    std::vector<InitRun> runs;
+    size_t offset = 0;
+    for (const Layer& layer : layers) {
+        size_t n_weights = static_cast<size_t>(layer.n_neurons) * layer.n_inputs;
+        float bound = 1.0f;
+        if (scheme == Init::Xavier) {
+            bound = std::sqrt(6.0f / (layer.n_inputs + layer.n_neurons));
+        } else if (scheme == Init::He) {
+            bound = std::sqrt(6.0f / layer.n_inputs);
+        }
+        runs.push_back(InitRun{offset, offset + n_weights, bound});
+        runs.push_back(InitRun{offset + n_weights, offset + n_weights + layer.n_neurons,
+                               scheme == Init::Uniform ? 1.0f : 0.0f});
+        offset += n_weights + layer.n_neurons;
+    }
+    return runs;
+}
+
+void MLP::initialize(Init scheme, uint64_t seed)
+{
+    Parameters parameters = get_parameters();
+    for (const InitRun& run : init_runs(layers, scheme)) {
+        fill_uniform(parameters.data + run.begin, run.end - run.begin, run.bound, seed, run.begin);
+    }
+}
+
+void MLP::initialize(Init scheme, uint64_t seed, ThreadPool& pool)
+{
+    // Fixed chunks of the block, each filling its part of every run it
+    // overlaps; the counter is the position in the block either way
+    Parameters parameters = get_parameters();
+    std::vector<InitRun> runs = init_runs(layers, scheme);
+    const size_t chunk = 1 << 16;
+    int n_chunks = static_cast<int>((parameters.size + chunk - 1) / chunk);
+    pool.parallel_for(n_chunks, [&](int c) {
+        size_t begin = c * chunk;
+        size_t end = std::min(begin + chunk, parameters.size);
+        for (const InitRun& run : runs) {
+            size_t b = std::max(begin, run.begin);
+            size_t e = std::min(end, run.end);
+            if (b < e) {
+                fill_uniform(parameters.data + b, e - b, run.bound, seed, b);
+            }
+        }
+    });
+}
+
 // Forward pass
-std::vector<Value> MLP::forward(const std::vector<Value>& inputs)
+std::span<const Value> MLP::forward(std::span<const Value> inputs)
+{
+    MICROGRAD_PROFILE_PHASE(Phase::Forward);
+    // All parameters go on the tape as one block, each layer reads its slice
+    Tape& tape = inputs.empty() ? Tape::current() : *inputs[0].get_tape();
+    Parameters parameters = get_parameters();
+    uint32_t first_id = tape.bind(parameters.data, parameters.grad, parameters.size, storage);
+    clear_columns();
+    return forward_layers(0, inputs, first_id);
+}
+
+std::span<const Value> MLP::forward(std::span<const Value> values, std::span<const int32_t> indices)
 {
-    std::vector<Value> outputs = inputs;
-    for (auto layer : layers) {
-        outputs = layer.forward(outputs);
+    MICROGRAD_PROFILE_PHASE(Phase::Forward);
+    Tape& tape = values.empty() ? Tape::current() : *values[0].get_tape();
+    Parameters parameters = get_parameters();
+    uint32_t first_id = tape.bind(parameters.data, parameters.grad, parameters.size, storage);
+    clear_columns();
+    layers[0].forward(values, indices, first_id, activations[0]);
+    return forward_layers(1, activations[0], first_id + layers[0].get_parameters().size);
+}
+
+// Layers [first, end) with the parameters bound from first_id on
+std::span<const Value> MLP::forward_layers(size_t first, std::span<const Value> inputs, uint32_t first_id)
+{
+    std::span<const Value> outputs = inputs;
+    for (size_t i = first; i < layers.size(); i++) {
+        std::vector<Value>& buffer = activations[i % 2];
+        layers[i].forward(outputs, first_id, buffer);
+        first_id += layers[i].get_parameters().size;
+        outputs = buffer;
     }
     return outputs;
 }
 
-// Get the parameters of the MLP
-std::vector<Value*> MLP::get_parameters()
+// Batched forward pass
+const Matrix& MLP::forward(const Matrix& inputs)
+{
+    if (inputs.get_cols() != n_inputs) {
+        throw std::invalid_argument("batch has " + std::to_string(inputs.get_cols()) + " columns, the MLP "
+                                    + std::to_string(n_inputs) + " inputs");
+    }
+    clear_columns();
+    batch_inputs = &inputs;
+    sparse_inputs = nullptr;
+    return forward_batch();
+}
+
+const Matrix& MLP::forward(const SparseMatrix& inputs)
+{
+    if (inputs.get_cols() != n_inputs) {
+        throw std::invalid_argument("sparse batch has " + std::to_string(inputs.get_cols()) + " columns, the MLP "
+                                    + std::to_string(n_inputs) + " inputs");
+    }
+    collect_columns(inputs);
+    batch_inputs = nullptr;
+    sparse_inputs = &inputs;
+    return forward_batch();
+}
+
+const Matrix& MLP::forward_batch()
+{
+    MICROGRAD_PROFILE_PHASE(Phase::Forward);
+    size_t k = checkpoint_every;
+    size_t n_segments = (layers.size() + k - 1) / k;
+    checkpoints.resize(n_segments);
+    segment.resize(k - 1);
+
+    // a sparse batch goes straight into the first layer (see forward_segment)
+    const Matrix* outputs = batch_inputs;
+    for (size_t s = 0; s < n_segments; s++) {
+        outputs = forward_segment(s, s * k, std::min(s * k + k, layers.size()), outputs);
+    }
+    return *outputs;
+}
+
+const Matrix* MLP::forward_segment(size_t s, size_t begin, size_t end, const Matrix* x)
+{
+    // Inner layers write to the shared segment buffers, the segment's last
+    // layer to its checkpoint
+    size_t last = std::min(s * checkpoint_every + checkpoint_every, layers.size()) - 1;
+    for (size_t i = begin; i < end; i++) {
+        Matrix& outputs = i == last ? checkpoints[s] : segment[i - s * checkpoint_every];
+        x = i == 0 && sparse_inputs ? &layers[0].forward(*sparse_inputs, outputs) : &layers[i].forward(*x, outputs);
+    }
+    return x;
+}
+
+// Batched backward pass
+void MLP::backward(const Matrix& output_grads)
 {
-    std::vector<Value*> parameters;
-    for (auto layer : layers) {
-        std::vector<Value*> layer_parameters = layer.get_parameters();
-        parameters.insert(parameters.end(), layer_parameters.begin(), layer_parameters.end());
+    MICROGRAD_PROFILE_PHASE(Phase::Backward);
+    // Segments last to first. The inner activations of the last segment are
+    // still in the buffers; any other segment is recomputed from its input.
+    // layer_grads alternate as dL/d(input of layer i); the first is not needed.
+    size_t k = checkpoint_every;
+    size_t n_segments = checkpoints.size();
+    const Matrix* grads = &output_grads;
+    for (size_t s = n_segments; s-- > 0;) {
+        size_t begin = s * k;
+        size_t end = std::min(begin + k, layers.size());
+        if (s + 1 < n_segments) {
+            forward_segment(s, begin, end - 1, s == 0 ? batch_inputs : &checkpoints[s - 1]);
+        }
+        for (size_t i = end; i-- > begin;) {
+            Matrix* layer_input_grads = i > 0 ? &layer_grads[i % 2] : nullptr;
+            layers[i].backward(*grads, layer_input_grads);
+            grads = layer_input_grads;
+        }
     }
-    return parameters;
-}
\ No newline at end of file
+}
+
+void MLP::set_checkpoint_every(int k)
+{
+    // Drop the buffers of the old layout, the next forward sizes them again
+    checkpoint_every = std::max(1, k);
+    checkpoints = std::vector<Matrix>();
+    segment = std::vector<Matrix>();
+}
+
+size_t MLP::get_activation_bytes() const
+{
+    size_t n = layer_grads[0].capacity() + layer_grads[1].capacity();
+    for (const Matrix& m : checkpoints) {
+        n += m.capacity();
+    }
+    for (const Matrix& m : segment) {
+        n += m.capacity();
+    }
+    return n * sizeof(float);
+}
+
+// Inference
+void MLP::predict(const float* inputs, float* outputs, int batch)
+{
+    // Each layer reads the previous activations and writes the next buffer;
+    // the last layer writes straight into outputs
+    const float* x = inputs;
+    const uint16_t* packed = packed_weights.data();
+    for (size_t i = 0; i < layers.size(); i++) {
+        const Layer& layer = layers[i];
+        Parameters parameters = layer.get_parameters();
+        size_t n_weights = static_cast<size_t>(layer.n_neurons) * layer.n_inputs;
+        float* y = outputs;
+        if (i + 1 < layers.size()) {
+            std::vector<float>& buffer = predict_buffers[i % 2];
+            size_t size = static_cast<size_t>(batch) * layer.n_neurons;
+            if (buffer.size() < size) {
+                buffer.resize(size);
+            }
+            y = buffer.data();
+        }
+        if (weight_format == WeightFormat::F32) {
+            dense_tanh(x, batch, layer.n_inputs, parameters.data, parameters.data + n_weights, layer.n_neurons, y,
+                       precision);
+        } else {
+            dense_tanh(x, batch, layer.n_inputs, packed, weight_format, parameters.data + n_weights,
+                       layer.n_neurons, y);
+            packed += n_weights;
+        }
+        x = y;
+    }
+}
+
+void MLP::set_precision(Precision precision)
+{
+    this->precision = precision;
+    for (Layer& layer : layers) {
+        layer.set_precision(precision);
+    }
+}
+
+void MLP::set_weight_format(WeightFormat format)
+{
+    weight_format = format;
+    packed_weights.clear();
+    if (format == WeightFormat::F32) {
+        packed_weights.shrink_to_fit();
+        return;
+    }
+    uint16_t (*convert)(float) = format == WeightFormat::F16 ? float_to_f16 : float_to_bf16;
+    for (const Layer& layer : layers) {
+        const float* weights = layer.get_parameters().data;
+        size_t n_weights = static_cast<size_t>(layer.n_neurons) * layer.n_inputs;
+        for (size_t i = 0; i < n_weights; i++) {
+            packed_weights.push_back(convert(weights[i]));
+        }
+    }
+}
+
+// Sparse batches
+void MLP::collect_columns(const SparseMatrix& inputs)
+{
+    sparse_grad.offset = 0;
+    sparse_grad.rows = layers[0].n_neurons;
+    sparse_grad.row_length = n_inputs;
+    sparse_grad.columns.clear();
+    if (column_marks.size() != static_cast<size_t>(n_inputs)) {
+        column_marks.assign(n_inputs, 0);
+        mark_generation = 0;
+    }
+    if (++mark_generation == 0) {
+        std::fill(column_marks.begin(), column_marks.end(), 0);
+        mark_generation = 1;
+    }
+    for (int r = 0; r < inputs.get_rows(); r++) {
+        const int32_t* columns = inputs.row_indices(r);
+        for (int i = 0; i < inputs.row_size(r); i++) {
+            if (column_marks[columns[i]] != mark_generation) {
+                column_marks[columns[i]] = mark_generation;
+                sparse_grad.columns.push_back(columns[i]);
+            }
+        }
+    }
+    std::sort(sparse_grad.columns.begin(), sparse_grad.columns.end());
+}
+
+void MLP::clear_columns()
+{
+    sparse_grad.offset = 0;
+    sparse_grad.rows = 0;
+    sparse_grad.row_length = 0;
+    sparse_grad.columns.clear();
+}
+
+// Data-parallel training step
+float MLP::train_batch(const Matrix& inputs, const Matrix& targets, ThreadPool& pool, Loss kind)
+{
+    return train_batch(&inputs, nullptr, targets, pool, kind);
+}
+
+float MLP::train_batch(const SparseMatrix& inputs, const Matrix& targets, ThreadPool& pool, Loss kind)
+{
+    if (inputs.get_cols() != n_inputs) {
+        throw std::invalid_argument("sparse batch has " + std::to_string(inputs.get_cols()) + " columns, the MLP "
+                                    + std::to_string(n_inputs) + " inputs");
+    }
+    return train_batch(nullptr, &inputs, targets, pool, kind);
+}
+
+// One of inputs and sparse is set
+float MLP::train_batch(const Matrix* inputs, const SparseMatrix* sparse, const Matrix& targets, ThreadPool& pool,
+                       Loss kind)
+{
+    int batch = sparse ? sparse->get_rows() : inputs->get_rows();
+    int n_outputs = n_neurons_per_layer.back();
+    if (inputs && inputs->get_cols() != n_inputs) {
+        throw std::invalid_argument("batch has " + std::to_string(inputs->get_cols()) + " columns, the MLP "
+                                    + std::to_string(n_inputs) + " inputs");
+    }
+    if (targets.get_rows() != batch
+        || targets.get_cols() != (kind == Loss::SoftmaxCrossEntropy ? 1 : n_outputs)) {
+        throw std::invalid_argument("train_batch: targets do not match the batch");
+    }
+    if (kind == Loss::SoftmaxCrossEntropy) {
+        check_class_targets(targets.data(), batch, n_outputs);
+    }
+    if (sparse) {
+        collect_columns(*sparse);
+    } else {
+        clear_columns();
+    }
+    int n_shards = std::min(pool.size(), batch);
+    Parameters parameters = get_parameters();
+    // the first layer's weights, at the start of the block
+    size_t first_weights = static_cast<size_t>(layers[0].n_neurons) * n_inputs;
+
+    while (static_cast<int>(workers.size()) < n_shards) {
+        auto worker = std::make_unique<Worker>(parameters.size);
+        size_t offset = 0;
+        for (const Layer& layer : layers) {
+            size_t n_weights = static_cast<size_t>(layer.n_neurons) * layer.n_inputs;
+            worker->layers.push_back(DenseTanh(layer.n_inputs, layer.n_neurons));
+            // shared weights, private gradients
+            worker->layers.back().set_parameters(parameters.data + offset, parameters.data + offset + n_weights,
+                                                 worker->grads.data() + offset,
+                                                 worker->grads.data() + offset + n_weights);
+            offset += layer.get_parameters().size;
+        }
+        worker->input_grads.resize(layers.size());
+        workers.push_back(std::move(worker));
+    }
+
+    pool.parallel_for(n_shards, [&](int shard) {
+        Worker& worker = *workers[shard];
+        int begin = static_cast<int>(static_cast<long>(batch) * shard / n_shards);
+        int end = static_cast<int>(static_cast<long>(batch) * (shard + 1) / n_shards);
+        int rows = end - begin;
+        float* shard_grads = worker.grads.data();
+        if (sparse) {
+            // the first weights' grads are left at zero by the reduction
+            if (!worker.first_weights_clean) {
+                std::memset(shard_grads, 0, first_weights * sizeof(float));
+                worker.first_weights_clean = true;
+            }
+            std::memset(shard_grads + first_weights, 0, (parameters.size - first_weights) * sizeof(float));
+        } else {
+            std::memset(shard_grads, 0, parameters.size * sizeof(float));
+            worker.first_weights_clean = false;
+        }
+        for (DenseTanh& layer : worker.layers) {
+            layer.set_precision(precision);
+        }
+
+        // forward over this shard
+        const Matrix* outputs;
+        if (sparse) {
+            worker.sparse_inputs.assign_rows(*sparse, begin, end);
+            outputs = &worker.layers[0].forward(worker.sparse_inputs);
+        } else {
+            worker.inputs.resize(rows, inputs->get_cols());
+            std::copy(inputs->row(begin), inputs->row(begin) + static_cast<size_t>(rows) * inputs->get_cols(),
+                      worker.inputs.data());
+            outputs = &worker.layers[0].forward(worker.inputs);
+        }
+        for (size_t l = 1; l < worker.layers.size(); l++) {
+            outputs = &worker.layers[l].forward(*outputs);
+        }
+
+        // loss and its gradient in one pass, scaled by the whole batch
+        worker.output_grads.resize(rows, n_outputs);
+        worker.loss = loss_kernel(kind, outputs->data(), targets.row(begin), rows, n_outputs, 1.0f / batch,
+                                  worker.output_grads.data());
+
+        const Matrix* grads = &worker.output_grads;
+        for (size_t l = layers.size(); l-- > 0;) {
+            Matrix* layer_input_grads = l > 0 ? &worker.input_grads[l] : nullptr;
+            worker.layers[l].backward(*grads, layer_input_grads);
+            grads = layer_input_grads;
+        }
+    });
+
+    // Reduce in shard order straight into the parameters' grads. For a
+    // sparse batch the first weights only at the touched columns, which are
+    // zeroed again on the way
+    float loss = 0.0f;
+    for (int shard = 0; shard < n_shards; shard++) {
+        float* grads = workers[shard]->grads.data();
+        if (sparse) {
+            kernels().axpy(1.0f, grads + first_weights, parameters.grad + first_weights,
+                           static_cast<int>(parameters.size - first_weights));
+            for (int j = 0; j < layers[0].n_neurons; j++) {
+                size_t row = static_cast<size_t>(j) * n_inputs;
+                for (int32_t c : sparse_grad.columns) {
+                    parameters.grad[row + c] += grads[row + c];
+                    grads[row + c] = 0.0f;
+                }
+            }
+        } else {
+            kernels().axpy(1.0f, grads, parameters.grad, static_cast<int>(parameters.size));
+        }
+        loss += workers[shard]->loss;
+    }
+    return loss;
+}
+
+// Zero the gradients of all parameters
+void MLP::zero_grad()
+{
+    Parameters parameters = get_parameters();
+    std::memset(parameters.grad, 0, parameters.size * sizeof(float));
+}
+
+// Checkpoints
+// Fixed part of the checkpoint header, followed by n_layers layer sizes and
+// padding up to data_offset. Fields are in native byte order.
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_inputs;
+    uint32_t n_layers;
+    uint32_t float_size;
+    uint64_t n_parameters;
+    uint64_t data_offset;
+};
+
+static constexpr char checkpoint_magic[8] = { 'M', 'G', 'R', 'D', 'C', 'K', 'P', 'T' };
+static constexpr uint32_t checkpoint_version = 1;
+
+static uint64_t checkpoint_data_offset(size_t n_layers)
+{
+    return (sizeof(CheckpointHeader) + n_layers * sizeof(uint32_t) + 63) / 64 * 64;
+}
+
+void MLP::save(const std::string& path) const
+{
+    Parameters parameters = get_parameters();
+    CheckpointHeader header;
+    std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.version = checkpoint_version;
+    header.n_inputs = n_inputs;
+    header.n_layers = n_neurons_per_layer.size();
+    header.float_size = sizeof(float);
+    header.n_parameters = parameters.size;
+    header.data_offset = checkpoint_data_offset(n_neurons_per_layer.size());
+
+    // header, sizes and padding go out as one block, then the parameters
+    std::vector<char> head(header.data_offset, 0);
+    std::memcpy(head.data(), &header, sizeof(header));
+    for (size_t i = 0; i < n_neurons_per_layer.size(); i++) {
+        uint32_t size = n_neurons_per_layer[i];
+        std::memcpy(head.data() + sizeof(header) + i * sizeof(uint32_t), &size, sizeof(size));
+    }
+
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        throw std::runtime_error("cannot open " + path + " for writing");
+    }
+    bool ok = std::fwrite(head.data(), 1, head.size(), file) == head.size()
+        && std::fwrite(parameters.data, sizeof(float), parameters.size, file) == parameters.size;
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok) {
+        throw std::runtime_error("cannot write checkpoint " + path);
+    }
+}
+
+MLP MLP::load(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(CheckpointHeader)) {
+        ::close(fd);
+        throw std::runtime_error("not a checkpoint: " + path);
+    }
+    size_t file_size = st.st_size;
+    // writable private mapping: the model may be trained further, the file never changes
+    void* address = ::mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (address == MAP_FAILED) {
+        throw std::runtime_error("cannot map " + path);
+    }
+    std::shared_ptr<void> mapping(address, [file_size](void* address) { ::munmap(address, file_size); });
+
+    const char* bytes = static_cast<const char*>(address);
+    CheckpointHeader header;
+    std::memcpy(&header, bytes, sizeof(header));
+    if (std::memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0) {
+        throw std::runtime_error("not a checkpoint: " + path);
+    }
+    if (header.version != checkpoint_version || header.float_size != sizeof(float)) {
+        throw std::runtime_error("unsupported checkpoint version in " + path);
+    }
+    if (header.n_layers == 0 || header.data_offset != checkpoint_data_offset(header.n_layers)
+        || header.data_offset > file_size) {
+        throw std::runtime_error("corrupt checkpoint header in " + path);
+    }
+
+    // Every size positive and an int; the parameters they imply, counted
+    // without overflow, must be the header's count and fit in the file
+    const uint32_t max_size = std::numeric_limits<int>::max();
+    if (header.n_inputs == 0 || header.n_inputs > max_size) {
+        throw std::runtime_error("corrupt checkpoint header in " + path);
+    }
+    const uint64_t max_parameters = (file_size - header.data_offset) / sizeof(float);
+    std::vector<int> sizes(header.n_layers);
+    uint64_t n_parameters = 0;
+    uint64_t layer_inputs = header.n_inputs;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        uint32_t size;
+        std::memcpy(&size, bytes + sizeof(header) + i * sizeof(uint32_t), sizeof(size));
+        if (size == 0 || size > max_size) {
+            throw std::runtime_error("corrupt checkpoint header in " + path);
+        }
+        uint64_t layer = (layer_inputs + 1) * size;
+        n_parameters += layer;
+        if (layer > max_parameters || n_parameters > max_parameters) {
+            throw std::runtime_error("truncated checkpoint " + path);
+        }
+        sizes[i] = size;
+        layer_inputs = size;
+    }
+    if (header.n_parameters != n_parameters) {
+        throw std::runtime_error("corrupt checkpoint header in " + path);
+    }
+
+    float* values = reinterpret_cast<float*>(static_cast<char*>(address) + header.data_offset);
+    auto storage = std::make_shared<ParameterStorage>(values, header.n_parameters, std::move(mapping));
+    return MLP(header.n_inputs, sizes, std::move(storage));
+}
+
+// Optimizer
+Optimizer::Optimizer(Parameters parameters, double learning_rate)
+    : parameters(parameters), learning_rate(learning_rate)
+{
+}
+
+Optimizer::~Optimizer()
+{
+}
+
+void Optimizer::step()
+{
+    prepare();
+    update(0, parameters.size);
+}
+
+void Optimizer::step(const SparseGrad& touched)
+{
+    // No block after a dense batch: every parameter
+    if (touched.rows == 0) {
+        step();
+        return;
+    }
+    // Dense before and after the block, the touched columns of each row inside
+    prepare();
+    size_t block_end = touched.offset + static_cast<size_t>(touched.rows) * touched.row_length;
+    update(0, touched.offset);
+    for (int r = 0; r < touched.rows; r++) {
+        update(touched.offset + static_cast<size_t>(r) * touched.row_length, touched.columns.data(),
+               touched.columns.size());
+    }
+    update(block_end, parameters.size);
+}
+
+void Optimizer::zero_grad()
+{
+    std::memset(parameters.grad, 0, parameters.size * sizeof(float));
+}
+
+SGD::SGD(Parameters parameters, double learning_rate, double momentum)
+    : Optimizer(parameters, learning_rate), momentum(momentum), velocity(parameters.size)
+{
+}
+
+void SGD::update(size_t begin, size_t end)
+{
+    float* __restrict data = parameters.data;
+    float* __restrict grad = parameters.grad;
+    const float lr = learning_rate;
+    const float mu = momentum;
+    if (mu == 0.0f) {
+        for (size_t i = begin; i < end; i++) {
+            data[i] -= lr * grad[i];
+            grad[i] = 0.0f;
+        }
+        return;
+    }
+    float* __restrict vel = velocity.data();
+    for (size_t i = begin; i < end; i++) {
+        vel[i] = mu * vel[i] + grad[i];
+        data[i] -= lr * vel[i];
+        grad[i] = 0.0f;
+    }
+}
+
+void SGD::update(size_t first, const int32_t* columns, size_t n)
+{
+    float* __restrict data = parameters.data + first;
+    float* __restrict grad = parameters.grad + first;
+    const float lr = learning_rate;
+    const float mu = momentum;
+    if (mu == 0.0f) {
+        for (size_t c = 0; c < n; c++) {
+            size_t i = columns[c];
+            data[i] -= lr * grad[i];
+            grad[i] = 0.0f;
+        }
+        return;
+    }
+    float* __restrict vel = velocity.data() + first;
+    for (size_t c = 0; c < n; c++) {
+        size_t i = columns[c];
+        vel[i] = mu * vel[i] + grad[i];
+        data[i] -= lr * vel[i];
+        grad[i] = 0.0f;
+    }
+}
+
+Adam::Adam(Parameters parameters, double learning_rate, double beta1, double beta2, double epsilon)
+    : Optimizer(parameters, learning_rate), beta1(beta1), beta2(beta2), epsilon(epsilon),
+      m(parameters.size), v(parameters.size)
+{
+}
+
+void Adam::prepare()
+{
+    // Bias corrections folded into the step size:
+    // p -= lr * sqrt(1 - b2^t) / (1 - b1^t) * m / (sqrt(v) + eps')
+    t++;
+    const double correction1 = 1.0 - std::pow(beta1, t);
+    const double correction2 = 1.0 - std::pow(beta2, t);
+    step_size = learning_rate * std::sqrt(correction2) / correction1;
+    eps = epsilon * std::sqrt(correction2);
+}
+
+void Adam::update(size_t begin, size_t end)
+{
+    const float b1 = beta1;
+    const float b2 = beta2;
+    const float step_size = this->step_size;
+    const float eps = this->eps;
+    float* __restrict data = parameters.data;
+    float* __restrict grad = parameters.grad;
+    float* __restrict m1 = m.data();
+    float* __restrict m2 = v.data();
+    for (size_t i = begin; i < end; i++) {
+        float g = grad[i];
+        m1[i] = b1 * m1[i] + (1.0f - b1) * g;
+        m2[i] = b2 * m2[i] + (1.0f - b2) * g * g;
+        data[i] -= step_size * m1[i] / (std::sqrt(m2[i]) + eps);
+        grad[i] = 0.0f;
+    }
+}
+
+void Adam::update(size_t first, const int32_t* columns, size_t n)
+{
+    const float b1 = beta1;
+    const float b2 = beta2;
+    float* __restrict data = parameters.data + first;
+    float* __restrict grad = parameters.grad + first;
+    float* __restrict m1 = m.data() + first;
+    float* __restrict m2 = v.data() + first;
+    for (size_t c = 0; c < n; c++) {
+        size_t i = columns[c];
+        float g = grad[i];
+        m1[i] = b1 * m1[i] + (1.0f - b1) * g;
+        m2[i] = b2 * m2[i] + (1.0f - b2) * g * g;
+        data[i] -= step_size * m1[i] / (std::sqrt(m2[i]) + eps);
+        grad[i] = 0.0f;
+    }
+}
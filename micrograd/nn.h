@@ -1,3 +1,5 @@
+#pragma once
+
 // Using the Value implementation from engine here we implement the neural network structure
 // piece by piece. We start with Neuron, which is a single node in the network. It has a
 // number of inputs and a number of outputs. It also has a weight and a bias. The weight
@@ -6,84 +8,408 @@
 // the neuron with respect to the inputs, weights, and biases. The backward function is
 // called by the backward function of the Layer class.
 
-#include "graph_system.cc"
+#include "engine.h"
+#include "thread_pool.h"
 
 #include <iostream>
+#include <memory>
+#include <span>
 #include <vector>
 #include <unordered_map>
 
 
+// Float array aligned to a cache line and zero-initialized, so SIMD loads
+// and whole-block copies of the parameters stay simple.
+class AlignedBuffer {
+public:
+    explicit AlignedBuffer(size_t size = 0);
+    ~AlignedBuffer();
+    AlignedBuffer(const AlignedBuffer&) = delete;
+    AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+    float* data() const { return values; }
+    size_t size() const { return n; }
+
+private:
+    void* raw = nullptr;
+    float* values = nullptr;
+    size_t n = 0;
+};
+
+// A view of parameters and their gradients, two parallel contiguous arrays.
+// The storage belongs to the MLP (or to a standalone Layer / Neuron).
+struct Parameters {
+    float* data = nullptr;
+    float* grad = nullptr;
+    size_t size = 0;
+
+    Parameters slice(size_t offset, size_t count) const {
+        return Parameters{data + offset, grad + offset, count};
+    }
+};
+
+// Initialization schemes, fan_in / fan_out being a layer's inputs / neurons:
+//   Uniform  every weight and bias in U(-1, 1)
+//   Xavier   weights in U(-a, a) with a = sqrt(6 / (fan_in + fan_out)), biases 0
+//   He       weights in U(-a, a) with a = sqrt(6 / fan_in), biases 0
+enum class Init : uint8_t { Uniform, Xavier, He };
+
+// Seeds of the constructors that do not take one. Each such construction
+// takes the next seed of a per-thread stream starting at default_seed, so
+// two parts built without a seed never share weights, while a program that
+// builds the same objects in the same order on a thread gets the same
+// weights on every run.
+constexpr uint64_t default_seed = 0;
+uint64_t next_default_seed();
+
+// Fills data[0..n) with U(-bound, bound). Counter based: value i is a hash of
+// the seed and offset + i, so a range can be split anywhere (between
+// threads, layers) and still give exactly the same numbers.
+void fill_uniform(float* data, size_t n, float bound, uint64_t seed, uint64_t offset = 0);
+
+// Storage behind Parameters. The values are either owned or live in an
+// external buffer (a mapped checkpoint) kept alive by a shared handle; the
+// gradients are always owned.
+struct ParameterStorage {
+    AlignedBuffer data;
+    AlignedBuffer grad;
+    float* values;
+    std::shared_ptr<void> external;
+
+    explicit ParameterStorage(size_t size) : data(size), grad(size), values(data.data()) {}
+    ParameterStorage(float* values, size_t size, std::shared_ptr<void> external)
+        : grad(size), values(values), external(std::move(external)) {}
+    Parameters view() const { return Parameters{values, grad.data(), grad.size()}; }
+};
+
+
+// Neuron; a view of n_inputs weights and one bias
 class Neuron {
 public:
+    // Standalone neuron with its own storage, weights then bias, all in
+    // U(-1, 1) drawn from seed, or from next_default_seed()
     Neuron(int n_inputs);
+    Neuron(int n_inputs, uint64_t seed);
+    // View of parameters in storage owned by a layer or an MLP
+    Neuron(int n_inputs, Parameters weights, Parameters bias, std::shared_ptr<ParameterStorage> storage);
     ~Neuron();
 
     int n_inputs;
 
-    Value forward(const std::vector<Value>& inputs);
+    // Binds the parameters on the inputs' tape, then records the neuron
+    Value forward(std::span<const Value> inputs);
+    // Records the neuron with its parameters already bound: weights at
+    // node weights_id onwards and the bias at node bias_id
+    Value forward(std::span<const Value> inputs, uint32_t weights_id, uint32_t bias_id) const;
+    // Sparse input: values[i] is input indices[i] (increasing), every other
+    // input is zero. Records one multiply-add per nonzero.
+    Value forward(std::span<const Value> values, std::span<const int32_t> indices);
+    Value forward(std::span<const Value> values, std::span<const int32_t> indices, uint32_t weights_id,
+                  uint32_t bias_id) const;
 
-    // get_parameters() returns a vector of pointers to the parameters of the neuron
-    std::vector<Value*> get_parameters();
+    Parameters get_weights() const { return weights; }
+    Parameters get_bias() const { return bias; }
 
 private:
-    std::vector<Value> weights;
-    Value bias = Value(0.0, "b");
+    std::shared_ptr<ParameterStorage> storage;
+    Parameters weights;
+    Parameters bias;
 };
 
 
-// Layer; a collection of neurons 
+// Layer; a collection of neurons, viewing one block of parameters laid out
+// as weights (n_neurons x n_inputs, one row per neuron) then biases
 class Layer {
 public:
+    // Standalone layer with its own storage, every parameter in U(-1, 1)
+    // drawn from seed
     Layer(int n_inputs, int n_neurons);
+    Layer(int n_inputs, int n_neurons, uint64_t seed);
+    // View of parameters in storage owned by an MLP, which also initializes them
+    Layer(int n_inputs, int n_neurons, Parameters parameters, std::shared_ptr<ParameterStorage> storage);
     ~Layer();
 
     int n_inputs;
     int n_neurons;
 
-    std::vector<Value> forward(const std::vector<Value>& inputs);
+    std::vector<Value> forward(std::span<const Value> inputs);
+    // Same, with the layer's parameters already bound from node first_id on,
+    // writing into outputs (cleared first, so its capacity is reused)
+    void forward(std::span<const Value> inputs, uint32_t first_id, std::vector<Value>& outputs) const;
+    // Sparse input as in Neuron::forward
+    std::vector<Value> forward(std::span<const Value> values, std::span<const int32_t> indices);
+    void forward(std::span<const Value> values, std::span<const int32_t> indices, uint32_t first_id,
+                 std::vector<Value>& outputs) const;
+
+    // Batched path, one sample per row. The whole layer is a single DenseTanh
+    // node working directly on the parameter block. std::invalid_argument
+    // unless the batch is n_inputs wide.
+    const Matrix& forward(const Matrix& inputs);
+    // Same, writing the activations into outputs (see DenseTanh::forward)
+    const Matrix& forward(const Matrix& inputs, Matrix& outputs);
+    // Sparse batch (see DenseTanh); backward then takes no input grads
+    const Matrix& forward(const SparseMatrix& inputs);
+    const Matrix& forward(const SparseMatrix& inputs, Matrix& outputs);
+    void backward(const Matrix& output_grads, Matrix* input_grads);
+    void set_precision(Precision precision) { dense.set_precision(precision); }
+
+    std::span<const Neuron> get_neurons() const { return neurons; }
+    Parameters get_parameters() const { return parameters; }
+
+    static size_t n_parameters(int n_inputs, int n_neurons) {
+        return static_cast<size_t>(n_neurons) * (n_inputs + 1);
+    }
 
-    std::vector<Neuron> get_neurons() const { return neurons; }
-    std::vector<Value*> get_parameters();
-    
 private:
+    std::shared_ptr<ParameterStorage> storage;
+    Parameters parameters;
     std::vector<Neuron> neurons;
+    DenseTanh dense;
+
+    void init(Parameters parameters);
+};
+
+
+// Where the gradients can be nonzero after a sparse batch. Inside the block
+// of rows x row_length parameters at offset (the first layer's weights, one
+// row per neuron) only the listed columns, the input features the batch
+// touched; outside the block, anywhere. Without rows, after a dense batch,
+// anywhere at all.
+struct SparseGrad {
+    size_t offset = 0;
+    int rows = 0;
+    int row_length = 0;
+    // increasing
+    std::vector<int32_t> columns;
 };
 
 
-// MLP; Multi-Layer Perceptron; a collection of layers
+// MLP; Multi-Layer Perceptron; a collection of layers. All weights and
+// biases live in one ParameterStorage, layer after layer.
 class MLP {
 public:
+    // Init::Uniform from next_default_seed()
     MLP(int n_inputs, std::vector<int> n_neurons_per_layer);
+    // Same, initialized with scheme from seed; equal seeds give bit-identical
+    // parameters
+    MLP(int n_inputs, std::vector<int> n_neurons_per_layer, Init scheme, uint64_t seed);
     ~MLP();
 
     int n_inputs;
     std::vector<int> n_neurons_per_layer;
 
-    std::vector<Value> forward(const std::vector<Value>& inputs);
+    // Scalar path. The outputs live in buffers owned by the MLP and stay
+    // valid until the next forward; once those buffers and the tape have
+    // grown to size, a call performs no heap allocation.
+    std::span<const Value> forward(std::span<const Value> inputs);
+    // Sparse input as in Neuron::forward; the first layer records one
+    // multiply-add per nonzero and neuron
+    std::span<const Value> forward(std::span<const Value> values, std::span<const int32_t> indices);
+
+    // Batched path: one graph node per layer instead of one per multiply-add.
+    // backward takes dL/d(output) for the last forward batch. Both forwards
+    // throw std::invalid_argument unless the batch is n_inputs wide.
+    const Matrix& forward(const Matrix& inputs);
+    void backward(const Matrix& output_grads);
+    // Sparse batch, n_inputs columns: the first layer's cost is proportional
+    // to the nonzeros, not the input width, and backward only writes the
+    // weight grads of the touched columns (see get_sparse_grad)
+    const Matrix& forward(const SparseMatrix& inputs);
+
+    // Gradient checkpointing for the batched path. The layers are cut into
+    // segments of k; forward keeps only the output of each segment's last
+    // layer and shares k - 1 buffers for the layers inside a segment, and
+    // backward recomputes those from the segment's input before going
+    // through it. Activation memory drops from L to about L / k + k - 1
+    // batch matrices for one more forward of the inner layers; k around
+    // sqrt(L) needs the least. k = 1 (the default) keeps every activation.
+    // Gradients are the same in every mode.
+    void set_checkpoint_every(int k);
+    int get_checkpoint_every() const { return checkpoint_every; }
+    // Bytes held by the batched path's activation and gradient buffers
+    size_t get_activation_bytes() const;
 
-    std::vector<Layer> get_layers() const { return layers; }
-    std::vector<Value*> get_parameters();
+    // Inference only: evaluates the network on plain floats, batch rows of
+    // n_inputs into batch rows of n_outputs. Records no graph at all and,
+    // once the activation buffers have grown to the batch size, does not
+    // allocate. The buffers belong to the MLP, so use one MLP per thread.
+    void predict(const float* inputs, float* outputs, int batch = 1);
+
+    // Arithmetic of the batched path, predict and train_batch. The scalar
+    // Value path always works in float32.
+    void set_precision(Precision precision);
+    Precision get_precision() const { return precision; }
+
+    // Weights predict reads. F16 and BF16 pack a 16-bit copy of every
+    // layer's weights (biases stay float32), halving the bytes streamed per
+    // sample. The copy is taken here, so set it again after the weights
+    // change; training keeps using the float32 parameters.
+    void set_weight_format(WeightFormat format);
+    WeightFormat get_weight_format() const { return weight_format; }
+
+    // Data-parallel training step on the batched path with the given loss
+    // (targets as for loss() on matrices). The batch is cut into pool.size() contiguous shards; each
+    // worker runs forward/backward with its own activations and gradient
+    // buffer, and the buffers are summed in shard order, so the result does
+    // not depend on scheduling. The sum is added to the parameters' grads and
+    // the loss is returned; the optimizer step is left to the caller.
+    // Throws std::invalid_argument, before any work, when inputs is not
+    // n_inputs wide or targets do not match the batch.
+    float train_batch(const Matrix& inputs, const Matrix& targets, ThreadPool& pool, Loss kind = Loss::MSE);
+    // Same on a sparse batch. Apart from the first layer's input products,
+    // the shard buffers are only cleared and reduced where the batch can
+    // have written, so nothing in the step scales with the input width.
+    float train_batch(const SparseMatrix& inputs, const Matrix& targets, ThreadPool& pool,
+                      Loss kind = Loss::MSE);
+    // Gradient pattern of the last forward or train_batch, for
+    // Optimizer::step(const SparseGrad&); dense (no rows) unless that one was
+    // sparse. It only covers the last batch, so step after each one.
+    const SparseGrad& get_sparse_grad() const { return sparse_grad; }
+
+    std::span<const Layer> get_layers() const { return layers; }
+    Parameters get_parameters() const { return storage->view(); }
+
+    // Draw every parameter again. Parameter i of the block only depends on
+    // the seed and i, so the pool version gives the same result for any
+    // number of threads.
+    void initialize(Init scheme, uint64_t seed);
+    void initialize(Init scheme, uint64_t seed, ThreadPool& pool);
 
     void zero_grad();
 
+    // Checkpoints. The file is a header (format version, layer sizes) and
+    // then every parameter in the in-memory layout, weights then biases layer
+    // after layer, starting at a 64-byte aligned offset. save() writes it
+    // sequentially. load() maps the file privately and the model works on
+    // the mapping directly: nothing is read or copied up front, pages are
+    // faulted in as inference touches them, and training writes go to
+    // private copies, never back to the file. Throws std::runtime_error on
+    // I/O errors or a malformed file.
+    void save(const std::string& path) const;
+    static MLP load(const std::string& path);
+
 private:
+    // Layers over existing parameter storage, values left as they are
+    MLP(int n_inputs, std::vector<int> n_neurons_per_layer, std::shared_ptr<ParameterStorage> storage);
+
+    std::shared_ptr<ParameterStorage> storage;
     std::vector<Layer> layers;
-};
+    // activations of the scalar forward, alternating between layers
+    std::vector<Value> activations[2];
+    // same for predict
+    std::vector<float> predict_buffers[2];
+    Precision precision = Precision::Single;
+    WeightFormat weight_format = WeightFormat::F32;
+    // 16-bit weights of every layer, one after the other, unless F32
+    std::vector<uint16_t> packed_weights;
+    // Batched path buffers: the output of the last layer of each segment,
+    // the outputs inside a segment, and the gradients flowing between layers
+    // (alternating). batch_inputs is the last forward's input batch.
+    int checkpoint_every = 1;
+    std::vector<Matrix> checkpoints;
+    std::vector<Matrix> segment;
+    Matrix layer_grads[2];
+    const Matrix* batch_inputs = nullptr;
+    // the last forward's input batch when it was sparse
+    const SparseMatrix* sparse_inputs = nullptr;
+    SparseGrad sparse_grad;
+    // column_marks[c] == mark_generation when column c is already in sparse_grad
+    std::vector<uint32_t> column_marks;
+    uint32_t mark_generation = 0;
+
+    // Batched forward from batch_inputs or sparse_inputs
+    const Matrix& forward_batch();
+    // Fills sparse_grad with the columns of inputs
+    void collect_columns(const SparseMatrix& inputs);
+    // Marks sparse_grad dense, for the paths that can write any gradient
+    void clear_columns();
+    std::span<const Value> forward_layers(size_t first, std::span<const Value> inputs, uint32_t first_id);
+    float train_batch(const Matrix* inputs, const SparseMatrix* sparse, const Matrix& targets, ThreadPool& pool,
+                      Loss kind);
+
+    // Forward through layers [begin, end) of segment s
+    const Matrix* forward_segment(size_t s, size_t begin, size_t end, const Matrix* x);
 
+    // State of one train_batch shard
+    struct Worker {
+        explicit Worker(size_t n_parameters) : grads(n_parameters) {}
 
-// Loss function, returns a Value pointer to the loss
-Value* loss(const std::vector<Value>& outputs, const std::vector<Value>& targets);
+        std::vector<DenseTanh> layers;
+        std::vector<Matrix> input_grads;
+        Matrix inputs;
+        SparseMatrix sparse_inputs;
+        // the first layer's weight grads are all zero, as sparse batches
+        // leave them
+        bool first_weights_clean = false;
+        Matrix output_grads;
+        AlignedBuffer grads;
+        float loss;
+    };
+    std::vector<std::unique_ptr<Worker>> workers;
+};
 
 
-// Optimizer
+// Optimizers. They work on a Parameters view with their state (velocity,
+// moments) in flat arrays parallel to it. step() updates every parameter and
+// zeroes its grad in the same pass over contiguous memory, so there is no
+// separate zero_grad sweep and the loop vectorizes.
 class Optimizer {
 public:
-    Optimizer(std::vector<Value*> parameters, double learning_rate);
-    ~Optimizer();
+    Optimizer(Parameters parameters, double learning_rate);
+    virtual ~Optimizer();
 
     void step();
+    // Step after a sparse batch: only the parameters whose grads can be
+    // nonzero are visited, all of them when touched has no rows. For plain
+    // SGD that is the same update as step(); with momentum or Adam the state
+    // of the skipped parameters is left as it is instead of decaying (the
+    // usual lazy sparse update).
+    void step(const SparseGrad& touched);
+    void zero_grad();
 
-private:
-    std::vector<Value*> parameters;
+protected:
+    Parameters parameters;
     double learning_rate;
+
+    // Once per step, before the updates
+    virtual void prepare() {}
+    // Update parameters [begin, end) and zero their grads
+    virtual void update(size_t begin, size_t end) = 0;
+    // Same for parameters first + columns[i], i < n
+    virtual void update(size_t first, const int32_t* columns, size_t n) = 0;
+};
+
+// Plain SGD, or SGD with (heavy-ball) momentum when momentum > 0
+class SGD : public Optimizer {
+public:
+    SGD(Parameters parameters, double learning_rate, double momentum = 0.0);
+
+private:
+    double momentum;
+    AlignedBuffer velocity;
+
+    void update(size_t begin, size_t end) override;
+    void update(size_t first, const int32_t* columns, size_t n) override;
+};
+
+// Adam (Kingma & Ba) with bias-corrected moment estimates
+class Adam : public Optimizer {
+public:
+    Adam(Parameters parameters, double learning_rate = 1e-3,
+         double beta1 = 0.9, double beta2 = 0.999, double epsilon = 1e-8);
+
+private:
+    double beta1;
+    double beta2;
+    double epsilon;
+    int t = 0;
+    AlignedBuffer m;
+    AlignedBuffer v;
+    // bias-corrected step size and epsilon of the current step
+    float step_size = 0.0f;
+    float eps = 0.0f;
+
+    void prepare() override;
+    void update(size_t begin, size_t end) override;
+    void update(size_t first, const int32_t* columns, size_t n) override;
 };
\ No newline at end of file
@@ -0,0 +1,216 @@
+// Benchmarks for micrograd/nn.h
+//
+// batched vs scalar: one training step (forward + backward) over a minibatch,
+// through the per-sample Value graph and through the batched Matrix path.
+// train_batch scaling: samples/sec of MLP::train_batch per thread count.
+// optimizer step: time per parameter of SGD / momentum / Adam step().
+// predict latency: per-sample latency of MLP::predict at batch 1 and 64,
+// next to the scalar graph and the batched forward.
+// checkpoint: save, and load + first prediction from a mapped checkpoint,
+// next to constructing a fresh model of the same size.
+// precision: per-sample predict time with float32, fp16 and bfloat16
+// weights, and with mixed precision sums, on a model whose weights do not
+// fit in cache.
+// sparse inputs: train_batch + optimizer step on a wide, mostly zero input,
+// as a dense Matrix and as a SparseMatrix with the sparse optimizer step,
+// per density.
+// initialize: constructing a seeded model, and initialize() alone on one
+// thread and on a pool.
+
+#include "nn.h"
+#include "bench.h"
+
+#include <vector>
+
+void bench_batched_vs_scalar(int n_inputs, std::vector<int> sizes, int batch)
+{
+    MLP mlp(n_inputs, sizes);
+    Tape& tape = Tape::current();
+    size_t mark = tape.mark();
+
+    Matrix inputs(batch, n_inputs, 0.5f);
+    Matrix output_grads(batch, sizes.back(), 1.0f);
+
+    double scalar_ns = time_ns([&]() {
+        for (int r = 0; r < batch; r++) {
+            std::vector<Value> x;
+            for (int i = 0; i < n_inputs; i++) {
+                x.push_back(Value(inputs(r, i)));
+            }
+            std::span<const Value> outputs = mlp.forward(x);
+            outputs[0].backward();
+            tape.rewind(mark);
+        }
+    }, 3);
+    double batched_ns = time_ns([&]() {
+        mlp.forward(inputs);
+        mlp.backward(output_grads);
+    }, 3);
+
+    std::printf("train step, %d inputs, %zu layers, batch %d\n", n_inputs, sizes.size(), batch);
+    report("  scalar graph, per sample", scalar_ns / batch / 1e3, "us");
+    report("  batched, per sample", batched_ns / batch / 1e3, "us");
+    tape.clear();
+}
+
+void bench_train_batch_scaling(int n_inputs, std::vector<int> sizes, int batch)
+{
+    MLP mlp(n_inputs, sizes);
+    Matrix inputs(batch, n_inputs, 0.5f);
+    Matrix targets(batch, sizes.back(), 0.0f);
+
+    std::printf("train_batch, %d inputs, %zu layers, batch %d\n", n_inputs, sizes.size(), batch);
+    int max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        ThreadPool pool(n_threads);
+        double ns = time_ns([&]() { mlp.train_batch(inputs, targets, pool); }, 5);
+        char name[64];
+        std::snprintf(name, sizeof(name), "  %d threads", n_threads);
+        report(name, batch / (ns * 1e-9), "samples/s");
+    }
+    Tape::current().clear();
+}
+
+void bench_optimizer_step(int n_inputs, std::vector<int> sizes)
+{
+    MLP mlp(n_inputs, sizes);
+    Parameters parameters = mlp.get_parameters();
+    double n = parameters.size;
+    SGD sgd(parameters, 0.01);
+    SGD momentum(parameters, 0.01, 0.9);
+    Adam adam(parameters, 0.001);
+
+    std::printf("optimizer step, %.0f parameters\n", n);
+    report("  SGD, per parameter", time_ns([&]() { sgd.step(); }, 20) / n, "ns");
+    report("  SGD + momentum, per parameter", time_ns([&]() { momentum.step(); }, 20) / n, "ns");
+    report("  Adam, per parameter", time_ns([&]() { adam.step(); }, 20) / n, "ns");
+    Tape::current().clear();
+}
+
+void bench_predict_latency(int n_inputs, std::vector<int> sizes)
+{
+    MLP mlp(n_inputs, sizes);
+    Tape& tape = Tape::current();
+    std::vector<Value> x;
+    for (int i = 0; i < n_inputs; i++) {
+        x.push_back(Value(0.5f));
+    }
+    size_t mark = tape.mark();
+
+    std::printf("inference, %d inputs, %zu layers\n", n_inputs, sizes.size());
+    report("  scalar graph forward, batch 1", time_ns([&]() {
+        mlp.forward(x);
+        tape.rewind(mark);
+    }, 5) / 1e3, "us/sample");
+    for (int batch : { 1, 64 }) {
+        Matrix inputs(batch, n_inputs, 0.5f);
+        std::vector<float> outputs(static_cast<size_t>(batch) * sizes.back());
+        char name[64];
+        std::snprintf(name, sizeof(name), "  batched forward, batch %d", batch);
+        report(name, time_ns([&]() { mlp.forward(inputs); }, 50) / batch / 1e3, "us/sample");
+        std::snprintf(name, sizeof(name), "  predict, batch %d", batch);
+        report(name, time_ns([&]() { mlp.predict(inputs.data(), outputs.data(), batch); }, 50) / batch / 1e3,
+               "us/sample");
+    }
+    tape.clear();
+}
+
+void bench_checkpoint(int n_inputs, std::vector<int> sizes)
+{
+    const char* path = "/tmp/micrograd_bench_checkpoint.bin";
+    std::vector<float> x(n_inputs, 0.5f);
+    std::vector<float> y(sizes.back());
+    MLP mlp(n_inputs, sizes);
+    std::printf("checkpoint, %zu parameters\n", mlp.get_parameters().size);
+
+    report("  construct MLP", time_ns([&]() { MLP fresh(n_inputs, sizes); }, 3) / 1e6, "ms");
+    report("  save", time_ns([&]() { mlp.save(path); }, 3) / 1e6, "ms");
+    report("  load", time_ns([&]() { MLP loaded = MLP::load(path); }, 20) / 1e6, "ms");
+    report("  load + first predict", time_ns([&]() {
+        MLP loaded = MLP::load(path);
+        loaded.predict(x.data(), y.data());
+    }, 20) / 1e6, "ms");
+    std::remove(path);
+}
+
+void bench_precision(int n_inputs, std::vector<int> sizes, int batch)
+{
+    MLP mlp(n_inputs, sizes);
+    Matrix inputs(batch, n_inputs, 0.5f);
+    std::vector<float> outputs(static_cast<size_t>(batch) * sizes.back());
+    std::printf("predict precision, %zu parameters, batch %d\n", mlp.get_parameters().size, batch);
+    auto run = [&](const char* name) {
+        report(name, time_ns([&]() { mlp.predict(inputs.data(), outputs.data(), batch); }, 20) / batch / 1e3,
+               "us/sample");
+    };
+    run("  float32 weights");
+    mlp.set_weight_format(WeightFormat::F16);
+    run("  fp16 weights");
+    mlp.set_weight_format(WeightFormat::BF16);
+    run("  bfloat16 weights");
+    mlp.set_weight_format(WeightFormat::F32);
+    mlp.set_precision(Precision::Mixed);
+    run("  float32 weights, mixed precision");
+}
+
+void bench_sparse_inputs(int n_inputs, std::vector<int> sizes, int batch)
+{
+    MLP mlp(n_inputs, sizes, Init::He, 1);
+    SGD optimizer(mlp.get_parameters(), 1e-3);
+    ThreadPool pool;
+    Matrix targets(batch, sizes.back(), 0.5f);
+    std::printf("sparse inputs, %d inputs, %zu parameters, batch %d\n", n_inputs, mlp.get_parameters().size, batch);
+    for (double density : { 0.01, 0.05 }) {
+        // same columns pattern for both forms
+        Matrix dense(batch, n_inputs);
+        uint64_t state = 12345;
+        for (int r = 0; r < batch; r++) {
+            for (int c = 0; c < n_inputs; c++) {
+                state = state * 6364136223846793005ull + 1442695040888963407ull;
+                if ((state >> 40) < density * (1ull << 24)) {
+                    dense(r, c) = 1.0f;
+                }
+            }
+        }
+        SparseMatrix sparse = SparseMatrix::from_dense(dense);
+        double dense_ns = time_ns([&]() {
+            mlp.train_batch(dense, targets, pool);
+            optimizer.step();
+        }, 5);
+        double sparse_ns = time_ns([&]() {
+            mlp.train_batch(sparse, targets, pool);
+            optimizer.step(mlp.get_sparse_grad());
+        }, 5);
+        char name[64];
+        std::snprintf(name, sizeof(name), "  density %.0f%%, dense step", density * 100);
+        report(name, dense_ns / 1e6, "ms");
+        std::snprintf(name, sizeof(name), "  density %.0f%%, sparse step", density * 100);
+        report(name, sparse_ns / 1e6, "ms");
+    }
+}
+
+void bench_initialize(int n_inputs, std::vector<int> sizes)
+{
+    MLP mlp(n_inputs, sizes, Init::He, 1);
+    std::printf("initialize, %zu parameters\n", mlp.get_parameters().size);
+    report("  construct MLP", time_ns([&]() { MLP fresh(n_inputs, sizes, Init::He, 1); }, 5) / 1e6, "ms");
+    report("  initialize", time_ns([&]() { mlp.initialize(Init::He, 2); }, 5) / 1e6, "ms");
+    ThreadPool pool;
+    char name[64];
+    std::snprintf(name, sizeof(name), "  initialize, %d threads", pool.size());
+    report(name, time_ns([&]() { mlp.initialize(Init::He, 2, pool); }, 5) / 1e6, "ms");
+}
+
+int main()
+{
+    bench_batched_vs_scalar(64, { 64, 64, 1 }, 32);
+    bench_batched_vs_scalar(784, { 128, 10 }, 32);
+    bench_batched_vs_scalar(784, { 512, 256, 10 }, 64);
+    bench_train_batch_scaling(784, { 256, 128, 10 }, 512);
+    bench_optimizer_step(784, { 256, 128, 10 });
+    bench_predict_latency(784, { 128, 10 });
+    bench_checkpoint(784, { 2048, 2048, 10 });
+    bench_precision(2048, { 2048, 2048, 10 }, 1);
+    bench_sparse_inputs(20000, { 128, 10 }, 32);
+    bench_initialize(3162, { 3162 });
+}
@@ -1,10 +1,35 @@
 // Testing the neural network implementation
 
-#include "nn.cc"
+#include "nn.h"
+#include "program.h"
 
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+// Counts every heap allocation made through operator new
+static std::atomic<long> n_allocations{0};
+
+void* operator new(size_t size)
+{
+    n_allocations++;
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
 
 void test_single_neuron()
 {
@@ -43,6 +68,547 @@ void test_single_neuron()
     // assert((y - target).get_data() < (prev_y - target).get_data());
 }
 
+void test_destroyed_model_bindings()
+{
+    // A model's parameters stay bound on the tape after it is destroyed; a
+    // later, unrelated backward must not write its grads into freed storage
+    {
+        MLP mlp(3, { 4, 1 }, Init::Xavier, 1);
+        std::vector<Value> x = { Value(1.0), Value(2.0), Value(0.5) };
+        mlp.forward(x)[0].backward();
+        Neuron neuron(3);
+        neuron.forward(x).backward();
+    }
+    Value a(1.0), b(2.0);
+    Value y = a * b;
+    y.backward();
+    assert(a.get_grad() == 2.0f && b.get_grad() == 1.0f);
+}
+
+void test_neuron_on_other_tape()
+{
+    // Inputs on a tape other than this thread's: the whole neuron, its
+    // starting zero included, is recorded there
+    Neuron neuron(3, 5);
+    Tape other;
+    std::vector<Value> x;
+    for (int i = 0; i < 3; i++) {
+        x.push_back(Value(&other, other.push(0.5f * i - 0.3f)));
+    }
+    size_t current_size = Tape::current().size();
+    for (bool sparse : { false, true }) {
+        std::vector<int32_t> indices = { 0, 1, 2 };
+        Value y = sparse ? neuron.forward(x, indices) : neuron.forward(x);
+        assert(y.get_tape() == &other && Tape::current().size() == current_size);
+        y.backward();
+        float dy = 1 - y.get_data() * y.get_data();
+        for (int i = 0; i < 3; i++) {
+            assert(std::fabs(neuron.get_weights().grad[i] - dy * x[i].get_data()) < 1e-5f);
+        }
+        assert(std::fabs(neuron.get_bias().grad[0] - dy) < 1e-5f);
+        std::fill(neuron.get_weights().grad, neuron.get_weights().grad + 3, 0.0f);
+        neuron.get_bias().grad[0] = 0.0f;
+        other.clear();
+        x.clear();
+        for (int i = 0; i < 3; i++) {
+            x.push_back(Value(&other, other.push(0.5f * i - 0.3f)));
+        }
+    }
+}
+
+void test_mlp_steady_state()
+{
+    // Graph is rebuilt every step on the same tape; after the first step
+    // the tape should not need to grow anymore
+    MLP mlp(3, { 4, 4, 1 });
+    Tape& tape = Tape::current();
+    size_t mark = tape.mark();
+
+    // fixed architecture, so the backward order is sorted only once
+    Schedule schedule;
+    size_t capacity = 0;
+    for (int step = 0; step < 5; step++) {
+        std::vector<Value> inputs = { Value(1.0), Value(2.0), Value(3.0) };
+        std::span<const Value> outputs = mlp.forward(inputs);
+        Value loss = outputs[0] - 0.5f;
+        if (step > 0) {
+            assert(schedule.matches(loss.get_id(), tape));
+        }
+        loss.backward(schedule);
+        if (step == 0) {
+            capacity = tape.capacity();
+        }
+        assert(tape.capacity() == capacity);
+        tape.rewind(mark);
+    }
+}
+
+void test_batched_matches_scalar()
+{
+    // The batched path must give the same outputs and parameter gradients
+    // as building the scalar graph sample by sample
+    MLP mlp(3, { 4, 4, 2 });
+    std::vector<std::vector<float>> X = {
+        { 2.0, 3.0, -1.0 },
+        { 3.0, -1.0, 0.5 },
+        { 0.5, 1.0, 1.0 },
+        { 1.0, 1.0, -1.0 }
+    };
+    Parameters parameters = mlp.get_parameters();
+
+    // scalar: loss = sum of all outputs over the batch
+    std::vector<float> scalar_outputs;
+    for (const auto& x : X) {
+        std::vector<Value> inputs;
+        for (float xi : x) {
+            inputs.push_back(Value(xi));
+        }
+        std::span<const Value> outputs = mlp.forward(inputs);
+        Value loss = outputs[0] + outputs[1];
+        loss.backward();
+        scalar_outputs.push_back(outputs[0].get_data());
+        scalar_outputs.push_back(outputs[1].get_data());
+    }
+    std::vector<float> scalar_grads(parameters.grad, parameters.grad + parameters.size);
+    mlp.zero_grad();
+
+    // batched: dL/d(output) is 1 everywhere
+    Matrix inputs(X.size(), 3);
+    for (int r = 0; r < inputs.get_rows(); r++) {
+        for (int c = 0; c < 3; c++) {
+            inputs(r, c) = X[r][c];
+        }
+    }
+    const Matrix& outputs = mlp.forward(inputs);
+    for (int r = 0; r < outputs.get_rows(); r++) {
+        for (int c = 0; c < 2; c++) {
+            assert(std::fabs(outputs(r, c) - scalar_outputs[r * 2 + c]) < 1e-5);
+        }
+    }
+    mlp.backward(Matrix(X.size(), 2, 1.0f));
+    for (size_t i = 0; i < parameters.size; i++) {
+        assert(std::fabs(parameters.grad[i] - scalar_grads[i]) < 1e-4);
+    }
+
+    // A batch of the wrong width is refused, not read past its rows
+    auto refused = [](auto&& forward) {
+        try {
+            forward();
+        } catch (const std::invalid_argument&) {
+            return true;
+        }
+        return false;
+    };
+    Layer layer(3, 4, 1);
+    Matrix wide(4, 5), narrow(4, 2), layer_out;
+    for (const Matrix* x : { &wide, &narrow }) {
+        assert(refused([&]() { mlp.forward(*x); }));
+        assert(refused([&]() { layer.forward(*x); }));
+        assert(refused([&]() { layer.forward(*x, layer_out); }));
+    }
+    assert(refused([&]() { layer.forward(SparseMatrix(5)); }));
+    Tape::current().clear();
+}
+
+void test_train_batch()
+{
+    // train_batch over a pool gives the gradients of the single-threaded
+    // batched path, is bit-identical from run to run, and trains
+    MLP mlp(3, { 8, 8, 1 }, Init::Xavier, 1);
+    Parameters parameters = mlp.get_parameters();
+    Matrix inputs(16, 3);
+    Matrix targets(16, 1);
+    for (int r = 0; r < 16; r++) {
+        inputs(r, 0) = std::sin(r);
+        inputs(r, 1) = std::cos(r);
+        inputs(r, 2) = 0.1f * r;
+        targets(r, 0) = r % 2 ? 0.5f : -0.5f;
+    }
+
+    // reference: batched forward/backward with d/dy = 2 (y - t) / batch
+    const Matrix& outputs = mlp.forward(inputs);
+    Matrix output_grads(16, 1);
+    for (int r = 0; r < 16; r++) {
+        output_grads(r, 0) = 2.0f * (outputs(r, 0) - targets(r, 0)) / 16;
+    }
+    mlp.backward(output_grads);
+    std::vector<float> expected(parameters.grad, parameters.grad + parameters.size);
+    mlp.zero_grad();
+
+    ThreadPool pool(4);
+    mlp.train_batch(inputs, targets, pool);
+    std::vector<float> first(parameters.grad, parameters.grad + parameters.size);
+    for (size_t i = 0; i < parameters.size; i++) {
+        assert(std::fabs(first[i] - expected[i]) < 1e-5);
+    }
+    mlp.zero_grad();
+    mlp.train_batch(inputs, targets, pool);
+    for (size_t i = 0; i < parameters.size; i++) {
+        assert(parameters.grad[i] == first[i]);
+    }
+    mlp.zero_grad();
+
+    float initial_loss = mlp.train_batch(inputs, targets, pool);
+    float loss = initial_loss;
+    for (int step = 0; step < 50; step++) {
+        for (size_t i = 0; i < parameters.size; i++) {
+            parameters.data[i] -= 0.1f * parameters.grad[i];
+        }
+        mlp.zero_grad();
+        loss = mlp.train_batch(inputs, targets, pool);
+    }
+    assert(loss < initial_loss);
+
+    // Mismatched shapes are refused before any work
+    mlp.zero_grad();
+    auto refused = [&](const Matrix& x, const Matrix& y, Loss kind) {
+        try {
+            mlp.train_batch(x, y, pool, kind);
+        } catch (const std::invalid_argument&) {
+            return true;
+        }
+        return false;
+    };
+    assert(refused(inputs, Matrix(15, 1), Loss::MSE));
+    assert(refused(inputs, Matrix(16, 2), Loss::MSE));
+    assert(refused(inputs, Matrix(16, 2), Loss::SoftmaxCrossEntropy));
+    assert(refused(Matrix(16, 4), targets, Loss::MSE));
+    assert(refused(inputs, Matrix(0, 1), Loss::MSE));
+    // one output, so class 0 is the only target
+    Matrix classes(16, 1);
+    for (float bad : { -1.0f, 1.0f }) {
+        classes(3, 0) = bad;
+        assert(refused(inputs, classes, Loss::SoftmaxCrossEntropy));
+    }
+    SparseMatrix sparse(3);
+    sparse.end_row();
+    bool threw = false;
+    try {
+        mlp.train_batch(sparse, Matrix(2, 1), pool);
+    } catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    assert(threw);
+    for (size_t i = 0; i < parameters.size; i++) {
+        assert(parameters.grad[i] == 0.0f);
+    }
+    Tape::current().clear();
+}
+
+void test_optimizer_steps()
+{
+    // One step of each optimizer on a single parameter with grad 3
+    float w = 1.0f;
+    float grad = 3.0f;
+    Parameters parameters{&w, &grad, 1};
+
+    SGD sgd(parameters, 0.1);
+    sgd.step();
+    assert(std::fabs(w - 0.7f) < 1e-6);
+    assert(grad == 0.0f);
+
+    // momentum: v = 3, then v = 0.9 * 3 + 3
+    w = 1.0f;
+    SGD momentum(parameters, 0.1, 0.9);
+    grad = 3.0f;
+    momentum.step();
+    grad = 3.0f;
+    momentum.step();
+    assert(std::fabs(w - (1.0f - 0.1f * 3.0f - 0.1f * 5.7f)) < 1e-6);
+
+    // Adam's first step moves by lr in the direction of -grad
+    w = 1.0f;
+    Adam adam(parameters, 0.01);
+    grad = 3.0f;
+    adam.step();
+    assert(std::fabs(w - 0.99f) < 1e-6);
+    assert(grad == 0.0f);
+}
+
+void test_parameter_views()
+{
+    // Layers and neurons view the MLP's single parameter block
+    MLP mlp(3, { 4, 2 });
+    Parameters parameters = mlp.get_parameters();
+    assert(parameters.size == 4 * 4 + 2 * 5);
+    assert(reinterpret_cast<uintptr_t>(parameters.data) % 64 == 0);
+
+    std::span<const Layer> layers = mlp.get_layers();
+    assert(layers[0].get_parameters().data == parameters.data);
+    assert(layers[1].get_parameters().data == parameters.data + 16);
+    Neuron second = layers[1].get_neurons()[1];
+    assert(second.get_weights().data == parameters.data + 16 + 4);
+    assert(second.get_bias().data == parameters.data + 16 + 8 + 1);
+
+    // scalar backward lands in the same gradient buffer
+    std::vector<Value> inputs = { Value(1.0), Value(-1.0), Value(0.5) };
+    std::span<const Value> outputs = mlp.forward(inputs);
+    outputs[1].backward();
+    assert(second.get_bias().grad[0] != 0.0f);
+    assert(layers[1].get_neurons()[0].get_bias().grad[0] == 0.0f);
+    mlp.zero_grad();
+    for (size_t i = 0; i < parameters.size; i++) {
+        assert(parameters.grad[i] == 0.0f);
+    }
+    Tape::current().clear();
+}
+
+void test_optimizers_train()
+{
+    // Every optimizer brings the loss down on a small regression problem
+    Matrix inputs(16, 3);
+    Matrix targets(16, 1);
+    for (int r = 0; r < 16; r++) {
+        inputs(r, 0) = std::sin(r);
+        inputs(r, 1) = std::cos(r);
+        inputs(r, 2) = 0.1f * r;
+        targets(r, 0) = r % 2 ? 0.5f : -0.5f;
+    }
+    ThreadPool pool(2);
+    for (int kind = 0; kind < 3; kind++) {
+        MLP mlp(3, { 8, 8, 1 }, Init::Xavier, 1);
+        std::unique_ptr<Optimizer> optimizer;
+        if (kind == 0) {
+            optimizer.reset(new SGD(mlp.get_parameters(), 0.1));
+        } else if (kind == 1) {
+            optimizer.reset(new SGD(mlp.get_parameters(), 0.05, 0.9));
+        } else {
+            optimizer.reset(new Adam(mlp.get_parameters(), 0.01));
+        }
+        float initial_loss = mlp.train_batch(inputs, targets, pool);
+        optimizer->zero_grad();
+        float loss = initial_loss;
+        for (int step = 0; step < 100; step++) {
+            loss = mlp.train_batch(inputs, targets, pool);
+            optimizer->step();
+        }
+        assert(loss < 0.5f * initial_loss);
+    }
+    Tape::current().clear();
+}
+
+void test_forward_allocations()
+{
+    // Once the tape and the activation buffers have grown to size, neither
+    // the scalar nor the batched inference path allocates
+    MLP mlp(8, { 16, 16, 4 });
+    Tape& tape = Tape::current();
+    std::vector<Value> inputs;
+    for (int i = 0; i < 8; i++) {
+        inputs.push_back(Value(0.1f * i));
+    }
+    size_t mark = tape.mark();
+    Matrix batch(32, 8, 0.5f);
+    for (int step = 0; step < 3; step++) {
+        mlp.forward(inputs);
+        tape.rewind(mark);
+        mlp.forward(batch);
+    }
+
+    long before = n_allocations;
+    for (int step = 0; step < 10; step++) {
+        std::span<const Value> outputs = mlp.forward(inputs);
+        assert(outputs.size() == 4);
+        tape.rewind(mark);
+        const Matrix& batch_outputs = mlp.forward(batch);
+        assert(batch_outputs.get_cols() == 4);
+    }
+    assert(n_allocations == before);
+    tape.clear();
+}
+
+void test_predict()
+{
+    // predict gives the batched forward's outputs without touching the tape
+    MLP mlp(5, { 16, 8, 3 });
+    Matrix inputs(7, 5);
+    for (int r = 0; r < 7; r++) {
+        for (int c = 0; c < 5; c++) {
+            inputs(r, c) = std::sin(r * 5 + c);
+        }
+    }
+    const Matrix& expected = mlp.forward(inputs);
+
+    Tape& tape = Tape::current();
+    size_t tape_size = tape.size();
+    std::vector<float> outputs(7 * 3);
+    mlp.predict(inputs.data(), outputs.data(), 7);
+    for (int r = 0; r < 7; r++) {
+        for (int c = 0; c < 3; c++) {
+            assert(outputs[r * 3 + c] == expected(r, c));
+        }
+    }
+
+    // one sample at a time, allocation free once warm
+    float output[3];
+    mlp.predict(inputs.row(0), output);
+    long before = n_allocations;
+    for (int r = 0; r < 7; r++) {
+        mlp.predict(inputs.row(r), output);
+        for (int c = 0; c < 3; c++) {
+            assert(output[c] == expected(r, c));
+        }
+    }
+    assert(n_allocations == before);
+    assert(tape.size() == tape_size);
+}
+
+void test_checkpoint()
+{
+    MLP mlp(5, { 16, 8, 3 });
+    std::string path = "/tmp/micrograd_test_checkpoint.bin";
+    mlp.save(path);
+
+    // the loaded model runs on the mapped file, giving the same outputs
+    MLP loaded = MLP::load(path);
+    assert(loaded.n_inputs == 5);
+    assert(loaded.n_neurons_per_layer == mlp.n_neurons_per_layer);
+    Parameters parameters = mlp.get_parameters();
+    Parameters loaded_parameters = loaded.get_parameters();
+    assert(loaded_parameters.size == parameters.size);
+    assert(loaded_parameters.data != parameters.data);
+    assert(reinterpret_cast<uintptr_t>(loaded_parameters.data) % 64 == 0);
+    assert(std::memcmp(loaded_parameters.data, parameters.data, parameters.size * sizeof(float)) == 0);
+
+    float inputs[5] = { 0.1f, -0.2f, 0.3f, -0.4f, 0.5f };
+    float expected[3], outputs[3];
+    mlp.predict(inputs, expected);
+    loaded.predict(inputs, outputs);
+    for (int c = 0; c < 3; c++) {
+        assert(outputs[c] == expected[c]);
+    }
+
+    // training the loaded model leaves the file alone
+    loaded_parameters.data[0] += 1.0f;
+    MLP reloaded = MLP::load(path);
+    assert(reloaded.get_parameters().data[0] == parameters.data[0]);
+
+    // a header that does not agree with itself or with the file size is
+    // rejected before anything is read past the mapping
+    std::vector<char> saved;
+    {
+        std::FILE* in = std::fopen(path.c_str(), "rb");
+        char buffer[4096];
+        for (size_t n; (n = std::fread(buffer, 1, sizeof(buffer), in)) > 0;) {
+            saved.insert(saved.end(), buffer, buffer + n);
+        }
+        std::fclose(in);
+    }
+    auto rejected = [&](size_t offset, uint32_t value, size_t length) {
+        std::vector<char> bytes(saved.begin(), saved.begin() + length);
+        std::memcpy(bytes.data() + offset, &value, sizeof(value));
+        std::FILE* out = std::fopen(path.c_str(), "wb");
+        std::fwrite(bytes.data(), 1, bytes.size(), out);
+        std::fclose(out);
+        try {
+            MLP::load(path);
+        } catch (const std::runtime_error&) {
+            return true;
+        }
+        return false;
+    };
+    // header: magic, version, n_inputs at 12, n_layers at 16, float size,
+    // n_parameters at 24, data offset, then the layer sizes from 40
+    size_t n_parameters = parameters.size;
+    assert(!rejected(12, 5, saved.size()));
+    assert(rejected(12, 0, saved.size()));
+    assert(rejected(12, 6, saved.size()));
+    assert(rejected(12, 0x80000000u, saved.size()));
+    assert(rejected(16, 1u << 30, saved.size()));
+    assert(rejected(24, n_parameters + 1, saved.size()));
+    assert(rejected(40, 0, saved.size()));
+    assert(rejected(44, 0xffffffffu, saved.size()));
+    assert(rejected(40, 17, saved.size()));
+    assert(rejected(12, 5, saved.size() - sizeof(float)));
+
+    // anything that is not a checkpoint is rejected
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    std::fputs("definitely not a checkpoint, just some text", file);
+    std::fclose(file);
+    bool thrown = false;
+    try {
+        MLP::load(path);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+    std::remove(path.c_str());
+}
+
+void test_optimized_mlp_program()
+{
+    // The scalar MLP graph optimizes down to one DotTanh per neuron, with
+    // the weights and activations as contiguous runs
+    MLP mlp(4, { 8, 3 });
+    Tape& tape = Tape::current();
+    size_t mark = tape.mark();
+    std::vector<Value> x;
+    for (int i = 0; i < 4; i++) {
+        x.push_back(Value(0.25f * i - 0.4f));
+    }
+    std::span<const Value> outputs = mlp.forward(x);
+    Value root = outputs[0] + outputs[1] + outputs[2];
+    Program program = Program::compile(root, x);
+    program.optimize();
+
+    int n_dots = 0;
+    for (const Instruction& in : program.get_instructions()) {
+        if (in.op == Op::DotTanh) {
+            n_dots++;
+            assert(in.contiguous);
+        }
+    }
+    assert(n_dots == 8 + 3);
+
+    float data[4] = { 0.5f, -0.1f, 0.9f, 0.0f };
+    float expected[3];
+    mlp.predict(data, expected);
+    assert(std::fabs(program.forward(data) - (expected[0] + expected[1] + expected[2])) < 1e-5);
+    tape.rewind(mark);
+}
+
+void test_gradient_checkpointing()
+{
+    // Checkpointing gives the same gradients with less activation memory;
+    // reports both, with the step time, for a deep and wide network
+    const int depth = 16, width = 256, batch = 64;
+    MLP mlp(width, std::vector<int>(depth, width));
+    Matrix inputs(batch, width);
+    Matrix output_grads(batch, width);
+    for (int r = 0; r < batch; r++) {
+        for (int c = 0; c < width; c++) {
+            inputs(r, c) = std::sin(r + 0.1f * c);
+            output_grads(r, c) = std::cos(r - 0.2f * c) / batch;
+        }
+    }
+    Parameters parameters = mlp.get_parameters();
+    std::vector<float> expected;
+
+    for (int k : { 1, 4 }) {
+        mlp.set_checkpoint_every(k);
+        auto start = std::chrono::steady_clock::now();
+        const int steps = 3;
+        for (int step = 0; step < steps; step++) {
+            mlp.zero_grad();
+            mlp.forward(inputs);
+            mlp.backward(output_grads);
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "checkpoint every " << k << ": " << mlp.get_activation_bytes() / 1024 << " KiB activations, "
+                  << ms / steps << " ms/step" << std::endl;
+
+        std::vector<float> grads(parameters.grad, parameters.grad + parameters.size);
+        if (k == 1) {
+            expected = grads;
+            assert(mlp.get_activation_bytes() >= (depth + 2) * sizeof(float) * batch * width);
+        } else {
+            // 4 checkpoints and 3 segment buffers instead of 16 outputs
+            assert(grads == expected);
+            assert(mlp.get_activation_bytes() <= (4 + 3 + 2) * sizeof(float) * batch * width);
+        }
+    }
+}
+
 // void test_layer()
 // {
 //     // Create a layer with 2 inputs and 3 neurons
@@ -82,7 +648,7 @@ void test_single_neuron()
 //     std::vector<Value> inputs = { x1, x2, x3 };
 
 //     // Compute the output of the MLP
-//     std::vector<Value> outputs = mlp.forward(inputs);
+//     std::span<const Value> outputs = mlp.forward(inputs);
 
 //     // Print the output
 //     std::cout << "y = " << outputs[0].to_string() << std::endl;
@@ -136,9 +702,342 @@ void test_single_neuron()
 //     }
 // }
 
+void test_precision()
+{
+    // One long layer against a double reference. Alternating weights make
+    // the partial sums large and the result small: Mixed only rounds the
+    // sum once, Single at every step
+    int n = 100000;
+    MLP mlp(n, { 2 });
+    std::vector<float> x(n);
+    Parameters parameters = mlp.get_parameters();
+    for (int i = 0; i < n; i++) {
+        x[i] = 1.0f + 1e-3f * std::sin(0.1f * i);
+        parameters.data[i] = i % 2 ? 0.5f : -0.5f;
+        parameters.data[n + i] = i % 2 ? -0.25f : 0.25f;
+    }
+    double reference[2];
+    for (int j = 0; j < 2; j++) {
+        double sum = parameters.data[2 * n + j];
+        for (int i = 0; i < n; i++) {
+            sum += static_cast<double>(x[i]) * parameters.data[static_cast<size_t>(j) * n + i];
+        }
+        reference[j] = std::tanh(sum);
+    }
+    float single[2], mixed[2];
+    mlp.predict(x.data(), single);
+    mlp.set_precision(Precision::Mixed);
+    mlp.predict(x.data(), mixed);
+    double single_error = 0.0, mixed_error = 0.0;
+    for (int j = 0; j < 2; j++) {
+        single_error = std::max(single_error, std::fabs(single[j] - reference[j]));
+        mixed_error = std::max(mixed_error, std::fabs(mixed[j] - reference[j]));
+    }
+    std::cout << "predict error over " << n << " inputs, single " << single_error << ", mixed " << mixed_error
+              << std::endl;
+    assert(mixed_error < 2e-6);
+    assert(mixed_error < single_error);
+
+    // Mixed training agrees with Single and the forward matches predict
+    MLP a(6, { 8, 3 });
+    MLP b(6, { 8, 3 });
+    std::copy(a.get_parameters().data, a.get_parameters().data + a.get_parameters().size, b.get_parameters().data);
+    b.set_precision(Precision::Mixed);
+    Matrix inputs(16, 6), targets(16, 3);
+    for (int r = 0; r < 16; r++) {
+        for (int c = 0; c < 6; c++) {
+            inputs(r, c) = std::cos(r * 6 + c);
+        }
+        for (int c = 0; c < 3; c++) {
+            targets(r, c) = std::sin(r + c);
+        }
+    }
+    ThreadPool pool(2);
+    a.zero_grad();
+    b.zero_grad();
+    float loss_a = a.train_batch(inputs, targets, pool);
+    float loss_b = b.train_batch(inputs, targets, pool);
+    assert(std::fabs(loss_a - loss_b) < 1e-5f);
+    for (size_t i = 0; i < a.get_parameters().size; i++) {
+        assert(std::fabs(a.get_parameters().grad[i] - b.get_parameters().grad[i]) < 1e-5f);
+    }
+    const Matrix& outputs = b.forward(inputs);
+    std::vector<float> predicted(16 * 3);
+    b.predict(inputs.data(), predicted.data(), 16);
+    for (int r = 0; r < 16; r++) {
+        for (int c = 0; c < 3; c++) {
+            assert(predicted[r * 3 + c] == outputs(r, c));
+        }
+    }
+
+    // 16-bit inference weights stay close to float32 and can be switched back
+    std::vector<float> f32(16 * 3), f16(16 * 3), bf16(16 * 3);
+    a.predict(inputs.data(), f32.data(), 16);
+    a.set_weight_format(WeightFormat::F16);
+    a.predict(inputs.data(), f16.data(), 16);
+    a.set_weight_format(WeightFormat::BF16);
+    a.predict(inputs.data(), bf16.data(), 16);
+    for (int i = 0; i < 16 * 3; i++) {
+        assert(std::fabs(f16[i] - f32[i]) < 2e-3f);
+        assert(std::fabs(bf16[i] - f32[i]) < 2e-2f);
+    }
+    a.set_weight_format(WeightFormat::F32);
+    a.predict(inputs.data(), f16.data(), 16);
+    assert(f16 == f32);
+}
+
+void test_initialize()
+{
+    // Same seed, same bits: through the constructor, initialize and the pool
+    std::vector<int> sizes = { 300, 200, 10 };
+    MLP a(100, sizes, Init::Xavier, 42);
+    MLP b(100, sizes, Init::Xavier, 42);
+    Parameters pa = a.get_parameters(), pb = b.get_parameters();
+    assert(std::memcmp(pa.data, pb.data, pa.size * sizeof(float)) == 0);
+    for (int n_threads : { 1, 2, 3, 8 }) {
+        ThreadPool pool(n_threads);
+        b.initialize(Init::Uniform, 7, pool);
+        a.initialize(Init::Uniform, 7);
+        assert(std::memcmp(pa.data, pb.data, pa.size * sizeof(float)) == 0);
+        b.initialize(Init::Xavier, 42, pool);
+    }
+    MLP c(100, sizes, Init::Xavier, 43);
+    size_t n_equal = 0;
+    for (size_t i = 0; i < pa.size; i++) {
+        n_equal += c.get_parameters().data[i] == pb.data[i];
+    }
+    assert(n_equal < pa.size / 100);
+
+    // The constructors without a seed take distinct seeds from a per-thread
+    // stream: parts built apart differ, and a fresh thread building the same
+    // objects in the same order gets the same weights
+    auto build = [&](std::vector<float>& weights) {
+        std::thread([&]() {
+            MLP d(100, sizes), e(100, sizes);
+            MLP f(100, sizes, Init::Uniform, default_seed);
+            assert(std::memcmp(d.get_parameters().data, f.get_parameters().data, pa.size * sizeof(float)) == 0);
+            assert(std::memcmp(d.get_parameters().data, e.get_parameters().data, pa.size * sizeof(float)) != 0);
+            Layer la(5, 3), lb(5, 3);
+            assert(std::memcmp(la.get_parameters().data, lb.get_parameters().data, 18 * sizeof(float)) != 0);
+            Neuron na(4), nb(4);
+            assert(std::memcmp(na.get_weights().data, nb.get_weights().data, 4 * sizeof(float)) != 0);
+            for (Parameters p : { e.get_parameters(), la.get_parameters(), lb.get_parameters(), na.get_weights(),
+                                  nb.get_bias() }) {
+                weights.insert(weights.end(), p.data, p.data + p.size);
+            }
+        }).join();
+    };
+    std::vector<float> first, second;
+    build(first);
+    build(second);
+    assert(first == second);
+
+    // Bounds per scheme, zero biases for Xavier and He
+    for (Init scheme : { Init::Uniform, Init::Xavier, Init::He }) {
+        a.initialize(scheme, 1);
+        size_t offset = 0;
+        for (const Layer& layer : a.get_layers()) {
+            float bound = 1.0f;
+            if (scheme == Init::Xavier) {
+                bound = std::sqrt(6.0f / (layer.n_inputs + layer.n_neurons));
+            } else if (scheme == Init::He) {
+                bound = std::sqrt(6.0f / layer.n_inputs);
+            }
+            size_t n_weights = static_cast<size_t>(layer.n_inputs) * layer.n_neurons;
+            float lo = bound, hi = -bound;
+            for (size_t i = 0; i < n_weights; i++) {
+                float w = pa.data[offset + i];
+                assert(w >= -bound && w < bound);
+                lo = std::min(lo, w);
+                hi = std::max(hi, w);
+            }
+            // and the range is actually used
+            assert(lo < -0.9f * bound && hi > 0.9f * bound);
+            for (int j = 0; j < layer.n_neurons; j++) {
+                float bias = pa.data[offset + n_weights + j];
+                assert(scheme == Init::Uniform ? bias >= -1.0f && bias < 1.0f : bias == 0.0f);
+            }
+            offset += n_weights + layer.n_neurons;
+        }
+    }
+
+    // A split range draws the same numbers as a whole one
+    std::vector<float> whole(1000), split(1000);
+    fill_uniform(whole.data(), 1000, 0.5f, 9);
+    fill_uniform(split.data(), 333, 0.5f, 9);
+    fill_uniform(split.data() + 333, 667, 0.5f, 9, 333);
+    assert(whole == split);
+}
+
+void test_sparse_inputs()
+{
+    // 40 inputs, about one in eight nonzero, the same batch dense and sparse
+    int n_inputs = 40, batch = 9;
+    Matrix dense(batch, n_inputs);
+    for (int r = 0; r < batch; r++) {
+        for (int c = 0; c < n_inputs; c++) {
+            if ((r * 7 + c * 3) % 8 == 0 && c != 5) {
+                dense(r, c) = std::sin(r + 0.3f * c);
+            }
+        }
+    }
+    SparseMatrix sparse = SparseMatrix::from_dense(dense);
+    assert(sparse.get_rows() == batch && sparse.nnz() < static_cast<size_t>(batch * n_inputs / 4));
+    bool threw = false;
+    try {
+        SparseMatrix bad(4);
+        bad.add(2, 1.0f);
+        bad.add(1, 1.0f);
+    } catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    assert(threw);
+
+    // Batched forward / backward agree with the dense path; untouched
+    // columns get no gradient
+    MLP mlp(n_inputs, { 6, 3 }, Init::Xavier, 8);
+    Parameters parameters = mlp.get_parameters();
+    Matrix dense_outputs = mlp.forward(dense);
+    mlp.backward(Matrix(batch, 3, 1.0f));
+    std::vector<float> dense_grads(parameters.grad, parameters.grad + parameters.size);
+    mlp.zero_grad();
+    for (int k : { 1, 2 }) {
+        mlp.set_checkpoint_every(k);
+        const Matrix& outputs = mlp.forward(sparse);
+        for (int r = 0; r < batch; r++) {
+            for (int c = 0; c < 3; c++) {
+                assert(std::fabs(outputs(r, c) - dense_outputs(r, c)) < 1e-5f);
+            }
+        }
+        mlp.backward(Matrix(batch, 3, 1.0f));
+        for (size_t i = 0; i < parameters.size; i++) {
+            assert(std::fabs(parameters.grad[i] - dense_grads[i]) < 1e-5f);
+        }
+        const SparseGrad& touched = mlp.get_sparse_grad();
+        assert(touched.rows == 6 && touched.row_length == n_inputs);
+        assert(std::find(touched.columns.begin(), touched.columns.end(), 5) == touched.columns.end());
+        for (int j = 0; j < 6; j++) {
+            assert(parameters.grad[j * n_inputs + 5] == 0.0f);
+        }
+        mlp.zero_grad();
+    }
+    mlp.set_checkpoint_every(1);
+
+    // train_batch, also alternating with dense batches on the same workers
+    Matrix targets(batch, 3, 0.25f);
+    ThreadPool pool(3);
+    for (int round = 0; round < 2; round++) {
+        float dense_loss = mlp.train_batch(dense, targets, pool);
+        std::vector<float> expected(parameters.grad, parameters.grad + parameters.size);
+        mlp.zero_grad();
+        float sparse_loss = mlp.train_batch(sparse, targets, pool);
+        assert(std::fabs(sparse_loss - dense_loss) < 1e-5f);
+        for (size_t i = 0; i < parameters.size; i++) {
+            assert(std::fabs(parameters.grad[i] - expected[i]) < 1e-5f);
+        }
+        mlp.zero_grad();
+    }
+
+    // A sparse SGD step is the dense step; both leave the grads at zero
+    MLP a(n_inputs, { 6, 3 }, Init::Xavier, 8), b(n_inputs, { 6, 3 }, Init::Xavier, 8);
+    SGD sgd_a(a.get_parameters(), 0.1), sgd_b(b.get_parameters(), 0.1);
+    for (int step = 0; step < 3; step++) {
+        a.train_batch(sparse, targets, pool);
+        b.train_batch(sparse, targets, pool);
+        sgd_a.step();
+        sgd_b.step(b.get_sparse_grad());
+    }
+    Parameters pa = a.get_parameters(), pb = b.get_parameters();
+    assert(std::memcmp(pa.data, pb.data, pa.size * sizeof(float)) == 0);
+    for (size_t i = 0; i < pb.size; i++) {
+        assert(pb.grad[i] == 0.0f);
+    }
+    // Sparse Adam leaves untouched weights alone
+    float untouched = pb.data[5];
+    Adam adam(pb, 0.01);
+    b.train_batch(sparse, targets, pool);
+    adam.step(b.get_sparse_grad());
+    assert(pb.data[5] == untouched && pb.data[0] != pa.data[0]);
+
+    // A dense batch after a sparse one makes the pattern dense again, so the
+    // sparse step reaches the columns the sparse batch did not touch
+    Matrix full(batch, n_inputs);
+    for (int r = 0; r < batch; r++) {
+        for (int c = 0; c < n_inputs; c++) {
+            full(r, c) = std::cos(r + 0.2f * c);
+        }
+    }
+    MLP c(n_inputs, { 6, 3 }, Init::Xavier, 8), d(n_inputs, { 6, 3 }, Init::Xavier, 8);
+    SGD sgd_c(c.get_parameters(), 0.1), sgd_d(d.get_parameters(), 0.1);
+    for (bool dense_batch : { false, true }) {
+        if (dense_batch) {
+            c.train_batch(full, targets, pool);
+            d.train_batch(full, targets, pool);
+            assert(d.get_sparse_grad().rows == 0 && d.get_sparse_grad().columns.empty());
+        } else {
+            c.train_batch(sparse, targets, pool);
+            d.train_batch(sparse, targets, pool);
+        }
+        sgd_c.step();
+        sgd_d.step(d.get_sparse_grad());
+    }
+    Parameters pc = c.get_parameters(), pd = d.get_parameters();
+    assert(std::memcmp(pc.data, pd.data, pc.size * sizeof(float)) == 0);
+    for (size_t i = 0; i < pd.size; i++) {
+        assert(pd.grad[i] == 0.0f);
+    }
+    d.forward(sparse);
+    assert(d.get_sparse_grad().rows == 6);
+    d.forward(full);
+    assert(d.get_sparse_grad().rows == 0);
+    d.zero_grad();
+
+    // Scalar path: one multiply-add per nonzero in the first layer
+    Tape& tape = Tape::current();
+    size_t mark = tape.mark();
+    std::vector<Value> values;
+    std::vector<int32_t> indices;
+    std::vector<Value> inputs;
+    for (int c = 0; c < n_inputs; c++) {
+        inputs.push_back(Value(dense(0, c)));
+        if (dense(0, c) != 0.0f) {
+            values.push_back(Value(dense(0, c)));
+            indices.push_back(c);
+        }
+    }
+    size_t before = tape.size();
+    std::span<const Value> sparse_out = mlp.forward(values, indices);
+    size_t sparse_nodes = tape.size() - before;
+    std::vector<float> sparse_values = { sparse_out[0].get_data(), sparse_out[1].get_data(), sparse_out[2].get_data() };
+    before = tape.size();
+    std::span<const Value> dense_out = mlp.forward(inputs);
+    size_t dense_nodes = tape.size() - before;
+    for (int c = 0; c < 3; c++) {
+        assert(std::fabs(sparse_values[c] - dense_out[c].get_data()) < 1e-5f);
+    }
+    assert(sparse_nodes < dense_nodes / 2);
+    tape.rewind(mark);
+}
+
 int main()
 {
     test_single_neuron();
+    test_destroyed_model_bindings();
+    test_neuron_on_other_tape();
+    test_mlp_steady_state();
+    test_batched_matches_scalar();
+    test_train_batch();
+    test_optimizer_steps();
+    test_optimizers_train();
+    test_parameter_views();
+    test_forward_allocations();
+    test_predict();
+    test_checkpoint();
+    test_optimized_mlp_program();
+    test_gradient_checkpointing();
+    test_precision();
+    test_initialize();
+    test_sparse_inputs();
     // test_layer();
     // test_MLP();
     // test_neural_network();
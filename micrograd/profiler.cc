@@ -0,0 +1,172 @@
+// Implementations from profiler.h
+
+#include "profiler.h"
+
+#include <fstream>
+#include <stdexcept>
+
+const char* phase_name(Phase phase)
+{
+    static const char* names[] = { "forward", "sort", "backward" };
+    static_assert(sizeof(names) / sizeof(names[0]) == static_cast<size_t>(Phase::Count),
+                  "every phase needs a name");
+    return names[static_cast<size_t>(phase)];
+}
+
+// Ops are listed by name in the output; the unnamed ones get their own
+static const char* op_key(Op op)
+{
+    switch (op) {
+    case Op::Leaf: return "leaf";
+    case Op::Const: return "const";
+    case Op::Neg: return "neg";
+    default: return op_name(op);
+    }
+}
+
+Profiler& Profiler::current()
+{
+    thread_local Profiler profiler;
+    return profiler;
+}
+
+void Profiler::enable(bool on)
+{
+    if (on && !enabled) {
+        step = Step{};
+        step.start_ns = now_ns();
+    }
+    enabled = on;
+}
+
+uint64_t Profiler::now_ns() const
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+void Profiler::end_step()
+{
+    step.end_ns = now_ns();
+    steps.push_back(step);
+    step = Step{};
+    step.start_ns = steps.back().end_ns;
+}
+
+void Profiler::reset()
+{
+    steps.clear();
+    spans.clear();
+    n_spans = 0;
+    step = Step{};
+    step.start_ns = now_ns();
+}
+
+void Profiler::add_backward(Op op, uint64_t ns)
+{
+    step.backward_ns[static_cast<size_t>(op)] += ns;
+    step.backward_calls[static_cast<size_t>(op)]++;
+}
+
+void Profiler::add_phase(Phase phase, uint64_t start_ns, uint64_t end_ns)
+{
+    step.phase_ns[static_cast<size_t>(phase)] += end_ns - start_ns;
+    Span span{phase, start_ns, end_ns};
+    if (spans.size() < max_spans) {
+        spans.push_back(span);
+    } else {
+        spans[n_spans % max_spans] = span;
+    }
+    n_spans++;
+}
+
+void Profiler::sample_graph_bytes(size_t bytes)
+{
+    step.graph_bytes = std::max(step.graph_bytes, bytes);
+}
+
+// Output
+void Profiler::write_summary(std::ostream& out) const
+{
+    out << "{\"steps\":[";
+    for (size_t s = 0; s < steps.size(); s++) {
+        const Step& st = steps[s];
+        out << (s ? ",\n" : "\n") << "{\"duration_ns\":" << st.end_ns - st.start_ns << ",\"nodes\":{";
+        const char* separator = "";
+        for (size_t op = 0; op < static_cast<size_t>(Op::Count); op++) {
+            if (st.nodes[op]) {
+                out << separator << "\"" << op_key(static_cast<Op>(op)) << "\":" << st.nodes[op];
+                separator = ",";
+            }
+        }
+        out << "},\"backward_ns\":{";
+        separator = "";
+        for (size_t op = 0; op < static_cast<size_t>(Op::Count); op++) {
+            if (st.backward_calls[op]) {
+                out << separator << "\"" << op_key(static_cast<Op>(op)) << "\":" << st.backward_ns[op];
+                separator = ",";
+            }
+        }
+        out << "},\"phase_ns\":{";
+        for (size_t p = 0; p < static_cast<size_t>(Phase::Count); p++) {
+            out << (p ? "," : "") << "\"" << phase_name(static_cast<Phase>(p)) << "\":" << st.phase_ns[p];
+        }
+        out << "},\"graph_bytes\":" << st.graph_bytes << "}";
+    }
+    out << "\n]}\n";
+}
+
+void Profiler::write_chrome_trace(std::ostream& out) const
+{
+    // Times in the trace format are microseconds
+    auto us = [](uint64_t ns) { return static_cast<double>(ns) / 1e3; };
+    out << "{\"traceEvents\":[";
+    const char* separator = "\n";
+    for (size_t s = 0; s < steps.size(); s++) {
+        const Step& st = steps[s];
+        out << separator << "{\"name\":\"step " << s << "\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":"
+            << us(st.start_ns) << ",\"dur\":" << us(st.end_ns - st.start_ns) << ",\"args\":{";
+        const char* inner = "";
+        for (size_t op = 0; op < static_cast<size_t>(Op::Count); op++) {
+            if (st.backward_calls[op]) {
+                out << inner << "\"backward " << op_key(static_cast<Op>(op)) << " us\":" << us(st.backward_ns[op]);
+                inner = ",";
+            }
+        }
+        out << "}}";
+        separator = ",\n";
+
+        uint64_t n_nodes = 0;
+        for (uint64_t n : st.nodes) {
+            n_nodes += n;
+        }
+        out << separator << "{\"name\":\"graph\",\"ph\":\"C\",\"pid\":0,\"ts\":" << us(st.start_ns)
+            << ",\"args\":{\"nodes\":" << n_nodes << ",\"bytes\":" << st.graph_bytes << "}}";
+    }
+    // oldest first; once the ring is full that is the one after the newest
+    size_t oldest = n_spans > max_spans ? n_spans % max_spans : 0;
+    for (size_t i = 0; i < spans.size(); i++) {
+        const Span& span = spans[(oldest + i) % spans.size()];
+        out << separator << "{\"name\":\"" << phase_name(span.phase) << "\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":"
+            << us(span.start_ns) << ",\"dur\":" << us(span.end_ns - span.start_ns) << "}";
+        separator = ",\n";
+    }
+    out << "\n]}\n";
+}
+
+void Profiler::write_summary(const std::string& path) const
+{
+    std::ofstream file(path);
+    if (!file) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    write_summary(file);
+}
+
+void Profiler::write_chrome_trace(const std::string& path) const
+{
+    std::ofstream file(path);
+    if (!file) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    write_chrome_trace(file);
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+// Step profiler for the engine. When built with MICROGRAD_PROFILE defined it
+// can be switched on at runtime per thread and then records, for every
+// training step:
+//  - nodes created per op
+//  - time spent in the forward, topological sort and backward phases
+//  - time spent in the backward kernel of each op
+//  - bytes held by the tape's arrays
+// Steps are written as a JSON summary or as a Chrome trace (chrome://tracing
+// or ui.perfetto.dev). Without MICROGRAD_PROFILE the MICROGRAD_PROFILE_*
+// macros expand to nothing and the hot paths carry no trace of it.
+
+#include "engine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+enum class Phase : uint8_t { Forward, Sort, Backward, Count };
+
+const char* phase_name(Phase phase);
+
+class Profiler
+{
+public:
+    struct Step {
+        uint64_t start_ns = 0;
+        uint64_t end_ns = 0;
+        uint64_t nodes[static_cast<size_t>(Op::Count)] = {};
+        uint64_t backward_ns[static_cast<size_t>(Op::Count)] = {};
+        uint64_t backward_calls[static_cast<size_t>(Op::Count)] = {};
+        uint64_t phase_ns[static_cast<size_t>(Phase::Count)] = {};
+        size_t graph_bytes = 0;
+    };
+
+private:
+    bool enabled = false;
+    Step step;
+    std::vector<Step> steps;
+    // phase intervals for the trace, a ring of the last max_spans: phase,
+    // start, end; n_spans counts every one recorded since the reset
+    struct Span { Phase phase; uint64_t start_ns; uint64_t end_ns; };
+    std::vector<Span> spans;
+    size_t n_spans = 0;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+
+public:
+    // Phase intervals the trace keeps; older ones are dropped, their times
+    // stay in the steps
+    static constexpr size_t max_spans = 1 << 16;
+
+    // Profiler of this thread, like Tape::current()
+    static Profiler& current();
+
+    void enable(bool on = true);
+    bool is_enabled() const { return enabled; }
+
+    // Close the current step and start the next one
+    void end_step();
+    // Drop every recorded step
+    void reset();
+
+    // Nanoseconds since the profiler was created
+    uint64_t now_ns() const;
+
+    // Recording, called through the MICROGRAD_PROFILE_* macros
+    void count_node(Op op, uint64_t n = 1) { step.nodes[static_cast<size_t>(op)] += n; }
+    void add_backward(Op op, uint64_t ns);
+    void add_phase(Phase phase, uint64_t start_ns, uint64_t end_ns);
+    void sample_graph_bytes(size_t bytes);
+
+    std::span<const Step> get_steps() const { return steps; }
+
+    // {"steps": [{"nodes": {op: count}, "backward_ns": {op: ns}, "phase_ns":
+    // {phase: ns}, "graph_bytes": n}, ...]} over the closed steps
+    void write_summary(std::ostream& out) const;
+    // Chrome trace events: one span per step and per phase (the last
+    // max_spans), per-op backward times as step arguments, and counters for
+    // nodes and graph bytes
+    void write_chrome_trace(std::ostream& out) const;
+    // Same to files; std::runtime_error if a file cannot be written
+    void write_summary(const std::string& path) const;
+    void write_chrome_trace(const std::string& path) const;
+};
+
+// Times the enclosing scope as a phase when the profiler is enabled
+class PhaseTimer
+{
+private:
+    Profiler* profiler;
+    Phase phase;
+    uint64_t start_ns;
+
+public:
+    explicit PhaseTimer(Phase phase)
+        : profiler(Profiler::current().is_enabled() ? &Profiler::current() : nullptr), phase(phase),
+          start_ns(profiler ? profiler->now_ns() : 0) {}
+    ~PhaseTimer()
+    {
+        if (profiler) {
+            profiler->add_phase(phase, start_ns, profiler->now_ns());
+        }
+    }
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+};
+
+#ifdef MICROGRAD_PROFILE
+#define MICROGRAD_PROFILE_PHASE(phase) PhaseTimer micrograd_phase_timer(phase)
+#define MICROGRAD_PROFILE_NODE(op)                          \
+    do {                                                    \
+        Profiler& micrograd_profiler = Profiler::current(); \
+        if (micrograd_profiler.is_enabled()) {              \
+            micrograd_profiler.count_node(op);              \
+        }                                                   \
+    } while (0)
+#define MICROGRAD_PROFILE_NODES(op, n)                      \
+    do {                                                    \
+        Profiler& micrograd_profiler = Profiler::current(); \
+        if (micrograd_profiler.is_enabled()) {              \
+            micrograd_profiler.count_node(op, n);           \
+        }                                                   \
+    } while (0)
+#define MICROGRAD_PROFILE_ENABLED() Profiler::current().is_enabled()
+#else
+#define MICROGRAD_PROFILE_PHASE(phase) do {} while (0)
+#define MICROGRAD_PROFILE_NODE(op) do {} while (0)
+#define MICROGRAD_PROFILE_NODES(op, n) do {} while (0)
+#define MICROGRAD_PROFILE_ENABLED() false
+#endif
@@ -0,0 +1,106 @@
+// Testing micrograd/profiler.h implementation
+//
+#include <assert.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "nn.h"
+#include "profiler.h"
+
+void test_disabled_records_nothing()
+{
+    Profiler& profiler = Profiler::current();
+    profiler.reset();
+    Value y = (Value(1.0f) * Value(2.0f)).tanh();
+    y.backward();
+    profiler.end_step();
+    const Profiler::Step& step = profiler.get_steps().back();
+    for (uint64_t n : step.nodes) {
+        assert(n == 0);
+    }
+    for (uint64_t ns : step.phase_ns) {
+        assert(ns == 0);
+    }
+    Tape::current().clear();
+}
+
+void test_step_counts()
+{
+    // Nodes per op, phases and per-op backward time of two steps
+    Profiler& profiler = Profiler::current();
+    profiler.reset();
+    profiler.enable();
+    MLP mlp(3, { 4, 1 });
+    Tape& tape = Tape::current();
+    size_t mark = tape.mark();
+    std::vector<Value> x = { Value(0.5f), Value(-1.0f), Value(2.0f) };
+    profiler.end_step();
+    for (int s = 0; s < 2; s++) {
+        std::span<const Value> outputs = mlp.forward(x);
+        outputs[0].backward();
+        tape.rewind(mark);
+        profiler.end_step();
+    }
+    profiler.enable(false);
+
+    assert(profiler.get_steps().size() == 3);
+    const Profiler::Step& step = profiler.get_steps()[1];
+    // 5 neurons: 3 + 4 multiply-adds, one tanh each
+    assert(step.nodes[static_cast<size_t>(Op::Tanh)] == 5);
+    assert(step.nodes[static_cast<size_t>(Op::Mul)] == 3 * 4 + 4);
+    // the 21 parameters bound on the tape; each neuron's sum starts from a constant
+    assert(step.nodes[static_cast<size_t>(Op::Leaf)] == 21);
+    assert(step.nodes[static_cast<size_t>(Op::Const)] == 5);
+    assert(step.backward_calls[static_cast<size_t>(Op::Tanh)] == 5);
+    assert(step.phase_ns[static_cast<size_t>(Phase::Forward)] > 0);
+    assert(step.phase_ns[static_cast<size_t>(Phase::Sort)] > 0);
+    assert(step.phase_ns[static_cast<size_t>(Phase::Backward)] > 0);
+    assert(step.graph_bytes >= tape.size() * sizeof(Node));
+    assert(step.end_ns >= step.start_ns);
+
+    std::ostringstream summary;
+    profiler.write_summary(summary);
+    assert(summary.str().find("\"tanh\":5") != std::string::npos);
+    std::ostringstream trace;
+    profiler.write_chrome_trace(trace);
+    assert(trace.str().rfind("{\"traceEvents\":[", 0) == 0);
+    assert(trace.str().find("\"name\":\"backward\",\"ph\":\"X\"") != std::string::npos);
+    assert(trace.str().find("\"name\":\"step 2\"") != std::string::npos);
+    profiler.reset();
+    tape.clear();
+}
+
+void test_span_ring()
+{
+    // The trace keeps the last max_spans phase intervals; the step keeps the
+    // time of every one
+    Profiler& profiler = Profiler::current();
+    profiler.reset();
+    size_t n = Profiler::max_spans + 10;
+    for (size_t i = 0; i < n; i++) {
+        profiler.add_phase(Phase::Sort, i, i + 1);
+    }
+    profiler.end_step();
+    assert(profiler.get_steps().back().phase_ns[static_cast<size_t>(Phase::Sort)] == n);
+
+    std::ostringstream trace;
+    profiler.write_chrome_trace(trace);
+    std::string text = trace.str();
+    const std::string sort = "{\"name\":\"sort\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":";
+    size_t count = 0;
+    for (size_t at = text.find(sort); at != std::string::npos; at = text.find(sort, at + 1)) {
+        count++;
+    }
+    assert(count == Profiler::max_spans);
+    // oldest kept first: the span that started at 10 ns
+    assert(text.compare(text.find(sort) + sort.size(), 5, "0.01,") == 0);
+    profiler.reset();
+}
+
+int main()
+{
+    test_disabled_records_nothing();
+    test_step_counts();
+    test_span_ring();
+}
@@ -0,0 +1,609 @@
+// Implementations from program.h
+//
+
+#include "program.h"
+#include "kernels.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_map>
+
+
+// Value of a two-input (or unary) instruction
+static float apply(Op op, float a, float b)
+{
+    switch (op) {
+    case Op::Add: return a + b;
+    case Op::Sub: return a - b;
+    case Op::Mul: return a * b;
+    case Op::Div: return a / b;
+    case Op::Neg: return -a;
+    case Op::Pow: return std::pow(a, b);
+    case Op::Exp: return std::exp(a);
+    case Op::Log: return std::log(a);
+    case Op::Tanh: return std::tanh(a);
+    case Op::Relu: return std::max(a, 0.0f);
+    case Op::Sigmoid: return logistic(a);
+    default: return 0.0f;
+    }
+}
+
+// Number of operands of an instruction that are registers
+static uint32_t register_operands(const Instruction& in)
+{
+    switch (in.op) {
+    case Op::Dot:
+    case Op::DotTanh: return 2 * in.count;
+    default: return op_is_nary(in.op) ? in.count : 0;
+    }
+}
+
+// Operands stored for an instruction, registers and others
+static uint32_t stored_operands(const Instruction& in)
+{
+    return op_is_nary(in.op) ? in.count + 1 : register_operands(in);
+}
+
+static uint32_t float_bits(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+// Compile
+Program Program::compile(const Value& root, std::span<const Value> inputs)
+{
+    Tape& tape = *root.get_tape();
+    std::vector<uint32_t> order;
+    tape.topological_sort(root.get_id(), order);
+
+    Program program;
+    std::vector<uint32_t> slots(tape.size(), Tape::npos);
+    auto assign = [&](uint32_t id) {
+        slots[id] = static_cast<uint32_t>(program.node_ids.size());
+        program.node_ids.push_back(id);
+        program.values.push_back(tape[id].data);
+        program.constant.push_back(tape[id].op == Op::Const);
+    };
+    auto is_leaf = [&](uint32_t id) { return tape[id].op == Op::Leaf || tape[id].op == Op::Const; };
+
+    // Registers: inputs, other leaves in tape order (so parameter blocks bound
+    // together stay together), then computed nodes in topological order
+    for (const Value& input : inputs) {
+        uint32_t id = input.get_id();
+        if (tape[id].op != Op::Leaf || slots[id] != Tape::npos) {
+            throw std::invalid_argument("program inputs must be distinct leaves");
+        }
+        assign(id);
+    }
+    program.n_inputs = inputs.size();
+    std::vector<uint32_t> leaves;
+    for (uint32_t id : order) {
+        if (is_leaf(id) && slots[id] == Tape::npos) {
+            leaves.push_back(id);
+        }
+    }
+    std::sort(leaves.begin(), leaves.end());
+    for (uint32_t id : leaves) {
+        assign(id);
+    }
+    program.n_leaves = program.node_ids.size();
+
+    for (uint32_t id : order) {
+        const Node& node = tape[id];
+        if (is_leaf(id)) {
+            continue;
+        }
+        assign(id);
+        Instruction instruction{node.op, false, slots[id], {Tape::npos, Tape::npos}, 0, 0};
+        if (op_is_nary(node.op)) {
+            std::span<const uint32_t> children = tape.get_operands(node);
+            std::span<const float> saved = tape.get_saved(node);
+            instruction.first = program.operands.size();
+            instruction.count = children.size();
+            for (size_t i = 0; i < children.size(); i++) {
+                program.operands.push_back(slots[children[i]]);
+                program.saved.push_back(saved[i]);
+            }
+            program.operands.push_back(tape.get_extra(node));
+            program.saved.push_back(0.0f);
+        }
+        for (int i = 0; i < op_arity(node.op); i++) {
+            instruction.in[i] = slots[node.children[i]];
+        }
+        program.instructions.push_back(instruction);
+    }
+    program.output = slots[root.get_id()];
+    program.generate_backward();
+    return program;
+}
+
+void Program::generate_backward()
+{
+    // The chain rule of each instruction, last one first
+    std::vector<GradInstruction>& out = backward_instructions;
+    out.clear();
+    for (auto it = instructions.rbegin(); it != instructions.rend(); ++it) {
+        const Instruction& in = *it;
+        switch (in.op) {
+        case Op::Add:
+            out.push_back({GradOp::Add, false, in.in[0], in.out, 0, 0, 0});
+            out.push_back({GradOp::Add, false, in.in[1], in.out, 0, 0, 0});
+            break;
+        case Op::Sub:
+            out.push_back({GradOp::Add, false, in.in[0], in.out, 0, 0, 0});
+            out.push_back({GradOp::Sub, false, in.in[1], in.out, 0, 0, 0});
+            break;
+        case Op::Mul:
+            out.push_back({GradOp::Mul, false, in.in[0], in.out, in.in[1], 0, 0});
+            out.push_back({GradOp::Mul, false, in.in[1], in.out, in.in[0], 0, 0});
+            break;
+        case Op::Div:
+            out.push_back({GradOp::DivLhs, false, in.in[0], in.out, in.in[1], 0, 0});
+            out.push_back({GradOp::DivRhs, false, in.in[1], in.out, in.in[1], 0, 0});
+            break;
+        case Op::Neg:
+            out.push_back({GradOp::Sub, false, in.in[0], in.out, 0, 0, 0});
+            break;
+        case Op::Pow:
+            out.push_back({GradOp::Pow, false, in.in[0], in.out, in.in[1], 0, 0});
+            break;
+        case Op::Exp:
+            out.push_back({GradOp::Exp, false, in.in[0], in.out, 0, 0, 0});
+            break;
+        case Op::Log:
+            out.push_back({GradOp::Log, false, in.in[0], in.out, 0, 0, 0});
+            break;
+        case Op::Tanh:
+            out.push_back({GradOp::Tanh, false, in.in[0], in.out, 0, 0, 0});
+            break;
+        case Op::Relu:
+            out.push_back({GradOp::Relu, false, in.in[0], in.out, 0, 0, 0});
+            break;
+        case Op::Sigmoid:
+            out.push_back({GradOp::Sigmoid, false, in.in[0], in.out, 0, 0, 0});
+            break;
+        case Op::CrossEntropy:
+        case Op::MseLoss:
+        case Op::HingeLoss:
+        case Op::SoftmaxLoss:
+            out.push_back({GradOp::Nary, false, 0, in.out, 0, in.first, in.count});
+            break;
+        case Op::Dot:
+        case Op::DotTanh:
+            out.push_back({in.op == Op::Dot ? GradOp::Dot : GradOp::DotTanh, in.contiguous,
+                           in.in[0], in.out, in.in[1], in.first, in.count});
+            break;
+        default:
+            break;
+        }
+    }
+    grads.assign(values.size(), 0.0f);
+}
+
+// Optimization passes
+void Program::optimize()
+{
+    fold_and_eliminate();
+    fuse_dots();
+    remove_dead_code();
+    generate_backward();
+}
+
+void Program::fold_and_eliminate()
+{
+    // One pass in program order. alias maps a register to the one that now
+    // holds its value; every input is looked up there first.
+    std::vector<uint32_t> alias(values.size());
+    for (size_t r = 0; r < alias.size(); r++) {
+        alias[r] = r;
+    }
+    auto resolve = [&](uint32_t r) { return r == Tape::npos ? r : alias[r]; };
+
+    // equal constants share one register
+    std::unordered_map<uint32_t, uint32_t> constants;
+    auto share_constant = [&](uint32_t r) {
+        auto [it, inserted] = constants.emplace(float_bits(values[r]), r);
+        if (!inserted) {
+            alias[r] = it->second;
+        }
+    };
+    for (size_t r = 0; r < n_leaves; r++) {
+        if (constant[r]) {
+            share_constant(r);
+        }
+    }
+
+    std::map<std::tuple<Op, uint32_t, uint32_t>, uint32_t> seen;
+    std::vector<Instruction> kept;
+    for (Instruction in : instructions) {
+        in.in[0] = resolve(in.in[0]);
+        in.in[1] = resolve(in.in[1]);
+        if (register_operands(in) > 0) {
+            for (uint32_t i = 0; i < register_operands(in); i++) {
+                operands[in.first + i] = resolve(operands[in.first + i]);
+            }
+            kept.push_back(in);
+            continue;
+        }
+
+        bool unary = op_arity(in.op) == 1;
+        bool a_constant = constant[in.in[0]];
+        bool b_constant = unary || constant[in.in[1]];
+        if (a_constant && b_constant) {
+            // constant folding
+            values[in.out] = apply(in.op, values[in.in[0]], unary ? 0.0f : values[in.in[1]]);
+            constant[in.out] = true;
+            share_constant(in.out);
+            continue;
+        }
+        if (in.op == Op::Mul && (a_constant || b_constant)) {
+            uint32_t c = a_constant ? in.in[0] : in.in[1];
+            if (values[c] == 1.0f) {
+                alias[in.out] = a_constant ? in.in[1] : in.in[0];
+                continue;
+            }
+        }
+
+        // common subexpressions, with the inputs of + and * in a fixed order
+        uint32_t a = in.in[0];
+        uint32_t b = in.in[1];
+        if ((in.op == Op::Add || in.op == Op::Mul) && b < a) {
+            std::swap(a, b);
+        }
+        auto [it, inserted] = seen.emplace(std::make_tuple(in.op, a, b), in.out);
+        if (!inserted) {
+            alias[in.out] = it->second;
+            continue;
+        }
+        kept.push_back(in);
+    }
+    instructions.swap(kept);
+    output = alias[output];
+}
+
+void Program::fuse_dots()
+{
+    std::vector<uint32_t> uses(values.size(), 0);
+    std::vector<uint32_t> producer(values.size(), Tape::npos);
+    for (size_t i = 0; i < instructions.size(); i++) {
+        const Instruction& in = instructions[i];
+        producer[in.out] = i;
+        for (uint32_t r : in.in) {
+            if (r != Tape::npos) {
+                uses[r]++;
+            }
+        }
+        for (uint32_t k = 0; k < register_operands(in); k++) {
+            uses[operands[in.first + k]]++;
+        }
+    }
+    uses[output]++;
+
+    std::vector<bool> dead(instructions.size(), false);
+    // a register only read by the chain being fused, produced by op
+    auto single_use = [&](uint32_t r, Op op) {
+        return r != Tape::npos && producer[r] != Tape::npos && uses[r] == 1
+            && instructions[producer[r]].op == op && !dead[producer[r]];
+    };
+    auto link = [&](uint32_t r) { return single_use(r, Op::Add) && single_use(instructions[producer[r]].in[1], Op::Mul); };
+
+    // Chains of  s = s + x * w  (optionally + bias at the end), found from
+    // their last add, become one Dot in place of that add
+    std::vector<uint32_t> pairs;
+    for (size_t i = instructions.size(); i-- > 0;) {
+        Instruction& top = instructions[i];
+        if (dead[i] || top.op != Op::Add) {
+            continue;
+        }
+        uint32_t start = Tape::npos;
+        uint32_t bias = Tape::npos;
+        uint32_t cur = i;
+        pairs.clear();
+        auto take = [&](uint32_t r) {
+            const Instruction& mul = instructions[producer[r]];
+            pairs.push_back(mul.in[1]);
+            pairs.push_back(mul.in[0]);
+            dead[producer[r]] = true;
+        };
+        if (!single_use(top.in[1], Op::Mul)) {
+            if (link(top.in[0])) {
+                bias = top.in[1];
+                cur = producer[top.in[0]];
+            } else if (single_use(top.in[0], Op::Mul)) {
+                take(top.in[0]);
+                bias = top.in[1];
+                cur = Tape::npos;
+            } else {
+                continue;
+            }
+        }
+        while (cur != Tape::npos) {
+            const Instruction& add = instructions[cur];
+            take(add.in[1]);
+            if (cur != i) {
+                dead[cur] = true;
+            }
+            uint32_t next = add.in[0];
+            if (link(next)) {
+                cur = producer[next];
+            } else {
+                if (single_use(next, Op::Mul)) {
+                    take(next);
+                } else {
+                    start = next;
+                }
+                cur = Tape::npos;
+            }
+        }
+
+        // pairs were collected last first, each as (b, a)
+        uint32_t first = operands.size();
+        operands.insert(operands.end(), pairs.rbegin(), pairs.rend());
+        top = Instruction{Op::Dot, false, top.out, {start, bias}, first, static_cast<uint32_t>(pairs.size() / 2)};
+    }
+
+    // tanh of a Dot that nothing else reads
+    for (size_t i = 0; i < instructions.size(); i++) {
+        Instruction& in = instructions[i];
+        if (!dead[i] && in.op == Op::Tanh && single_use(in.in[0], Op::Dot)) {
+            Instruction fused = instructions[producer[in.in[0]]];
+            dead[producer[in.in[0]]] = true;
+            fused.op = Op::DotTanh;
+            fused.out = in.out;
+            in = fused;
+        }
+    }
+
+    std::vector<Instruction> kept;
+    for (size_t i = 0; i < instructions.size(); i++) {
+        if (!dead[i]) {
+            kept.push_back(instructions[i]);
+        }
+    }
+    instructions.swap(kept);
+}
+
+void Program::remove_dead_code()
+{
+    // Instructions whose result never reaches the output
+    std::vector<bool> live(values.size(), false);
+    live[output] = true;
+    std::vector<Instruction> kept;
+    for (auto it = instructions.rbegin(); it != instructions.rend(); ++it) {
+        if (!live[it->out]) {
+            continue;
+        }
+        for (uint32_t r : it->in) {
+            if (r != Tape::npos) {
+                live[r] = true;
+            }
+        }
+        for (uint32_t k = 0; k < register_operands(*it); k++) {
+            live[operands[it->first + k]] = true;
+        }
+        kept.push_back(*it);
+    }
+    std::reverse(kept.begin(), kept.end());
+
+    // Renumber: leaves stay, then live folded constants, then results in order
+    std::vector<uint32_t> renamed(values.size(), Tape::npos);
+    std::vector<uint32_t> order;
+    for (size_t r = 0; r < n_leaves; r++) {
+        order.push_back(r);
+    }
+    for (size_t r = n_leaves; r < values.size(); r++) {
+        if (constant[r] && live[r]) {
+            order.push_back(r);
+        }
+    }
+    size_t n_constants = order.size();
+    for (const Instruction& in : kept) {
+        order.push_back(in.out);
+    }
+
+    std::vector<float> new_values;
+    std::vector<uint32_t> new_node_ids;
+    std::vector<bool> new_constant;
+    for (uint32_t r : order) {
+        renamed[r] = new_values.size();
+        new_values.push_back(values[r]);
+        new_node_ids.push_back(node_ids[r]);
+        new_constant.push_back(constant[r]);
+    }
+    auto rename = [&](uint32_t r) { return r == Tape::npos ? r : renamed[r]; };
+
+    std::vector<uint32_t> new_operands;
+    std::vector<float> new_saved;
+    for (Instruction& in : kept) {
+        in.out = rename(in.out);
+        in.in[0] = rename(in.in[0]);
+        in.in[1] = rename(in.in[1]);
+        uint32_t first = new_operands.size();
+        for (uint32_t k = 0; k < stored_operands(in); k++) {
+            uint32_t operand = operands[in.first + k];
+            new_operands.push_back(k < register_operands(in) ? rename(operand) : operand);
+            new_saved.push_back(in.first + k < saved.size() ? saved[in.first + k] : 0.0f);
+        }
+        in.first = first;
+        if (in.op == Op::Dot || in.op == Op::DotTanh) {
+            in.contiguous = true;
+            for (uint32_t k = 0; k < in.count; k++) {
+                in.contiguous = in.contiguous && new_operands[first + 2 * k] == new_operands[first] + k
+                    && new_operands[first + 2 * k + 1] == new_operands[first + 1] + k;
+            }
+        }
+    }
+
+    output = rename(output);
+    n_leaves = n_constants;
+    values.swap(new_values);
+    node_ids.swap(new_node_ids);
+    constant.swap(new_constant);
+    operands.swap(new_operands);
+    saved.swap(new_saved);
+    instructions.swap(kept);
+}
+
+// Forward pass
+float Program::forward()
+{
+    MICROGRAD_PROFILE_PHASE(Phase::Forward);
+    const Kernels& k = kernels();
+    float* v = values.data();
+    const uint32_t* ops = operands.data();
+    for (const Instruction& in : instructions) {
+        switch (in.op) {
+        case Op::Add: v[in.out] = v[in.in[0]] + v[in.in[1]]; break;
+        case Op::Sub: v[in.out] = v[in.in[0]] - v[in.in[1]]; break;
+        case Op::Mul: v[in.out] = v[in.in[0]] * v[in.in[1]]; break;
+        case Op::Div: v[in.out] = v[in.in[0]] / v[in.in[1]]; break;
+        case Op::Neg: v[in.out] = -v[in.in[0]]; break;
+        case Op::Pow: v[in.out] = std::pow(v[in.in[0]], v[in.in[1]]); break;
+        case Op::Exp: v[in.out] = std::exp(v[in.in[0]]); break;
+        case Op::Log: v[in.out] = std::log(v[in.in[0]]); break;
+        case Op::Tanh: v[in.out] = std::tanh(v[in.in[0]]); break;
+        case Op::Relu: v[in.out] = std::max(v[in.in[0]], 0.0f); break;
+        case Op::Sigmoid: v[in.out] = logistic(v[in.in[0]]); break;
+        case Op::CrossEntropy: {
+            // same steps as cross_entropy(), softmax - one_hot saved for backward
+            const uint32_t* logits = ops + in.first;
+            uint32_t target = logits[in.count];
+            float* p = saved.data() + in.first;
+            float m = -INFINITY;
+            for (uint32_t i = 0; i < in.count; i++) {
+                m = std::max(m, v[logits[i]]);
+            }
+            float sum = 0;
+            for (uint32_t i = 0; i < in.count; i++) {
+                p[i] = std::exp(v[logits[i]] - m);
+                sum += p[i];
+            }
+            for (uint32_t i = 0; i < in.count; i++) {
+                p[i] = p[i] / sum - (i == target ? 1.0f : 0.0f);
+            }
+            v[in.out] = std::log(sum) + m - v[logits[target]];
+            break;
+        }
+        case Op::MseLoss:
+        case Op::HingeLoss:
+        case Op::SoftmaxLoss: {
+            // outputs, then targets (one per sample for SoftmaxLoss), then the batch
+            const uint32_t* children = ops + in.first;
+            int batch = static_cast<int>(children[in.count]);
+            uint32_t n_outputs = in.op == Op::SoftmaxLoss ? in.count - batch : in.count / 2;
+            loss_inputs.resize(in.count);
+            for (uint32_t i = 0; i < in.count; i++) {
+                loss_inputs[i] = v[children[i]];
+            }
+            Loss kind = in.op == Op::MseLoss ? Loss::MSE : in.op == Op::HingeLoss ? Loss::Hinge : Loss::SoftmaxCrossEntropy;
+            if (kind == Loss::SoftmaxCrossEntropy) {
+                check_class_targets(loss_inputs.data() + n_outputs, batch, n_outputs / batch);
+            }
+            v[in.out] = loss_kernel(kind, loss_inputs.data(), loss_inputs.data() + n_outputs, batch,
+                                    n_outputs / batch, 1.0f / batch, saved.data() + in.first);
+            break;
+        }
+        case Op::Dot:
+        case Op::DotTanh: {
+            float sum = in.in[0] == Tape::npos ? 0.0f : v[in.in[0]];
+            const uint32_t* pair = ops + in.first;
+            if (in.contiguous) {
+                sum += k.dot(v + pair[0], v + pair[1], in.count);
+            } else {
+                for (uint32_t i = 0; i < in.count; i++) {
+                    sum += v[pair[2 * i]] * v[pair[2 * i + 1]];
+                }
+            }
+            if (in.in[1] != Tape::npos) {
+                sum += v[in.in[1]];
+            }
+            v[in.out] = in.op == Op::Dot ? sum : std::tanh(sum);
+            break;
+        }
+        default: break;
+        }
+    }
+    return v[output];
+}
+
+float Program::forward(std::span<const float> inputs)
+{
+    std::copy(inputs.begin(), inputs.begin() + std::min(inputs.size(), n_inputs), values.begin());
+    return forward();
+}
+
+// Backward pass
+void Program::backward()
+{
+    MICROGRAD_PROFILE_PHASE(Phase::Backward);
+    const Kernels& k = kernels();
+    const float* v = values.data();
+    float* g = grads.data();
+    const uint32_t* ops = operands.data();
+    std::fill(grads.begin(), grads.end(), 0.0f);
+    g[output] = 1.0f;
+    for (const GradInstruction& in : backward_instructions) {
+        switch (in.op) {
+        case GradOp::Add: g[in.dst] += g[in.src]; break;
+        case GradOp::Sub: g[in.dst] -= g[in.src]; break;
+        case GradOp::Mul: g[in.dst] += g[in.src] * v[in.aux]; break;
+        case GradOp::DivLhs: g[in.dst] += g[in.src] / v[in.aux]; break;
+        case GradOp::DivRhs: g[in.dst] -= g[in.src] * v[in.src] / v[in.aux]; break;
+        case GradOp::Pow: {
+            float x = v[in.dst];
+            float p = v[in.aux];
+            g[in.dst] += g[in.src] * (x != 0 ? p * v[in.src] / x : p * std::pow(x, p - 1));
+            break;
+        }
+        case GradOp::Exp: g[in.dst] += g[in.src] * v[in.src]; break;
+        case GradOp::Log: g[in.dst] += g[in.src] / v[in.dst]; break;
+        case GradOp::Tanh: g[in.dst] += g[in.src] * (1 - v[in.src] * v[in.src]); break;
+        case GradOp::Relu: g[in.dst] += v[in.src] > 0 ? g[in.src] : 0.0f; break;
+        case GradOp::Sigmoid: g[in.dst] += g[in.src] * v[in.src] * (1 - v[in.src]); break;
+        case GradOp::Nary: {
+            const uint32_t* children = ops + in.first;
+            const float* p = saved.data() + in.first;
+            for (uint32_t i = 0; i < in.count; i++) {
+                g[children[i]] += g[in.src] * p[i];
+            }
+            break;
+        }
+        case GradOp::Dot:
+        case GradOp::DotTanh: {
+            float d = g[in.src];
+            if (in.op == GradOp::DotTanh) {
+                d *= 1 - v[in.src] * v[in.src];
+            }
+            if (in.dst != Tape::npos) {
+                g[in.dst] += d;
+            }
+            if (in.aux != Tape::npos) {
+                g[in.aux] += d;
+            }
+            const uint32_t* pair = ops + in.first;
+            if (in.contiguous) {
+                k.axpy(d, v + pair[1], g + pair[0], in.count);
+                k.axpy(d, v + pair[0], g + pair[1], in.count);
+            } else {
+                for (uint32_t i = 0; i < in.count; i++) {
+                    g[pair[2 * i]] += d * v[pair[2 * i + 1]];
+                    g[pair[2 * i + 1]] += d * v[pair[2 * i]];
+                }
+            }
+            break;
+        }
+        }
+    }
+}
+
+uint32_t Program::get_slot(const Value& value) const
+{
+    auto it = std::find(node_ids.begin(), node_ids.end(), value.get_id());
+    return it == node_ids.end() ? Tape::npos : static_cast<uint32_t>(it - node_ids.begin());
+}
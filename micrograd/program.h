@@ -0,0 +1,142 @@
+#pragma once
+
+// Compiled form of a recorded Value graph. compile() walks the graph below a
+// root once and lowers it into a flat list of instructions over a dense
+// register file, one register per node: the inputs first, then the other
+// leaves (parameters, constants) in tape order, then every computed node in
+// topological order. The matching backward program is generated at the same
+// time, so a step is two linear passes over small arrays with no graph to
+// rebuild, sort or chase pointers through.
+//
+// optimize() then rewrites the program: constant folding, common
+// subexpression elimination, and fusion of multiply-add chains into Dot /
+// DotTanh instructions with a single backward kernel each.
+
+#include "engine.h"
+
+#include <span>
+#include <vector>
+
+// out = op(in[0], in[1]); unary ops ignore in[1].
+// CrossEntropy and the losses: the operand registers (logits; outputs then
+// targets) are operands[first .. first + count) and operands[first + count]
+// is the target class or the batch size.
+// Dot: out = in[0] + sum_i a_i * b_i + in[1], where in[0] (start of the
+// chain) and in[1] (trailing bias) may be Tape::npos and the (a_i, b_i)
+// register pairs are operands[first .. first + 2 * count). DotTanh is
+// tanh of the same. When contiguous is set the a and b registers are two
+// runs a_0, a_0 + 1, ... and b_0, b_0 + 1, ..., which run on the SIMD
+// kernels.
+struct Instruction {
+    Op op;
+    bool contiguous;
+    uint32_t out;
+    uint32_t in[2];
+    uint32_t first;
+    uint32_t count;
+};
+
+// Operations of the backward program, each accumulates into grad[dst]
+enum class GradOp : uint8_t {
+    Add,      // grad[dst] += grad[src]
+    Sub,      // grad[dst] -= grad[src]
+    Mul,      // grad[dst] += grad[src] * value[aux]
+    DivLhs,   // grad[dst] += grad[src] / value[aux]
+    DivRhs,   // grad[dst] -= grad[src] * value[src] / value[aux]
+    Pow,      // grad[dst] += grad[src] * value[aux] * value[src] / value[dst]
+    Exp,      // grad[dst] += grad[src] * value[src]
+    Log,      // grad[dst] += grad[src] / value[dst]
+    Tanh,     // grad[dst] += grad[src] * (1 - value[src]^2)
+    Relu,     // grad[dst] += grad[src] if value[src] > 0
+    Sigmoid,  // grad[dst] += grad[src] * value[src] * (1 - value[src])
+    // grad[operand_i] += grad[src] * saved[i] for the n-ary ops, where saved
+    // is the closed-form gradient written by forward (e.g. softmax - one_hot)
+    Nary,
+    // d = grad[src] (times 1 - value[src]^2 for DotTanh); grad[dst] and
+    // grad[aux] (start and bias, when not npos) get d, every pair gets
+    // grad[a_i] += d * value[b_i] and grad[b_i] += d * value[a_i]
+    Dot,
+    DotTanh,
+};
+
+struct GradInstruction {
+    GradOp op;
+    bool contiguous;
+    uint32_t dst;
+    uint32_t src;
+    uint32_t aux;
+    uint32_t first;
+    uint32_t count;
+};
+
+class Program
+{
+private:
+    std::vector<Instruction> instructions;
+    std::vector<GradInstruction> backward_instructions;
+    // register pairs of the Dot / DotTanh instructions, operands of n-ary ops
+    std::vector<uint32_t> operands;
+    // per operand gradients written by the n-ary ops' forward
+    std::vector<float> saved;
+    // gathered inputs of a loss instruction
+    std::vector<float> loss_inputs;
+    std::vector<float> values;
+    std::vector<float> grads;
+    // tape node each register was lowered from
+    std::vector<uint32_t> node_ids;
+    // registers holding compile-time constants
+    std::vector<bool> constant;
+    size_t n_inputs = 0;
+    size_t n_leaves = 0;
+    uint32_t output = 0;
+
+    // Passes of optimize()
+    void fold_and_eliminate();
+    void fuse_dots();
+    void remove_dead_code();
+    void generate_backward();
+
+public:
+    // Lower the graph below root. The given inputs (leaves) get registers
+    // 0 .. inputs.size() - 1 in that order and are what forward() replaces;
+    // every other leaf keeps the value it had when compiled, unless written
+    // through get_values(). Throws std::invalid_argument if an input is not
+    // a leaf or appears twice.
+    static Program compile(const Value& root, std::span<const Value> inputs = {});
+
+    // Rewrite the program into fewer, larger instructions computing the same
+    // values and gradients (up to rounding):
+    //  - instructions on constants only are evaluated now, x * 1 becomes x
+    //  - repeated (op, inputs) and repeated constants are computed once
+    //  - chains of single-use x * w and + become one Dot, and a Dot feeding
+    //    only a tanh becomes DotTanh
+    //  - unused instructions are dropped and the registers renumbered
+    // Leaf registers, and so get_slot() of leaves, are unchanged.
+    void optimize();
+
+    // Run the program, optionally with new input values first; returns the
+    // output. Throws std::invalid_argument for a softmax loss target that is
+    // not a class of its outputs.
+    float forward();
+    float forward(std::span<const float> inputs);
+    // Gradient of the output with respect to every register, for the values
+    // of the last forward
+    void backward();
+
+    float get_output() const { return values[output]; }
+    // Register of a node of the compiled graph, or Tape::npos. Linear search,
+    // meant for setup code.
+    uint32_t get_slot(const Value& value) const;
+
+    std::span<float> get_values() { return values; }
+    std::span<const float> get_grads() const { return grads; }
+    std::span<const float> get_input_grads() const { return {grads.data(), n_inputs}; }
+
+    size_t get_n_inputs() const { return n_inputs; }
+    // Registers no instruction writes: inputs, other leaves, and constants
+    size_t get_n_leaves() const { return n_leaves; }
+    size_t get_n_registers() const { return values.size(); }
+    std::span<const Instruction> get_instructions() const { return instructions; }
+    std::span<const GradInstruction> get_backward_instructions() const { return backward_instructions; }
+    std::span<const uint32_t> get_operands() const { return operands; }
+};
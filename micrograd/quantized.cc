@@ -0,0 +1,248 @@
+// Implementations from quantized.h
+
+#include "quantized.h"
+#include "kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+// Calibration and the comparison run the float model over this many samples at a time
+static constexpr int chunk_rows = 256;
+
+static int8_t quantize(float x, float inverse_scale)
+{
+    return static_cast<int8_t>(std::lrint(std::clamp(x * inverse_scale, -127.0f, 127.0f)));
+}
+
+// value = scale * int8 for values up to max_abs
+static float scale_for(float max_abs)
+{
+    return max_abs > 0.0f ? max_abs / 127.0f : 1.0f;
+}
+
+static int argmax(const float* row, int n)
+{
+    return static_cast<int>(std::max_element(row, row + n) - row);
+}
+
+// Construction
+QuantizedMLP::QuantizedMLP(const MLP& mlp, const float* calibration, int n_samples)
+    : n_inputs(mlp.n_inputs), n_outputs(mlp.n_neurons_per_layer.back())
+{
+    if (n_samples < 1) {
+        throw std::invalid_argument("calibration needs at least one sample");
+    }
+    std::span<const Layer> mlp_layers = mlp.get_layers();
+    for (const Layer& layer : mlp_layers) {
+        if (layer.n_inputs >= (1 << 17)) {
+            throw std::invalid_argument("layer with " + std::to_string(layer.n_inputs) +
+                                        " inputs is too wide for int32 sums");
+        }
+    }
+
+    // Calibration: the largest magnitude each layer's input reaches on the
+    // samples, running the float layers chunk by chunk
+    std::vector<float> max_abs(mlp_layers.size(), 0.0f);
+    std::vector<float> activations[2];
+    for (int start = 0; start < n_samples; start += chunk_rows) {
+        int rows = std::min(chunk_rows, n_samples - start);
+        const float* x = calibration + static_cast<size_t>(start) * n_inputs;
+        for (size_t l = 0; l < mlp_layers.size(); l++) {
+            const Layer& layer = mlp_layers[l];
+            size_t n = static_cast<size_t>(rows) * layer.n_inputs;
+            for (size_t i = 0; i < n; i++) {
+                max_abs[l] = std::max(max_abs[l], std::fabs(x[i]));
+            }
+            if (l + 1 == mlp_layers.size()) {
+                break;
+            }
+            Parameters parameters = layer.get_parameters();
+            std::vector<float>& y = activations[l % 2];
+            y.resize(static_cast<size_t>(rows) * layer.n_neurons);
+            dense_tanh(x, rows, layer.n_inputs, parameters.data,
+                       parameters.data + static_cast<size_t>(layer.n_neurons) * layer.n_inputs, layer.n_neurons,
+                       y.data());
+            x = y.data();
+        }
+    }
+
+    // Weights, one scale per neuron, and the tables
+    const float step = 2.0f * tanh_range / tanh_entries;
+    for (size_t l = 0; l < mlp_layers.size(); l++) {
+        const Layer& layer = mlp_layers[l];
+        const float* weights = layer.get_parameters().data;
+        const float* bias = weights + static_cast<size_t>(layer.n_neurons) * layer.n_inputs;
+        QuantizedLayer q;
+        q.n_inputs = layer.n_inputs;
+        q.n_neurons = layer.n_neurons;
+        q.input_scale = scale_for(max_abs[l]);
+        q.weights.resize(static_cast<size_t>(layer.n_neurons) * layer.n_inputs);
+        for (int j = 0; j < layer.n_neurons; j++) {
+            const float* row = weights + static_cast<size_t>(j) * layer.n_inputs;
+            float row_max = 0.0f;
+            for (int i = 0; i < layer.n_inputs; i++) {
+                row_max = std::max(row_max, std::fabs(row[i]));
+            }
+            float weight_scale = scale_for(row_max);
+            for (int i = 0; i < layer.n_inputs; i++) {
+                q.weights[static_cast<size_t>(j) * layer.n_inputs + i] = quantize(row[i], 1.0f / weight_scale);
+            }
+            q.index_scale.push_back(q.input_scale * weight_scale / step);
+            q.index_offset.push_back(bias[j] / step + tanh_entries / 2);
+        }
+        layers.push_back(std::move(q));
+    }
+    for (size_t l = 0; l < layers.size(); l++) {
+        QuantizedLayer& q = layers[l];
+        for (int e = 0; e < tanh_entries; e++) {
+            float y = std::tanh((e - tanh_entries / 2) * step);
+            if (l + 1 < layers.size()) {
+                q.tanh_i8.push_back(quantize(y, 1.0f / layers[l + 1].input_scale));
+            } else {
+                q.tanh_f32.push_back(y);
+            }
+        }
+    }
+}
+
+size_t QuantizedMLP::get_weight_bytes() const
+{
+    size_t bytes = 0;
+    for (const QuantizedLayer& q : layers) {
+        // int8 weights, a scale and a bias per neuron
+        bytes += q.weights.size() + 2 * q.n_neurons * sizeof(float);
+    }
+    return bytes;
+}
+
+// Inference
+void QuantizedMLP::predict(const float* inputs, float* outputs, int batch)
+{
+    const Kernels& k = kernels();
+    size_t n = static_cast<size_t>(batch) * n_inputs;
+    if (buffers[0].size() < n) {
+        buffers[0].resize(n);
+    }
+    k.quantize_i8(inputs, 1.0f / layers[0].input_scale, buffers[0].data(), static_cast<int>(n));
+
+    // Each layer reads one buffer and writes the other, the last layer
+    // writes floats into outputs
+    const float last_entry = tanh_entries - 1;
+    for (size_t l = 0; l < layers.size(); l++) {
+        const QuantizedLayer& q = layers[l];
+        bool last = l + 1 == layers.size();
+        std::vector<int8_t>& next = buffers[(l + 1) % 2];
+        if (!last && next.size() < static_cast<size_t>(batch) * q.n_neurons) {
+            next.resize(static_cast<size_t>(batch) * q.n_neurons);
+        }
+        const int8_t* x = buffers[l % 2].data();
+        std::vector<int32_t>& acc = accumulators;
+        if (acc.size() < static_cast<size_t>(q.n_neurons)) {
+            acc.resize(q.n_neurons);
+        }
+        for (int r = 0; r < batch; r++) {
+            // Integer sums, four neurons at a time, then the table lookups
+            const int8_t* xr = x + static_cast<size_t>(r) * q.n_inputs;
+            int j = 0;
+            for (; j + 4 <= q.n_neurons; j += 4) {
+                k.dot_i8_rows4(xr, q.weights.data() + static_cast<size_t>(j) * q.n_inputs, q.n_inputs, q.n_inputs,
+                               acc.data() + j);
+            }
+            for (; j < q.n_neurons; j++) {
+                acc[j] = k.dot_i8(xr, q.weights.data() + static_cast<size_t>(j) * q.n_inputs, q.n_inputs);
+            }
+            for (j = 0; j < q.n_neurons; j++) {
+                float index = std::clamp(acc[j] * q.index_scale[j] + q.index_offset[j], 0.0f, last_entry);
+                int e = static_cast<int>(index + 0.5f);
+                if (last) {
+                    outputs[static_cast<size_t>(r) * q.n_neurons + j] = q.tanh_f32[e];
+                } else {
+                    next[static_cast<size_t>(r) * q.n_neurons + j] = q.tanh_i8[e];
+                }
+            }
+        }
+    }
+}
+
+// Accuracy
+QuantizationReport measure_quantization(MLP& mlp, QuantizedMLP& quantized, const float* inputs, int n_samples,
+                                        const float* targets)
+{
+    QuantizationReport report;
+    int n_outputs = quantized.n_outputs;
+    report.samples = static_cast<size_t>(std::max(n_samples, 0));
+    report.n_outputs = n_outputs;
+    report.has_targets = targets != nullptr;
+    if (n_samples < 1) {
+        return report;
+    }
+    std::vector<float> float_outputs(static_cast<size_t>(chunk_rows) * n_outputs);
+    std::vector<float> quantized_outputs(float_outputs.size());
+    double abs_sum = 0.0;
+    size_t same_argmax = 0, float_correct = 0, quantized_correct = 0;
+    for (int start = 0; start < n_samples; start += chunk_rows) {
+        int rows = std::min(chunk_rows, n_samples - start);
+        const float* x = inputs + static_cast<size_t>(start) * quantized.n_inputs;
+        mlp.predict(x, float_outputs.data(), rows);
+        quantized.predict(x, quantized_outputs.data(), rows);
+        for (int r = 0; r < rows; r++) {
+            const float* f = float_outputs.data() + static_cast<size_t>(r) * n_outputs;
+            const float* q = quantized_outputs.data() + static_cast<size_t>(r) * n_outputs;
+            const float* t = targets ? targets + static_cast<size_t>(start + r) * n_outputs : nullptr;
+            for (int c = 0; c < n_outputs; c++) {
+                double error = std::fabs(static_cast<double>(f[c]) - q[c]);
+                report.max_abs_error = std::max(report.max_abs_error, error);
+                abs_sum += error;
+                if (t) {
+                    report.float_mse += (static_cast<double>(f[c]) - t[c]) * (f[c] - t[c]);
+                    report.quantized_mse += (static_cast<double>(q[c]) - t[c]) * (q[c] - t[c]);
+                }
+            }
+            if (n_outputs > 1) {
+                int float_class = argmax(f, n_outputs);
+                int quantized_class = argmax(q, n_outputs);
+                same_argmax += float_class == quantized_class;
+                if (t) {
+                    int target_class = argmax(t, n_outputs);
+                    float_correct += float_class == target_class;
+                    quantized_correct += quantized_class == target_class;
+                }
+            }
+        }
+    }
+    double n_values = static_cast<double>(report.samples) * n_outputs;
+    report.mean_abs_error = abs_sum / n_values;
+    report.float_mse /= n_values;
+    report.quantized_mse /= n_values;
+    report.argmax_agreement = static_cast<double>(same_argmax) / report.samples;
+    report.float_accuracy = static_cast<double>(float_correct) / report.samples;
+    report.quantized_accuracy = static_cast<double>(quantized_correct) / report.samples;
+    return report;
+}
+
+void QuantizationReport::write_report(std::ostream& out) const
+{
+    char line[128];
+    std::snprintf(line, sizeof(line), "%zu samples x %d outputs, float vs int8\n", samples, n_outputs);
+    out << line;
+    std::snprintf(line, sizeof(line), "abs error    max %.6f  mean %.6f\n", max_abs_error, mean_abs_error);
+    out << line;
+    if (n_outputs > 1) {
+        std::snprintf(line, sizeof(line), "same argmax  %5.1f%%\n", 100.0 * argmax_agreement);
+        out << line;
+    }
+    if (has_targets) {
+        std::snprintf(line, sizeof(line), "mse          float %.6f  int8 %.6f  delta %+.6f\n", float_mse,
+                      quantized_mse, quantized_mse - float_mse);
+        out << line;
+        if (n_outputs > 1) {
+            std::snprintf(line, sizeof(line), "accuracy     float %5.1f%%  int8 %5.1f%%  delta %+.1f%%\n",
+                          100.0 * float_accuracy, 100.0 * quantized_accuracy,
+                          100.0 * (quantized_accuracy - float_accuracy));
+            out << line;
+        }
+    }
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+// Quantized int8 inference for a trained MLP. Every layer's weights are
+// stored as int8 with one float scale per neuron (its largest weight maps to
+// 127); activations are int8 too, with one scale per layer that a
+// calibration pass over sample inputs fixes (the largest input of the layer
+// seen there maps to 127, larger ones are clamped). A layer is
+//   acc_j = sum_i x_q[i] * w_q[j][i]                 (int32)
+//   y_j   = tanh(acc_j * x_scale * w_scale_j + bias_j)
+// with tanh read from a lookup table indexed by the pre-activation. For the
+// hidden layers the table holds the output already quantized to the next
+// layer's input scale, so activations never go back to float between
+// layers; the last layer's table holds floats. The weights take about a
+// quarter of the float32 bytes.
+//
+// The model is a copy taken at construction: later training of the MLP does
+// not reach it. measure_quantization() reports how far it is from the float
+// path on a set of samples.
+
+#include "nn.h"
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+class QuantizedMLP {
+public:
+    // Quantizes mlp, calibrating the activation scales on n_samples rows of
+    // n_inputs. Throws std::invalid_argument without samples or with layers
+    // too wide for exact int32 sums (2^17 inputs).
+    QuantizedMLP(const MLP& mlp, const float* calibration, int n_samples);
+
+    int n_inputs;
+    int n_outputs;
+
+    // batch rows of n_inputs into batch rows of n_outputs, as MLP::predict.
+    // Once the buffers have grown to the batch size it does not allocate;
+    // they belong to the model, so use one QuantizedMLP per thread.
+    void predict(const float* inputs, float* outputs, int batch = 1);
+
+    // Scale of layer l's input activations: value = scale * int8
+    float get_input_scale(size_t l) const { return layers[l].input_scale; }
+    // Bytes of the quantized weights with their scales and the biases, to
+    // set against MLP::get_parameters().size * sizeof(float)
+    size_t get_weight_bytes() const;
+
+    // Entries of the tanh tables, over pre-activations in [-tanh_range, tanh_range)
+    static constexpr int tanh_entries = 4096;
+    static constexpr float tanh_range = 8.0f;
+
+private:
+    struct QuantizedLayer {
+        int n_inputs;
+        int n_neurons;
+        float input_scale;
+        // n_neurons x n_inputs, one row per neuron
+        std::vector<int8_t> weights;
+        // Per neuron, table index = acc * index_scale + index_offset; they
+        // fold the input and weight scales, the bias and the table step
+        std::vector<float> index_scale;
+        std::vector<float> index_offset;
+        // tanh quantized to the next layer's input scale (hidden layers) or
+        // as floats (the last layer)
+        std::vector<int8_t> tanh_i8;
+        std::vector<float> tanh_f32;
+    };
+    std::vector<QuantizedLayer> layers;
+    // quantized activations, alternating between layers
+    std::vector<int8_t> buffers[2];
+    // int32 sums of one sample's neurons
+    std::vector<int32_t> accumulators;
+};
+
+// Float against quantized outputs on the same samples
+struct QuantizationReport {
+    size_t samples = 0;
+    int n_outputs = 0;
+    // over every output of every sample
+    double max_abs_error = 0.0;
+    double mean_abs_error = 0.0;
+    // Samples whose largest output is the same neuron in both (more than
+    // one output only)
+    double argmax_agreement = 0.0;
+    // With targets (rows of n_outputs): mean squared error of each path and,
+    // for more than one output, the fraction of samples whose largest
+    // output is the target's largest
+    bool has_targets = false;
+    double float_mse = 0.0;
+    double quantized_mse = 0.0;
+    double float_accuracy = 0.0;
+    double quantized_accuracy = 0.0;
+
+    // A few lines: the errors and each path's numbers side by side
+    void write_report(std::ostream& out) const;
+};
+
+// Runs both models over n_samples rows of inputs. targets may be nullptr.
+QuantizationReport measure_quantization(MLP& mlp, QuantizedMLP& quantized, const float* inputs, int n_samples,
+                                        const float* targets = nullptr);
@@ -0,0 +1,47 @@
+// Benchmarks for micrograd/quantized.h
+//
+// int8 vs float: weight bytes, and samples/sec of QuantizedMLP::predict next
+// to MLP::predict at batch 1 and 64, on a model whose weights fit in cache
+// and on one whose float weights do not, with the accuracy delta on the
+// benchmark's inputs.
+
+#include "quantized.h"
+#include "bench.h"
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+void bench_quantized(int n_inputs, std::vector<int> sizes)
+{
+    const int n_samples = 256;
+    MLP mlp(n_inputs, sizes, Init::Xavier, 1);
+    std::vector<float> inputs(static_cast<size_t>(n_samples) * n_inputs);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        inputs[i] = std::sin(0.37f * i);
+    }
+    std::vector<float> outputs(static_cast<size_t>(n_samples) * sizes.back());
+    QuantizedMLP quantized(mlp, inputs.data(), n_samples);
+
+    std::printf("int8 inference, %zu parameters\n", mlp.get_parameters().size);
+    report("  float32 weights", mlp.get_parameters().size * sizeof(float) / 1e6, "MB");
+    report("  int8 weights", quantized.get_weight_bytes() / 1e6, "MB");
+    for (int batch : { 1, 64 }) {
+        int iters = std::max(2, 20000000 / static_cast<int>(mlp.get_parameters().size) / batch);
+        double float_ns = time_ns([&]() { mlp.predict(inputs.data(), outputs.data(), batch); }, iters);
+        double int8_ns = time_ns([&]() { quantized.predict(inputs.data(), outputs.data(), batch); }, iters);
+        char name[64];
+        std::snprintf(name, sizeof(name), "  float32, batch %d", batch);
+        report(name, batch / (float_ns / 1e9), "samples/s");
+        std::snprintf(name, sizeof(name), "  int8, batch %d", batch);
+        report(name, batch / (int8_ns / 1e9), "samples/s");
+    }
+    measure_quantization(mlp, quantized, inputs.data(), n_samples).write_report(std::cout);
+}
+
+int main()
+{
+    bench_quantized(784, { 128, 10 });
+    bench_quantized(2048, { 2048, 2048, 10 });
+}
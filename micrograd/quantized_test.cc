@@ -0,0 +1,119 @@
+// Testing micrograd/quantized.h implementation
+//
+#include <algorithm>
+#include <assert.h>
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "quantized.h"
+
+// n samples of n_inputs in [-amplitude, amplitude]
+static std::vector<float> samples(int n, int n_inputs, float amplitude)
+{
+    std::vector<float> x(static_cast<size_t>(n) * n_inputs);
+    for (size_t i = 0; i < x.size(); i++) {
+        x[i] = amplitude * std::sin(0.77f * i + 0.1f * (i % 7));
+    }
+    return x;
+}
+
+void test_quantization()
+{
+    MLP mlp(20, { 16, 16, 4 }, Init::Xavier, 7);
+    std::vector<float> calibration = samples(300, 20, 2.0f);
+    QuantizedMLP quantized(mlp, calibration.data(), 300);
+    assert(quantized.n_inputs == 20 && quantized.n_outputs == 4);
+
+    // The first layer's scale maps the largest calibration input to 127;
+    // hidden ones see tanh outputs
+    float max_abs = 0.0f;
+    for (float v : calibration) {
+        max_abs = std::max(max_abs, std::fabs(v));
+    }
+    assert(quantized.get_input_scale(0) == max_abs / 127.0f);
+    assert(quantized.get_input_scale(1) > 0.0f && quantized.get_input_scale(1) <= 1.0f / 127.0f);
+
+    // int8 weights, plus a float scale and bias per neuron
+    size_t float_bytes = mlp.get_parameters().size * sizeof(float);
+    assert(quantized.get_weight_bytes() == (20 * 16 + 16 * 16 + 16 * 4) + 2 * (16 + 16 + 4) * sizeof(float));
+    assert(quantized.get_weight_bytes() * 2 < float_bytes);
+
+    // Close to the float path, one sample at a time and batched alike
+    std::vector<float> x = samples(50, 20, 1.5f);
+    std::vector<float> expected(50 * 4), batched(50 * 4), single(4);
+    mlp.predict(x.data(), expected.data(), 50);
+    quantized.predict(x.data(), batched.data(), 50);
+    for (int r = 0; r < 50; r++) {
+        quantized.predict(x.data() + r * 20, single.data());
+        for (int c = 0; c < 4; c++) {
+            assert(single[c] == batched[r * 4 + c]);
+            assert(std::fabs(batched[r * 4 + c] - expected[r * 4 + c]) < 0.05f);
+        }
+    }
+
+    // Inputs past the calibrated range are clamped to it
+    std::vector<float> large(20, 100.0f), clamped(20, max_abs), a(4), b(4);
+    quantized.predict(large.data(), a.data());
+    quantized.predict(clamped.data(), b.data());
+    assert(a == b);
+
+    bool threw = false;
+    try {
+        QuantizedMLP empty(mlp, calibration.data(), 0);
+    } catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    assert(threw);
+}
+
+void test_accuracy_report()
+{
+    // Train a classifier of which input is the largest, then compare paths
+    const int n = 512, n_inputs = 8, n_classes = 4;
+    std::vector<float> x = samples(n, n_inputs, 1.0f);
+    std::vector<float> targets(n * n_classes, -1.0f);
+    for (int r = 0; r < n; r++) {
+        int best = 0;
+        for (int c = 1; c < n_classes; c++) {
+            best = x[r * n_inputs + c] > x[r * n_inputs + best] ? c : best;
+        }
+        targets[r * n_classes + best] = 1.0f;
+    }
+    MLP mlp(n_inputs, { 32, n_classes }, Init::Xavier, 3);
+    Adam optimizer(mlp.get_parameters(), 0.01);
+    ThreadPool pool(2);
+    Matrix inputs(n, n_inputs), target_matrix(n, n_classes);
+    std::copy(x.begin(), x.end(), inputs.data());
+    std::copy(targets.begin(), targets.end(), target_matrix.data());
+    for (int step = 0; step < 300; step++) {
+        mlp.train_batch(inputs, target_matrix, pool);
+        optimizer.step();
+    }
+
+    QuantizedMLP quantized(mlp, x.data(), 128);
+    QuantizationReport report = measure_quantization(mlp, quantized, x.data(), n, targets.data());
+    assert(report.samples == static_cast<size_t>(n) && report.n_outputs == n_classes);
+    assert(report.max_abs_error < 0.1 && report.mean_abs_error < 0.02);
+    assert(report.mean_abs_error <= report.max_abs_error);
+    assert(report.argmax_agreement > 0.95);
+    assert(report.float_accuracy > 0.8);
+    assert(std::fabs(report.quantized_accuracy - report.float_accuracy) < 0.05);
+    assert(std::fabs(report.quantized_mse - report.float_mse) < 0.05);
+
+    std::ostringstream out;
+    report.write_report(out);
+    assert(out.str().find("accuracy") != std::string::npos);
+
+    // Without targets only the differences between the paths
+    QuantizationReport plain = measure_quantization(mlp, quantized, x.data(), n);
+    assert(!plain.has_targets && plain.max_abs_error == report.max_abs_error);
+}
+
+int main()
+{
+    test_quantization();
+    test_accuracy_report();
+}
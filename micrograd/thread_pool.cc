@@ -0,0 +1,89 @@
+// Implementations from thread_pool.h
+//
+
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(int n_threads)
+{
+    if (n_threads <= 0) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (int i = 1; i < n_threads; i++) {
+        threads.emplace_back([this]() { worker_loop(); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (std::thread& t : threads) {
+        t.join();
+    }
+}
+
+void ThreadPool::run_tasks(const std::function<void(int)>& fn)
+{
+    // Grab task indices until there are none left
+    for (int i = next_task.fetch_add(1); i < n_tasks; i = next_task.fetch_add(1)) {
+        fn(i);
+    }
+}
+
+void ThreadPool::worker_loop()
+{
+    uint64_t seen = 0;
+    while (true) {
+        const std::function<void(int)>* fn;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            work_ready.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            fn = job;
+            if (!fn) {
+                // woke up after that job was already finished
+                continue;
+            }
+            busy_workers++;
+        }
+        run_tasks(*fn);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy_workers--;
+        }
+        work_done.notify_one();
+    }
+}
+
+void ThreadPool::parallel_for(int n, const std::function<void(int)>& fn)
+{
+    if (threads.empty() || n <= 1) {
+        for (int i = 0; i < n; i++) {
+            fn(i);
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &fn;
+        n_tasks = n;
+        next_task.store(0);
+        generation++;
+    }
+    work_ready.notify_all();
+    run_tasks(fn);
+
+    // Workers that never woke up for this generation simply find no tasks
+    // left when they do; only the ones that joined have to be waited for
+    std::unique_lock<std::mutex> lock(mutex);
+    work_done.wait(lock, [&]() { return busy_workers == 0 && next_task.load() >= n_tasks; });
+    job = nullptr;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+// Fixed-size pool of worker threads for data-parallel work. parallel_for hands
+// out task indices to the workers and the calling thread, and returns once
+// every task is done. A pool of size 1 runs everything on the calling thread.
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+
+    // current job, published under the mutex with a new generation
+    const std::function<void(int)>* job = nullptr;
+    int n_tasks = 0;
+    std::atomic<int> next_task{0};
+    int busy_workers = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    void worker_loop();
+    void run_tasks(const std::function<void(int)>& fn);
+
+public:
+    // n_threads includes the calling thread; 0 means one per hardware thread
+    explicit ThreadPool(int n_threads = 0);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return static_cast<int>(threads.size()) + 1; }
+
+    // Run fn(0) ... fn(n - 1), possibly in parallel; blocks until all finish
+    void parallel_for(int n, const std::function<void(int)>& fn);
+};
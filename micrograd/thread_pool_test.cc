@@ -0,0 +1,48 @@
+// Testing micrograd/thread_pool.h implementation
+//
+#include <assert.h>
+#include <atomic>
+#include <vector>
+
+#include "thread_pool.h"
+
+void test_parallel_for_runs_every_task_once()
+{
+    for (int n_threads : { 1, 2, 4, 8 }) {
+        ThreadPool pool(n_threads);
+        assert(pool.size() == n_threads);
+        for (int round = 0; round < 200; round++) {
+            int n = round % 37;
+            std::vector<std::atomic<int>> hits(n);
+            pool.parallel_for(n, [&](int i) { hits[i]++; });
+            for (int i = 0; i < n; i++) {
+                assert(hits[i] == 1);
+            }
+        }
+    }
+}
+
+void test_parallel_for_sum()
+{
+    // Results written per task and summed afterwards do not depend on threads
+    ThreadPool pool(4);
+    std::vector<long> partial(64);
+    pool.parallel_for(64, [&](int i) {
+        long sum = 0;
+        for (int k = 0; k < 10000; k++) {
+            sum += i * k;
+        }
+        partial[i] = sum;
+    });
+    long total = 0;
+    for (long p : partial) {
+        total += p;
+    }
+    assert(total == 2016L * 49995000L);
+}
+
+int main()
+{
+    test_parallel_for_runs_every_task_once();
+    test_parallel_for_sum();
+}
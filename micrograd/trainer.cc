@@ -0,0 +1,191 @@
+// Implementations from trainer.h
+
+#include "trainer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+const char* stage_name(Stage stage)
+{
+    static const char* names[] = { "load", "compute", "update", "hook" };
+    static_assert(sizeof(names) / sizeof(names[0]) == static_cast<size_t>(Stage::Count),
+                  "every stage needs a name");
+    return names[static_cast<size_t>(stage)];
+}
+
+double TrainerStats::utilization(Stage stage) const
+{
+    return wall_ns ? static_cast<double>(stages[static_cast<size_t>(stage)].busy_ns) / wall_ns : 0.0;
+}
+
+static uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Trainer::Trainer(MLP& mlp, Optimizer& optimizer, ThreadPool& pool, TrainerOptions options)
+    : mlp(mlp), optimizer(optimizer), pool(pool), options(options)
+{
+    if (options.queue_depth < 1) {
+        throw std::invalid_argument("queue_depth must be at least 1");
+    }
+}
+
+void Trainer::fail(std::exception_ptr e)
+{
+    {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) {
+            error = e;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(update_mutex);
+        aborted = true;
+    }
+    update_done.notify_all();
+}
+
+size_t Trainer::run(const Source& source)
+{
+    stats = TrainerStats{};
+    n_updated = 0;
+    aborted = false;
+    error = nullptr;
+
+    // Batch buffers cycle load -> compute -> free -> load; one more than the
+    // queue holds so load can fill while compute works on another
+    std::vector<Batch> batches(options.queue_depth + 1);
+    BoundedQueue<size_t> free_batches(batches.size());
+    BoundedQueue<size_t> loaded(options.queue_depth);
+    BoundedQueue<StepInfo> computed(options.queue_depth);
+    BoundedQueue<StepInfo> updated(options.queue_depth);
+    for (size_t i = 0; i < batches.size(); i++) {
+        free_batches.push(i);
+    }
+    auto close_all = [&]() {
+        free_batches.close();
+        loaded.close();
+        computed.close();
+        updated.close();
+    };
+
+    // Runs body for one stage, charging the time in it as busy and the rest
+    // of the loop (queue waits) as idle
+    auto stage_thread = [&](Stage stage, auto body) {
+        return std::thread([&, stage, body]() mutable {
+            TrainerStats::StageTime& time = stats.stages[static_cast<size_t>(stage)];
+            try {
+                uint64_t start = now_ns();
+                body([&](auto&& work) {
+                    uint64_t begin = now_ns();
+                    work();
+                    time.busy_ns += now_ns() - begin;
+                });
+                time.idle_ns = now_ns() - start - time.busy_ns;
+            } catch (...) {
+                fail(std::current_exception());
+                close_all();
+            }
+        });
+    };
+
+    uint64_t start = now_ns();
+    std::thread load = stage_thread(Stage::Load, [&](auto busy) {
+        size_t slot;
+        while (free_batches.pop(slot)) {
+            bool more;
+            busy([&]() { more = source(batches[slot]); });
+            if (!more || !loaded.push(slot)) {
+                break;
+            }
+        }
+        loaded.close();
+    });
+    std::thread compute = stage_thread(Stage::Compute, [&](auto busy) {
+        size_t slot;
+        for (size_t step = 0; loaded.pop(slot); step++) {
+            {
+                // the parameters of the previous step must be final
+                std::unique_lock<std::mutex> lock(update_mutex);
+                update_done.wait(lock, [&]() { return aborted || n_updated == step; });
+                if (aborted) {
+                    break;
+                }
+            }
+            const Batch& batch = batches[slot];
+            StepInfo info{step, batch.epoch, batch.inputs.get_rows(), 0.0f};
+            busy([&]() { info.loss = mlp.train_batch(batch.inputs, batch.targets, pool, options.loss); });
+            if (!free_batches.push(slot) || !computed.push(info)) {
+                break;
+            }
+        }
+        computed.close();
+    });
+    std::thread update = stage_thread(Stage::Update, [&](auto busy) {
+        StepInfo info;
+        while (computed.pop(info)) {
+            busy([&]() { optimizer.step(); });
+            {
+                std::lock_guard<std::mutex> lock(update_mutex);
+                n_updated++;
+            }
+            update_done.notify_all();
+            if (!updated.push(info)) {
+                break;
+            }
+        }
+        updated.close();
+    });
+    std::thread hook_stage = stage_thread(Stage::Hook, [&](auto busy) {
+        StepInfo info;
+        while (updated.pop(info)) {
+            if (hook) {
+                busy([&]() { hook(info); });
+            }
+            stats.steps++;
+        }
+    });
+
+    load.join();
+    compute.join();
+    update.join();
+    hook_stage.join();
+    stats.wall_ns = now_ns() - start;
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return stats.steps;
+}
+
+size_t Trainer::run(BatchLoader& loader, int n_epochs)
+{
+    int epoch = 0;
+    return run([&](Batch& batch) {
+        while (epoch < n_epochs) {
+            if (loader.next(batch)) {
+                return true;
+            }
+            epoch++;
+        }
+        return false;
+    });
+}
+
+void Trainer::write_report(std::ostream& out) const
+{
+    char line[128];
+    std::snprintf(line, sizeof(line), "%zu steps in %.3f ms\n", stats.steps, stats.wall_ns / 1e6);
+    out << line;
+    for (size_t s = 0; s < static_cast<size_t>(Stage::Count); s++) {
+        const TrainerStats::StageTime& time = stats.stages[s];
+        std::snprintf(line, sizeof(line), "%-8s busy %10.3f ms  idle %10.3f ms  %5.1f%%\n",
+                      stage_name(static_cast<Stage>(s)), time.busy_ns / 1e6, time.idle_ns / 1e6,
+                      100.0 * stats.utilization(static_cast<Stage>(s)));
+        out << line;
+    }
+}
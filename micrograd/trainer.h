@@ -0,0 +1,166 @@
+#pragma once
+
+// Pipelined training driver. A training step is split into stages that run
+// on their own threads and hand work to each other through bounded queues:
+//   load     fill a batch buffer from the source (a BatchLoader or a callback)
+//   compute  forward, loss and backward of the batch (MLP::train_batch)
+//   update   the optimizer step, which also zeroes the gradients
+//   hook     the step hook, with the step's loss
+// Loading of the next batches and the hook of earlier steps overlap with
+// compute and update. Compute of step N + 1 still waits for the update of
+// step N, so the parameters go through exactly the same sequence as in the
+// serial loop; none of step N + 1's forward, graph setup included, runs
+// while step N's backward or update does (the update writes the weights
+// that forward reads and zeroes the grads backward adds to). What the
+// pipeline gains is the source's and the hook's time: with no I/O it runs
+// at the serial loop's speed, while a source and hook waiting 0.7 ms per
+// step on a 1.4 ms step run about 1.5x faster (dataset_bench, pipeline).
+// The time every stage spends working and waiting is recorded and shows
+// where the pipeline stalls.
+
+#include "dataset.h"
+#include "nn.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <ostream>
+
+// Fixed-capacity queue between two stages. push blocks while the queue is
+// full and pop while it is empty; after close, push fails and pop drains
+// what is left.
+template <typename T>
+class BoundedQueue
+{
+private:
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [&]() { return closed || items.size() < capacity; });
+        if (closed) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        lock.unlock();
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [&]() { return closed || !items.empty(); });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        lock.unlock();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+};
+
+enum class Stage : uint8_t { Load, Compute, Update, Hook, Count };
+
+const char* stage_name(Stage stage);
+
+struct TrainerOptions {
+    Loss loss = Loss::MSE;
+    // Batches loaded ahead of compute
+    int queue_depth = 2;
+};
+
+// What the hook sees of a finished step
+struct StepInfo {
+    size_t step;
+    size_t epoch;
+    int rows;
+    float loss;
+};
+
+struct TrainerStats {
+    struct StageTime {
+        uint64_t busy_ns = 0;
+        // waiting for input, for room in the next queue, or (compute) for
+        // the previous update
+        uint64_t idle_ns = 0;
+    };
+    StageTime stages[static_cast<size_t>(Stage::Count)];
+    uint64_t wall_ns = 0;
+    size_t steps = 0;
+
+    // Fraction of the run the stage spent working
+    double utilization(Stage stage) const;
+};
+
+class Trainer
+{
+public:
+    // Fills a batch and returns true, or returns false when there is no more data
+    using Source = std::function<bool(Batch&)>;
+    using Hook = std::function<void(const StepInfo&)>;
+
+private:
+    MLP& mlp;
+    Optimizer& optimizer;
+    ThreadPool& pool;
+    TrainerOptions options;
+    Hook hook;
+    TrainerStats stats;
+
+    // steps whose update is done; compute of step n waits for n
+    std::mutex update_mutex;
+    std::condition_variable update_done;
+    size_t n_updated = 0;
+    bool aborted = false;
+
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    void fail(std::exception_ptr e);
+
+public:
+    // The model, optimizer (over the model's parameters) and pool must
+    // outlive the trainer; compute runs train_batch on the pool
+    Trainer(MLP& mlp, Optimizer& optimizer, ThreadPool& pool, TrainerOptions options = {});
+
+    // Called on the hook stage after every step, in step order. It runs
+    // while later steps train, so it must not touch the model.
+    void set_hook(Hook hook) { this->hook = std::move(hook); }
+
+    // Train on every batch of source; returns the number of steps. An
+    // exception thrown by any stage stops the pipeline and is rethrown here.
+    size_t run(const Source& source);
+    // Train for n_epochs epochs of the loader. The loader's batches are
+    // swapped into the pipeline's buffers, not copied.
+    size_t run(BatchLoader& loader, int n_epochs);
+
+    // Stage times of the last run
+    const TrainerStats& get_stats() const { return stats; }
+    // One line per stage: busy and idle milliseconds and utilization
+    void write_report(std::ostream& out) const;
+};
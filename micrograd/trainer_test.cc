@@ -0,0 +1,154 @@
+// Testing micrograd/trainer.h implementation
+//
+#include <assert.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trainer.h"
+
+static const std::string dataset_path = "/tmp/micrograd_trainer_test.bin";
+
+// y = x0 * x1 over a grid, 200 samples
+static Dataset write_dataset()
+{
+    {
+        DatasetWriter writer(dataset_path, 2, 1);
+        for (int i = 0; i < 200; i++) {
+            float x[2] = { std::sin(0.37f * i), std::cos(0.91f * i) };
+            float y = x[0] * x[1];
+            writer.add(x, &y);
+        }
+    }
+    return Dataset::open(dataset_path);
+}
+
+void test_bounded_queue()
+{
+    BoundedQueue<int> queue(2);
+    std::thread producer([&]() {
+        for (int i = 0; i < 1000; i++) {
+            queue.push(i);
+        }
+        queue.close();
+    });
+    int expected = 0, item;
+    while (queue.pop(item)) {
+        assert(item == expected++);
+    }
+    producer.join();
+    assert(expected == 1000);
+    assert(!queue.push(1));
+}
+
+void test_matches_serial_loop()
+{
+    // The pipeline applies the same updates in the same order as the plain loop
+    Dataset dataset = write_dataset();
+    LoaderOptions loader_options;
+    loader_options.batch_size = 16;
+    loader_options.seed = 11;
+    ThreadPool pool(2);
+
+    MLP serial(2, { 8, 1 }, Init::Xavier, 4);
+    Adam serial_optimizer(serial.get_parameters(), 0.01);
+    BatchLoader serial_loader(dataset, loader_options);
+    std::vector<float> serial_losses;
+    for (int epoch = 0; epoch < 5; epoch++) {
+        while (const Batch* batch = serial_loader.next()) {
+            serial_losses.push_back(serial.train_batch(batch->inputs, batch->targets, pool));
+            serial_optimizer.step();
+        }
+    }
+
+    MLP pipelined(2, { 8, 1 }, Init::Xavier, 4);
+    Adam optimizer(pipelined.get_parameters(), 0.01);
+    BatchLoader loader(dataset, loader_options);
+    Trainer trainer(pipelined, optimizer, pool);
+    std::vector<StepInfo> steps;
+    trainer.set_hook([&](const StepInfo& info) { steps.push_back(info); });
+    size_t n_steps = trainer.run(loader, 5);
+
+    assert(n_steps == 5 * loader.batches_per_epoch());
+    assert(steps.size() == n_steps);
+    for (size_t i = 0; i < n_steps; i++) {
+        assert(steps[i].step == i);
+        assert(steps[i].epoch == i / loader.batches_per_epoch());
+        assert(steps[i].loss == serial_losses[i]);
+    }
+    assert(steps.back().rows == 200 % 16);
+    Parameters a = serial.get_parameters(), b = pipelined.get_parameters();
+    assert(std::memcmp(a.data, b.data, a.size * sizeof(float)) == 0);
+    assert(serial_losses.back() < serial_losses.front());
+
+    const TrainerStats& stats = trainer.get_stats();
+    assert(stats.steps == n_steps);
+    for (size_t s = 0; s < static_cast<size_t>(Stage::Count); s++) {
+        double utilization = stats.utilization(static_cast<Stage>(s));
+        assert(utilization >= 0.0 && utilization <= 1.0);
+    }
+    assert(stats.stages[static_cast<size_t>(Stage::Compute)].busy_ns > 0);
+    std::ostringstream report;
+    trainer.write_report(report);
+    assert(report.str().find("compute") != std::string::npos);
+    std::remove(dataset_path.c_str());
+}
+
+void test_errors_stop_the_pipeline()
+{
+    MLP mlp(2, { 4, 1 }, Init::He, 1);
+    SGD optimizer(mlp.get_parameters(), 0.01);
+    ThreadPool pool(1);
+    Trainer trainer(mlp, optimizer, pool);
+
+    // from the source
+    int n = 0;
+    auto source = [&](Batch& batch) {
+        if (n++ == 7) {
+            throw std::runtime_error("source failed");
+        }
+        batch.inputs = Matrix(4, 2, 0.5f);
+        batch.targets = Matrix(4, 1, 0.1f);
+        return true;
+    };
+    bool threw = false;
+    try {
+        trainer.run(source);
+    } catch (const std::runtime_error& e) {
+        threw = std::string(e.what()) == "source failed";
+    }
+    assert(threw);
+
+    // from the hook, after which the trainer can run again; the source is
+    // kept far from failing, it may run ahead of the hook
+    n = -1000;
+    trainer.set_hook([](const StepInfo& info) {
+        if (info.step == 2) {
+            throw std::logic_error("hook failed");
+        }
+    });
+    threw = false;
+    try {
+        trainer.run(source);
+    } catch (const std::logic_error&) {
+        threw = true;
+    }
+    assert(threw);
+    trainer.set_hook(nullptr);
+    n = 0;
+    int limit = 0;
+    size_t steps = trainer.run([&](Batch& batch) { return limit++ < 3 && source(batch); });
+    assert(steps == 3);
+}
+
+int main()
+{
+    test_bounded_queue();
+    test_matches_serial_loop();
+    test_errors_stop_the_pipeline();
+}